@@ -0,0 +1,244 @@
+#ifndef GRID_H
+#define GRID_H
+
+#include <cmath>
+#include <cstdlib>
+#include <unordered_map>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+/**
+ * Cells that became empty are kept, with their neighbour links and member
+ * storage, until there are this many more empty cells than occupied ones.
+ * Then the grid is rebuilt.
+ */
+#ifndef GRID_POOLED_CELLS
+#define GRID_POOLED_CELLS 4096
+#endif
+
+/**
+ * Lookup nearby particles in time O(1) (on average) by keeping track of the
+ * cell membership of each particle.
+ *
+ * - Cells are identified by CellID, a std::tuple<int,int,int> representing
+ *   their location in 3d, and stored in slots. std::unordered_map maps the
+ *   CellID to the slot with average lookup time O(1).
+ * - A slot holds the ids of the cell's members in a std::vector, and the
+ *   slots of the 27 cells around it (itself included), -1 if such a cell
+ *   has no slot. The links are set when a slot is created, so finding the
+ *   neighbours of a cell needs no hashing.
+ * - Cells that become empty keep their slot, so bodies that leave and come
+ *   back, as in vibrating systems, neither allocate nor hash.
+ *
+ * The grid is maintained incrementally. Every body keeps its slack, a lower
+ * bound of the distance to the faces of its cell. moved() subtracts the
+ * largest coordinate change of the step, and only bodies whose slack runs
+ * out have their cell computed. Those that left their cell are queued, and
+ * applyMoves() moves them all at once after the drift.
+*/
+
+struct Grid{
+  typedef std::tuple<int,int,int> CellID;
+  double cell_size;
+
+  Grid() : cell_size(1.0), numberOfSlots(0), occupied(0), checks(0), migrations(0), rebuilds(0) {};
+  Grid(double cell_size) :
+    cell_size(cell_size), numberOfSlots(0), occupied(0), checks(0), migrations(0), rebuilds(0) {};
+
+  /**
+   * The coordinates are multiplied by large primes before they are
+   * combined, as x^y^z maps all cells of a plane x+y+z=const, and many
+   * more, to few buckets.
+   */
+  struct hash{
+    size_t operator()(const CellID& x) const {
+      return (static_cast<size_t>(std::get<0>(x)) * 73856093u) ^
+             (static_cast<size_t>(std::get<1>(x)) * 19349663u) ^
+             (static_cast<size_t>(std::get<2>(x)) * 83492791u);
+    }
+  };
+
+  std::unordered_map<CellID, int, hash> slots;
+
+  /**
+   * Slots [0, numberOfSlots) are in use, occupied of them are not empty.
+   * The vectors may be longer, to keep the storage of former slots.
+   */
+  int                           numberOfSlots;
+  int                           occupied;
+  std::vector<CellID>           cellIDs;
+  std::vector<std::vector<int>> members;
+  std::vector<int>              adjacency;
+
+  /**
+   * Per body: slot, position in the slot's members, and slack.
+   */
+  std::vector<int>    cellOf, positionInCell;
+  std::vector<double> slack;
+
+  /**
+   * Bodies that left their cell during this step, and their new cell.
+   */
+  std::vector<std::pair<int,CellID>> moves;
+
+  /**
+   * Totals since the grid was built: bodies whose cell was computed,
+   * bodies moved to another cell, and rebuilds due to empty cells.
+   */
+  long checks, migrations, rebuilds;
+
+  CellID coordsToCellID(double x, double y, double z){
+    CellID r = {
+      std::floor(x/cell_size),
+      std::floor(y/cell_size),
+      std::floor(z/cell_size)
+    };
+    return  r;
+  }
+
+  /**
+   * Put the bodies into their cells from scratch. The storage of the
+   * former slots is reused.
+   */
+  void build(int numberOfBodies, const double* x, const double* y, const double* z){
+    slots.clear();
+    for (int s = 0; s < numberOfSlots; ++s) members[s].clear();
+    numberOfSlots = 0;
+    occupied      = 0;
+    moves.clear();
+
+    cellOf.resize(numberOfBodies);
+    positionInCell.resize(numberOfBodies);
+    slack.resize(numberOfBodies);
+    for (int i = 0; i < numberOfBodies; ++i){
+      CellID cid = coordsToCellID(x[i], y[i], z[i]);
+      insert(i, slotOf(cid));
+      slack[i] = slackOf(x[i], y[i], z[i], cid);
+    }
+  }
+
+  /**
+   * Body i is now at (x,y,z), and no coordinate changed by more than
+   * step since the last call.
+   */
+  inline void moved(int i, double x, double y, double z, double step){
+    slack[i] -= step;
+    if (slack[i] >= 0) return;
+
+    checks++;
+    CellID cid = coordsToCellID(x, y, z);
+    slack[i] = slackOf(x, y, z, cid);
+    if (!(cid == cellIDs[cellOf[i]])) moves.push_back(std::make_pair(i, cid));
+  }
+
+  /**
+   * Move the queued bodies to their new cells. Rebuilds the grid from the
+   * positions if too many cells are empty.
+   */
+  void applyMoves(const double* x, const double* y, const double* z){
+    for (size_t k = 0; k < moves.size(); ++k){
+      const int i = moves[k].first;
+      remove(i);
+      insert(i, slotOf(moves[k].second));
+    }
+    migrations += moves.size();
+    moves.clear();
+
+    if (numberOfSlots - occupied > occupied + GRID_POOLED_CELLS){
+      rebuilds++;
+      build(cellOf.size(), x, y, z);
+    }
+  }
+
+  /**
+   * Put body i into cell cid, for grids that are filled from scratch
+   * every step rather than maintained.
+   */
+  void add(int i, const CellID& cid){
+    if (i >= static_cast<int>(cellOf.size())){
+      cellOf.resize(i+1);
+      positionInCell.resize(i+1);
+    }
+    insert(i, slotOf(cid));
+  }
+
+  /**
+   * Members of cell cid, nullptr if the cell has no slot.
+   */
+  const std::vector<int>* find(const CellID& cid) const {
+    auto found = slots.find(cid);
+    return found == slots.end() ? nullptr : &members[found->second];
+  }
+
+private:
+  /**
+   * Slot of the cell, created and linked to its neighbours if the cell has
+   * none yet.
+   */
+  int slotOf(const CellID& cid){
+    auto found = slots.find(cid);
+    if (found != slots.end()) return found->second;
+
+    const int s = numberOfSlots++;
+    slots.emplace(cid, s);
+    if (static_cast<int>(members.size()) < numberOfSlots){
+      members.emplace_back();
+      cellIDs.push_back(cid);
+    }
+    cellIDs[s] = cid;
+    adjacency.resize(27*numberOfSlots);
+
+    int cx,cy,cz;
+    std::tie(cx,cy,cz) = cid;
+    for (int d = 0; d < 27; ++d){
+      auto neighbour = slots.find(CellID(cx + d/9-1, cy + d/3%3-1, cz + d%3-1));
+      const int t = neighbour == slots.end() ? -1 : neighbour->second;
+      adjacency[27*s + d] = t;
+      if (t >= 0) adjacency[27*t + 26-d] = s;
+    }
+    return s;
+  }
+
+  void insert(int i, int s){
+    if (members[s].empty()) occupied++;
+    cellOf[i]         = s;
+    positionInCell[i] = members[s].size();
+    members[s].push_back(i);
+  }
+
+  /**
+   * Remove body i from its cell, filling the gap with the last member.
+   */
+  void remove(int i){
+    std::vector<int>& cell = members[cellOf[i]];
+    const int last = cell.back();
+    cell[positionInCell[i]] = last;
+    positionInCell[last]    = positionInCell[i];
+    cell.pop_back();
+    if (cell.empty()) occupied--;
+  }
+
+  /**
+   * Distance of (x,y,z) to the nearest face of cell cid, less a margin for
+   * the rounding of the cell coordinates.
+   */
+  double slackOf(double x, double y, double z, const CellID& cid){
+    const double lx = std::get<0>(cid)*cell_size;
+    const double ly = std::get<1>(cid)*cell_size;
+    const double lz = std::get<2>(cid)*cell_size;
+    double s = std::min(std::min(x-lx, lx+cell_size-x),
+               std::min(std::min(y-ly, ly+cell_size-y),
+                        std::min(z-lz, lz+cell_size-z)));
+    return s - 1e-9*cell_size;
+  }
+};
+inline bool operator==(const Grid::CellID& lhs, const Grid::CellID& rhs) {
+  return (
+     std::get<0>(lhs) == std::get<0>(rhs) &&
+     std::get<1>(lhs) == std::get<1>(rhs) &&
+     std::get<2>(lhs) == std::get<2>(rhs)
+    );
+}
+
+#endif
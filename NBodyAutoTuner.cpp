@@ -0,0 +1,267 @@
+#include "NBodyAutoTuner.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include <omp.h>
+
+/**
+ * Largest number of pairs per time step of a probe. Larger systems are
+ * timed on an evenly spaced subset of their bodies and tracers, and the
+ * time is scaled up by the number of pairs.
+ */
+#ifndef AUTOTUNER_PAIR_BUDGET
+#define AUTOTUNER_PAIR_BUDGET (1 << 24)
+#endif
+
+namespace {
+  /**
+   * A configuration is timed for at least this long, or ten steps.
+   */
+  const double MinimumMeasurementTime = 0.05;
+  const int    MaximumMeasurementSteps = 10;
+
+  const int TracerTiles[] = { 128, 256, 512, 1024, 2048 };
+
+  /**
+   * Pairs of bodies and of bodies and tracers per time step, with the
+   * three force evaluations of the Yoshida integrator.
+   */
+  double pairsPerStep (const NBodySimulation& s, int bodies, int tracers) {
+    const double evaluations = s.integrator == NBodySimulation::Yoshida4 ? 3 : 1;
+    return evaluations*bodies*(static_cast<double>(bodies) + tracers);
+  }
+}
+
+NBodyAutoTuner::NBodyAutoTuner (const std::string& cacheFile) :
+  _cacheFile(cacheFile), _maxThreads(omp_get_max_threads()), _tunedBucket(-1) {
+  if (_cacheFile.empty()) {
+    const char* value = std::getenv("NBODY_TUNING_CACHE");
+    _cacheFile = value != nullptr ? value : "nbody-tuning.cache";
+  }
+}
+
+std::string NBodyAutoTuner::cpuModel () {
+  std::ifstream cpuinfo("/proc/cpuinfo");
+  std::string line;
+  while (std::getline(cpuinfo, line)) {
+    if (line.compare(0, 10, "model name") == 0) {
+      size_t colon = line.find(':');
+      if (colon != std::string::npos) {
+        return line.substr(line.find_first_not_of(" \t", colon+1));
+      }
+    }
+  }
+  return "unknown";
+}
+
+/**
+ * floor(log2(n)), and 0 for no bodies.
+ */
+int NBodyAutoTuner::bucket (int n) {
+  int b = 0;
+  while (n > 1) {
+    n >>= 1;
+    b++;
+  }
+  return b;
+}
+
+const char* NBodyAutoTuner::kernelName (NBodyEngine::Kernel kernel) {
+  switch (kernel) {
+    case NBodyEngine::Scalar:          return "scalar";
+    case NBodyEngine::MolecularForces: return "molecular-forces";
+    case NBodyEngine::Vectorised:      return "vectorised";
+    case NBodyEngine::Parallelised:    return "parallel";
+    case NBodyEngine::ParticleMesh:    return "particle-mesh";
+    case NBodyEngine::Respa:           return "respa";
+  }
+  return "unknown";
+}
+
+std::string NBodyAutoTuner::key (const NBodyEngine& engine) const {
+  std::ostringstream k;
+  k << cpuModel()
+    << '\t' << _maxThreads
+    << '\t' << bucket(engine.simulation().NumberOfBodies)
+    << '\t' << bucket(engine.simulation().NumberOfTracers);
+  return k.str();
+}
+
+/**
+ * Each line of the cache holds the four key fields and the kernel, thread
+ * count, tile and time per step, separated by tabs. Later lines win.
+ */
+bool NBodyAutoTuner::lookUp (const std::string& key, Configuration& configuration) const {
+  std::ifstream in(_cacheFile.c_str());
+  std::string line;
+  bool found = false;
+  while (std::getline(in, line)) {
+    if (line.compare(0, key.size(), key) != 0 || line.size() <= key.size() ||
+        line[key.size()] != '\t') continue;
+
+    std::istringstream values(line.substr(key.size()+1));
+    int kernel;
+    Configuration c;
+    if (values >> kernel >> c.threads >> c.tracerSourceTile >> c.secondsPerStep &&
+        (kernel == NBodyEngine::Scalar || kernel == NBodyEngine::Vectorised ||
+         kernel == NBodyEngine::Parallelised) &&
+        c.threads >= 1 && c.threads <= _maxThreads && c.tracerSourceTile >= 1) {
+      c.kernel = static_cast<NBodyEngine::Kernel>(kernel);
+      configuration = c;
+      found = true;
+    }
+  }
+  return found;
+}
+
+void NBodyAutoTuner::store (const std::string& key, const Configuration& configuration) const {
+  std::ofstream out(_cacheFile.c_str(), std::ios::app);
+  if (!out) {
+    std::cerr << "warning: cannot write tuning cache " << _cacheFile << std::endl;
+    return;
+  }
+  out << key
+      << '\t' << static_cast<int>(configuration.kernel)
+      << '\t' << configuration.threads
+      << '\t' << configuration.tracerSourceTile
+      << '\t' << configuration.secondsPerStep << std::endl;
+}
+
+double NBodyAutoTuner::measure (const NBodyEngine& engine,
+                                const Configuration& configuration,
+                                double giveUpAbove) const {
+  const NBodySimulation& s = engine.simulation();
+
+  // an evenly spaced subset of the bodies and tracers within the pair budget
+  const double full  = pairsPerStep(s, s.NumberOfBodies, s.NumberOfTracers);
+  const double share = full > AUTOTUNER_PAIR_BUDGET ? std::sqrt(AUTOTUNER_PAIR_BUDGET/full) : 1.0;
+  const int bodies  = std::max(1, static_cast<int>(share*s.NumberOfBodies));
+  const int tracers = static_cast<int>(share*s.NumberOfTracers);
+  const int n       = bodies + tracers;
+  const double scale = full/pairsPerStep(s, bodies, tracers);
+
+  // the engine takes the tracers as bodies of mass 0
+  std::vector<double> x(n), y(n), z(n), vx(n), vy(n), vz(n), m(n, 0.0);
+  for (int k = 0; k < bodies; ++k) {
+    const int i = static_cast<int>(static_cast<long>(k)*s.NumberOfBodies/bodies);
+    x[k]  = s.xx[i]; y[k]  = s.xy[i]; z[k]  = s.xz[i];
+    vx[k] = s.vx[i]; vy[k] = s.vy[i]; vz[k] = s.vz[i];
+    m[k]  = s.m[i];
+  }
+  for (int k = 0; k < tracers; ++k) {
+    const int i = static_cast<int>(static_cast<long>(k)*s.NumberOfTracers/tracers);
+    x[bodies+k]  = s.txx[i]; y[bodies+k]  = s.txy[i]; z[bodies+k]  = s.txz[i];
+    vx[bodies+k] = s.tvx[i]; vy[bodies+k] = s.tvy[i]; vz[bodies+k] = s.tvz[i];
+  }
+
+  NBodyEngine probe(configuration.kernel);
+  probe.create(n, x.data(), y.data(), z.data(), vx.data(), vy.data(), vz.data(),
+               m.data(), s.timeStepSize);
+  probe.simulation().C                = s.C;
+  probe.simulation().integrator       = s.integrator;
+  probe.simulation().reproducible     = s.reproducible;
+  probe.simulation().tracerSourceTile = configuration.tracerSourceTile;
+  omp_set_num_threads(configuration.threads);
+
+  // the first step includes the initial force evaluation, so it may take
+  // twice as long as the others
+  auto start = std::chrono::steady_clock::now();
+  probe.advance(1);
+  const double warmUp = scale*std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  if (warmUp > 2*giveUpAbove) return warmUp/2;
+
+  double seconds = 0;
+  int    steps   = 0;
+  while (seconds < MinimumMeasurementTime && steps < MaximumMeasurementSteps) {
+    start = std::chrono::steady_clock::now();
+    probe.advance(1);
+    seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    steps++;
+    if (scale*seconds/steps > giveUpAbove) break;
+  }
+  return scale*seconds/steps;
+}
+
+NBodyAutoTuner::Configuration NBodyAutoTuner::calibrate (const NBodyEngine& engine) const {
+  // the widest configuration first, so the bound for the slower ones is
+  // tight from the start
+  std::vector<Configuration> candidates;
+  Configuration c = { NBodyEngine::Parallelised, _maxThreads, engine.simulation().tracerSourceTile, 0 };
+  candidates.push_back(c);
+  int threads = 1;
+  while (2*threads < _maxThreads) threads *= 2;
+  for (; threads >= 1; threads /= 2) {
+    if (threads == _maxThreads) continue;
+    c.threads = threads;
+    candidates.push_back(c);
+  }
+  c.threads = 1;
+  c.kernel  = NBodyEngine::Vectorised;
+  candidates.push_back(c);
+  c.kernel  = NBodyEngine::Scalar;
+  candidates.push_back(c);
+
+  Configuration best = candidates[0];
+  best.secondsPerStep = std::numeric_limits<double>::max();
+  for (size_t k = 0; k < candidates.size(); ++k) {
+    candidates[k].secondsPerStep = measure(engine, candidates[k], 2*best.secondsPerStep);
+    if (candidates[k].secondsPerStep < best.secondsPerStep) best = candidates[k];
+  }
+
+  // the tile only matters for the tracer kernel of steps 3 and 4
+  if (engine.simulation().NumberOfTracers > 0 && best.kernel != NBodyEngine::Scalar) {
+    Configuration winner = best;
+    for (size_t k = 0; k < sizeof(TracerTiles)/sizeof(TracerTiles[0]); ++k) {
+      if (TracerTiles[k] == winner.tracerSourceTile) continue;
+      c = winner;
+      c.tracerSourceTile = TracerTiles[k];
+      c.secondsPerStep = measure(engine, c, 2*best.secondsPerStep);
+      if (c.secondsPerStep < best.secondsPerStep) best = c;
+    }
+  }
+
+  return best;
+}
+
+void NBodyAutoTuner::apply (NBodyEngine& engine, const Configuration& configuration) {
+  engine.switchKernel(configuration.kernel);
+  engine.simulation().tracerSourceTile = configuration.tracerSourceTile;
+  omp_set_num_threads(configuration.threads);
+}
+
+NBodyAutoTuner::Configuration NBodyAutoTuner::tune (NBodyEngine& engine) {
+  const std::string k = key(engine);
+  Configuration configuration;
+  bool cached = lookUp(k, configuration);
+  if (!cached) {
+    configuration = calibrate(engine);
+    store(k, configuration);
+  }
+  apply(engine, configuration);
+  _tunedBucket = bucket(engine.simulation().NumberOfBodies);
+
+  std::cout << "auto-tuner: " << engine.simulation().NumberOfBodies << " bodies";
+  if (engine.simulation().NumberOfTracers > 0) {
+    std::cout << " and " << engine.simulation().NumberOfTracers << " tracers";
+  }
+  std::cout << ", " << kernelName(configuration.kernel) << " kernel"
+            << ", " << configuration.threads << " threads";
+  if (engine.simulation().NumberOfTracers > 0) {
+    std::cout << ", tracer tile " << configuration.tracerSourceTile;
+  }
+  std::cout << ", " << configuration.secondsPerStep << " s per step"
+            << (cached ? " (cached)" : " (calibrated)") << std::endl;
+
+  return configuration;
+}
+
+bool NBodyAutoTuner::needsRetuning (const NBodyEngine& engine) const {
+  return _tunedBucket >= 0 && bucket(engine.simulation().NumberOfBodies) != _tunedBucket;
+}
@@ -0,0 +1,78 @@
+#ifndef NBODYAUTOTUNER_H
+#define NBODYAUTOTUNER_H
+
+#include <string>
+
+#include "NBodyEngine.h"
+
+/**
+ * Startup calibration of the all-pairs kernels.
+ *
+ * Which of the scalar (step 1), vectorised (step 3) and parallel (step 4)
+ * kernels is fastest depends on N and the machine: for a few hundred bodies
+ * the OpenMP overhead of step 4 outweighs its threads. The tuner runs a few
+ * time steps of a copy of the actual system with every kernel and thread
+ * count (powers of two up to the OpenMP maximum), widest first, and then,
+ * if there are tracers, with every tracer tile size for the winner. The
+ * engine is switched to the fastest configuration. Systems with more than
+ * AUTOTUNER_PAIR_BUDGET pairs per step are timed on an evenly spaced
+ * subset, and the times are scaled up to the whole system.
+ *
+ * Results are cached in a text file, by default nbody-tuning.cache in the
+ * working directory or the file named by NBODY_TUNING_CACHE, keyed on the
+ * CPU model, the maximum thread count and the power-of-two buckets of the
+ * numbers of bodies and tracers. Once the number of bodies leaves its
+ * bucket, e.g. after collisions, needsRetuning() returns true.
+ */
+class NBodyAutoTuner {
+public:
+  struct Configuration {
+    NBodyEngine::Kernel kernel;
+    int                 threads;
+    int                 tracerSourceTile;
+    double              secondsPerStep;
+  };
+
+  /**
+   * An empty file name selects the default cache file.
+   */
+  explicit NBodyAutoTuner (const std::string& cacheFile = "");
+
+  /**
+   * Look up or calibrate the configuration for the engine's current system
+   * and apply it.
+   */
+  Configuration tune (NBodyEngine& engine);
+
+  /**
+   * Time all candidate configurations on a copy of the engine's system.
+   */
+  Configuration calibrate (const NBodyEngine& engine) const;
+
+  static void apply (NBodyEngine& engine, const Configuration& configuration);
+
+  bool needsRetuning (const NBodyEngine& engine) const;
+
+  static std::string cpuModel ();
+  static int         bucket (int n);
+  static const char* kernelName (NBodyEngine::Kernel kernel);
+
+private:
+  std::string key (const NBodyEngine& engine) const;
+  bool lookUp (const std::string& key, Configuration& configuration) const;
+  void store (const std::string& key, const Configuration& configuration) const;
+
+  /**
+   * Seconds per time step of one configuration, or a value above
+   * giveUpAbove as soon as it is clear that it cannot win, including in
+   * the first step.
+   */
+  double measure (const NBodyEngine& engine, const Configuration& configuration,
+                  double giveUpAbove) const;
+
+  std::string _cacheFile;
+  int         _maxThreads;
+  int         _tunedBucket;
+};
+
+#endif
@@ -0,0 +1,234 @@
+#include "NBodyEngine.h"
+#include "NBodyAutoTuner.h"
+#include "NBodyError.h"
+#include "NBodyScenario.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iomanip>
+
+#include "NBodySimulationMolecularForces.cpp"
+#include "NBodySimulationParallelised.cpp"
+#include "NBodySimulationParticleMesh.cpp"
+#include "NBodySimulationRespa.cpp"
+
+namespace {
+  int runCommandLine (NBodyEngine::Kernel kernel, int argc, char** argv);
+
+  NBodySimulation* createSimulation (NBodyEngine::Kernel kernel) {
+    switch (kernel) {
+      case NBodyEngine::Scalar:          return new NBodySimulation();
+      case NBodyEngine::MolecularForces: return new NBodySimulationMolecularForces();
+      case NBodyEngine::Vectorised:      return new NBodySimulationVectorised();
+      case NBodyEngine::Parallelised:    return new NBodySimulationParallelised();
+      case NBodyEngine::ParticleMesh:    return new NBodySimulationParticleMesh();
+      case NBodyEngine::Respa:           return new NBodySimulationRespa();
+    }
+    return new NBodySimulation();
+  }
+}
+
+NBodyEngine::NBodyEngine (Kernel kernel) :
+  _kernel(kernel), _simulation(createSimulation(kernel)) {}
+
+NBodyEngine::~NBodyEngine () {
+  delete _simulation;
+}
+
+void NBodyEngine::create (int numberOfBodies,
+                          const double* xx, const double* xy, const double* xz,
+                          const double* vx, const double* vy, const double* vz,
+                          const double* m,
+                          double timeStepSize) {
+  NBodySimulation& s = *_simulation;
+  for (int i = 0; i < numberOfBodies; ++i) {
+    if (!(m[i] >= 0)) throw NBodyError() << "invalid mass";
+  }
+  const int numberOfTracers = std::count(m, m+numberOfBodies, 0.0);
+  if (numberOfTracers == numberOfBodies) {
+    throw NBodyError() << "at least one body needs a positive mass";
+  }
+  s.allocateBodies(numberOfBodies - numberOfTracers);
+  s.allocateTracers(numberOfTracers);
+
+  for (int i = 0, body = 0, tracer = 0; i < numberOfBodies; ++i) {
+    if (m[i] == 0.0) {
+      s.txx[tracer] = xx[i]; s.txy[tracer] = xy[i]; s.txz[tracer] = xz[i];
+      s.tvx[tracer] = vx[i]; s.tvy[tracer] = vy[i]; s.tvz[tracer] = vz[i];
+      s.tid[tracer] = i;
+      tracer++;
+    }
+    else {
+      s.xx[body] = xx[i]; s.xy[body] = xy[i]; s.xz[body] = xz[i];
+      s.vx[body] = vx[i]; s.vy[body] = vy[i]; s.vz[body] = vz[i];
+      s.m[body]  = m[i];
+      s.id[body] = i;
+      body++;
+    }
+  }
+
+  startRun(timeStepSize);
+}
+
+void NBodyEngine::createScenario (const std::string& scenario, int numberOfBodies,
+                                  uint64_t seed, double timeStepSize) {
+  NBodyScenario::generate(*_simulation, scenario, numberOfBodies, seed);
+  startRun(timeStepSize);
+}
+
+void NBodyEngine::startRun (double timeStepSize) {
+  NBodySimulation& s = *_simulation;
+  s.t               = 0;
+  s.timeStepSize    = timeStepSize;
+  s.timeStepCounter = 0;
+  s.forceEvaluations = 0;
+  s.referenceNumberOfBodies = 0;
+  s.driftAlarmRaised = false;
+  s.snapshotFilter.tFull = 0;
+  // Without a final time or a plot interval the run is driven by advance()
+  s.tFinal          = std::numeric_limits<double>::max();
+  s.tPlot           = std::numeric_limits<double>::max();
+  s.tPlotDelta      = 0;
+
+  prepareKernel();
+}
+
+void NBodyEngine::setUp (int argc, char** argv) {
+  _simulation->setUp(argc, argv);
+  prepareKernel();
+}
+
+void NBodyEngine::prepareKernel () {
+  if (_kernel == MolecularForces) {
+    static_cast<NBodySimulationMolecularForces*>(_simulation)->setUpGrid(CUTOFF_RADIUS);
+  }
+}
+
+void NBodyEngine::advance (int nSteps) {
+  for (int step = 0; step < nSteps; ++step) {
+    _simulation->updateBody();
+
+    for (size_t k = 0; k < _observers.size(); ++k) {
+      if (_simulation->timeStepCounter % _observers[k].everyNSteps == 0) {
+        _observers[k].observer(*this);
+      }
+    }
+  }
+}
+
+void NBodyEngine::addObserver (Observer observer, int everyNSteps) {
+  RegisteredObserver o = { observer, std::max(1, everyNSteps) };
+  _observers.push_back(o);
+}
+
+void NBodyEngine::switchKernel (Kernel kernel) {
+  if (kernel == _kernel) return;
+  if ((kernel  != Scalar && kernel  != Vectorised && kernel  != Parallelised) ||
+      (_kernel != Scalar && _kernel != Vectorised && _kernel != Parallelised)) {
+    throw NBodyError() << "kernels can only be switched between the all-pairs kernels"
+                          " of steps 1, 3 and 4";
+  }
+
+  NBodySimulation* simulation = createSimulation(kernel);
+  simulation->swapState(*_simulation);
+  delete _simulation;
+  _simulation = simulation;
+  _kernel     = kernel;
+}
+
+NBodyEngine::State NBodyEngine::state () const {
+  const NBodySimulation& s = *_simulation;
+  State r = {
+    s.NumberOfBodies, s.timeStepCounter, s.t,
+    s.xx, s.xy, s.xz,
+    s.vx, s.vy, s.vz,
+    s.m,
+    s.id,
+    s.NumberOfTracers,
+    s.txx, s.txy, s.txz,
+    s.tvx, s.tvy, s.tvz,
+    s.tid
+  };
+  return r;
+}
+
+bool NBodyEngine::hasReachedEnd () const {
+  return _simulation->hasReachedEnd();
+}
+
+int runCommandLineSimulation (NBodyEngine::Kernel kernel, int argc, char** argv) {
+  try {
+    return runCommandLine(kernel, argc, argv);
+  }
+  catch (const NBodyError& error) {
+    std::cerr << error.what() << std::endl;
+    return -2;
+  }
+  catch (int error) {
+    // usage errors of NBodySimulation::checkInput(), already reported
+    return error;
+  }
+}
+
+namespace {
+  /**
+   * runCommandLineSimulation() without the error handling.
+   */
+  int runCommandLine (NBodyEngine::Kernel kernel, int argc, char** argv) {
+    std::cout << std::setprecision(15);
+
+    const char* gravity = std::getenv("NBODY_GRAVITY");
+    if (gravity != nullptr && std::string(gravity) == "pm" &&
+        kernel != NBodyEngine::MolecularForces) {
+      kernel = NBodyEngine::ParticleMesh;
+    }
+
+    const char* integrator = std::getenv("NBODY_INTEGRATOR");
+    if (integrator != nullptr && std::string(integrator) == "respa" &&
+        kernel != NBodyEngine::MolecularForces) {
+      kernel = NBodyEngine::Respa;
+    }
+
+    // The molecular forces model has no gravitational energy to monitor, so
+    // step 2 writes no diagnostics and has no drift alarm
+    bool diagnostics = kernel != NBodyEngine::MolecularForces;
+
+    const char* autotune = std::getenv("NBODY_AUTOTUNE");
+    bool tuning = autotune != nullptr && std::string(autotune) != "0" &&
+      (kernel == NBodyEngine::Scalar || kernel == NBodyEngine::Vectorised ||
+       kernel == NBodyEngine::Parallelised);
+
+    NBodyEngine engine(kernel);
+    engine.setUp(argc, argv);
+
+    NBodyAutoTuner tuner;
+    if (tuning) tuner.tune(engine);
+
+    // The tuner may replace the simulation object, so it is looked up anew
+    engine.simulation().openParaviewVideoFile();
+    if (diagnostics) engine.simulation().openDiagnosticsFile();
+    engine.simulation().takeSnapshot();
+
+    // the drift is measured from the initial state
+    if (diagnostics) {
+      engine.simulation().evaluateDiagnostics();
+      engine.simulation().logDiagnostics();
+    }
+
+    engine.addObserver([&engine, diagnostics](const NBodyEngine&) {
+      if (diagnostics) engine.simulation().logDiagnostics();
+      engine.simulation().takeSnapshot();
+    });
+
+    while (!engine.hasReachedEnd()) {
+      engine.advance(1);
+      if (tuning && tuner.needsRetuning(engine)) tuner.tune(engine);
+    }
+
+    engine.simulation().printSummary();
+    if (diagnostics) engine.simulation().closeDiagnosticsFile();
+    engine.simulation().closeParaviewVideoFile();
+
+    return 0;
+  }
+}
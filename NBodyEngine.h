@@ -0,0 +1,157 @@
+#ifndef NBODYENGINE_H
+#define NBODYENGINE_H
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "NBodySimulation.h"
+
+/**
+ * Simulation engine that drives the kernels of steps 1-4 without any I/O.
+ *
+ * A system is created either from in-memory arrays or from the command line
+ * of the step-N executables, advanced by a number of time steps, and its
+ * state can be read through views on the simulation's own arrays. Output is
+ * left to observers, which are called back after time steps.
+ *
+ *   NBodyEngine engine(NBodyEngine::Parallelised);
+ *   engine.create(n, x, y, z, vx, vy, vz, m, 0.001);
+ *   engine.addObserver([](const NBodyEngine& e){ ... }, 100);
+ *   engine.advance(1000);
+ *   NBodyEngine::State s = engine.state();
+ */
+class NBodyEngine {
+public:
+  enum Kernel {
+    Scalar,           // step 1
+    MolecularForces,  // step 2
+    Vectorised,       // step 3
+    Parallelised,     // step 4
+    ParticleMesh,     // PM/P3M gravity, see NBodySimulationParticleMesh.cpp
+    Respa             // multiple time stepping, see NBodySimulationRespa.cpp
+  };
+
+  /**
+   * Zero-copy view of the current state. The pointers refer to the
+   * simulation's arrays and stay valid until the next call to advance(),
+   * create() or setUp(). The tracers are listed separately from the
+   * massive bodies. id and tid give the position of every body in the
+   * setup.
+   */
+  struct State {
+    int           numberOfBodies;
+    int           timeStepCounter;
+    double        t;
+    const double* xx;
+    const double* xy;
+    const double* xz;
+    const double* vx;
+    const double* vy;
+    const double* vz;
+    const double* m;
+    const int*    id;
+    int           numberOfTracers;
+    const double* txx;
+    const double* txy;
+    const double* txz;
+    const double* tvx;
+    const double* tvy;
+    const double* tvz;
+    const int*    tid;
+  };
+
+  typedef std::function<void(const NBodyEngine&)> Observer;
+
+  explicit NBodyEngine (Kernel kernel = Parallelised);
+  ~NBodyEngine ();
+
+  /**
+   * Create a system of numberOfBodies bodies from arrays of positions,
+   * velocities and masses. The arrays are copied, and bodies of mass 0
+   * become tracers. The simulation's arrays are reused if they are large
+   * enough, so creating many systems in a row does not allocate. Throws
+   * NBodyError for negative masses and if no body has a positive mass.
+   */
+  void create (int numberOfBodies,
+               const double* xx, const double* xy, const double* xz,
+               const double* vx, const double* vy, const double* vz,
+               const double* m,
+               double timeStepSize);
+
+  /**
+   * Create a system from one of the built-in scenarios, see NBodyScenario.h.
+   */
+  void createScenario (const std::string& scenario, int numberOfBodies,
+                       uint64_t seed, double timeStepSize);
+
+  /**
+   * Create a system from the command line of the step-N executables.
+   */
+  void setUp (int argc, char** argv);
+
+  /**
+   * Run nSteps time steps. Does no I/O apart from what registered observers
+   * do.
+   */
+  void advance (int nSteps);
+
+  /**
+   * Register a callback run after every everyNSteps-th time step.
+   */
+  void addObserver (Observer observer, int everyNSteps = 1);
+
+  /**
+   * Move the current system to another of the all-pairs kernels (Scalar,
+   * Vectorised or Parallelised) between two time steps. The simulation
+   * object is replaced, so references obtained from simulation() become
+   * invalid. Throws NBodyError for any other kernel.
+   */
+  void switchKernel (Kernel kernel);
+
+  State state () const;
+  bool  hasReachedEnd () const;
+  Kernel kernel () const { return _kernel; }
+
+  /**
+   * Direct access to the underlying simulation, e.g. for its output routines.
+   */
+  NBodySimulation&       simulation ()       { return *_simulation; }
+  const NBodySimulation& simulation () const { return *_simulation; }
+
+private:
+  struct RegisteredObserver {
+    Observer observer;
+    int      everyNSteps;
+  };
+
+  NBodyEngine (const NBodyEngine&);
+  NBodyEngine& operator= (const NBodyEngine&);
+
+  void startRun (double timeStepSize);
+  void prepareKernel ();
+
+  Kernel                          _kernel;
+  NBodySimulation*                _simulation;
+  std::vector<RegisteredObserver> _observers;
+};
+
+/**
+ * Main routine shared by the step-N executables: set up from the command
+ * line, run to the final time and write the ParaView, diagnostics and
+ * terminal output.
+ *
+ * NBODY_GRAVITY=pm replaces the all-pairs gravity kernels by the
+ * particle-mesh solver, and NBODY_INTEGRATOR=respa by the multiple time
+ * stepping kernel. NBODY_AUTOTUNE=1 lets NBodyAutoTuner choose among the
+ * all-pairs kernels, see NBodyAutoTuner.h.
+ *
+ * This is the only place that turns errors into an exit code: invalid
+ * arguments and NBodyError are reported on std::cerr and returned as -1
+ * or -2, which the step-N executables pass on from main().
+ */
+int runCommandLineSimulation (NBodyEngine::Kernel kernel, int argc, char** argv);
+
+#endif
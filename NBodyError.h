@@ -0,0 +1,34 @@
+#ifndef NBODYERROR_H
+#define NBODYERROR_H
+
+#include <exception>
+#include <sstream>
+#include <string>
+
+/**
+ * Invalid setups, options and files. The library throws it instead of
+ * exiting, so programs that embed the engine, like the simulation server,
+ * can report the error and carry on. The step-N executables print the
+ * message and exit with -2. The message is composed like an output stream:
+ *
+ *   throw NBodyError() << "invalid mesh size " << meshSize;
+ */
+class NBodyError : public std::exception {
+public:
+  template <class T>
+  NBodyError& operator<< (const T& value) {
+    std::ostringstream out;
+    out << value;
+    _message += out.str();
+    return *this;
+  }
+
+  const char* what () const throw() {
+    return _message.c_str();
+  }
+
+private:
+  std::string _message;
+};
+
+#endif
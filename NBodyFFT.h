@@ -0,0 +1,156 @@
+#ifndef NBODYFFT_H
+#define NBODYFFT_H
+
+#include <cmath>
+#include <complex>
+#include <vector>
+
+#ifdef NBODY_USE_FFTW
+#include <fftw3.h>
+#endif
+
+/**
+ * Three-dimensional complex FFT on an M x M x M array stored with the last
+ * index running fastest.
+ *
+ * The bundled implementation is an iterative radix-2 Cooley-Tukey transform
+ * applied line by line along each axis, with the lines distributed among
+ * OpenMP threads. M has to be a power of two. Compiling with
+ * -DNBODY_USE_FFTW (and linking -lfftw3) uses a local FFTW instead, which
+ * accepts any M.
+ *
+ * The inverse transform is normalised, i.e. inverse(forward(a)) == a.
+ */
+class FFT3D {
+public:
+  typedef std::complex<double> Complex;
+
+  FFT3D () : M(0) {}
+
+#ifdef NBODY_USE_FFTW
+  ~FFT3D () {
+    if (M > 0) {
+      fftw_destroy_plan(forwardPlan);
+      fftw_destroy_plan(inversePlan);
+    }
+  }
+#endif
+
+  static bool isPowerOfTwo (int n) {
+    return n > 0 && (n & (n-1)) == 0;
+  }
+
+  /**
+   * Prepare for transforms of size M^3. Cheap if the size did not change
+   * since the last call.
+   */
+  void plan (int size, std::vector<Complex>& data) {
+    if (size == M) return;
+#ifdef NBODY_USE_FFTW
+    if (M > 0) {
+      fftw_destroy_plan(forwardPlan);
+      fftw_destroy_plan(inversePlan);
+    }
+    // Estimated plans do not touch the array. Unaligned, so that they can be
+    // executed on any std::vector of the same size.
+    fftw_complex* p = reinterpret_cast<fftw_complex*>(&data[0]);
+    forwardPlan = fftw_plan_dft_3d(size, size, size, p, p, FFTW_FORWARD,
+                                   FFTW_ESTIMATE | FFTW_UNALIGNED);
+    inversePlan = fftw_plan_dft_3d(size, size, size, p, p, FFTW_BACKWARD,
+                                   FFTW_ESTIMATE | FFTW_UNALIGNED);
+#else
+    (void) data;
+    roots.resize(size/2);
+    for (int k = 0; k < size/2; ++k) {
+      roots[k] = std::polar(1.0, -2.0*M_PI*k/size);
+    }
+#endif
+    M = size;
+  }
+
+  void forward (std::vector<Complex>& data) { transform(data, false); }
+  void inverse (std::vector<Complex>& data) {
+    transform(data, true);
+    double scale = 1.0/(double(M)*M*M);
+    #pragma omp parallel for
+    for (long i = 0; i < long(M)*M*M; ++i) data[i] *= scale;
+  }
+
+private:
+  int M;
+
+#ifdef NBODY_USE_FFTW
+  fftw_plan forwardPlan;
+  fftw_plan inversePlan;
+
+  void transform (std::vector<Complex>& data, bool inverse) {
+    fftw_complex* p = reinterpret_cast<fftw_complex*>(&data[0]);
+    fftw_execute_dft(inverse ? inversePlan : forwardPlan, p, p);
+  }
+#else
+  std::vector<Complex> roots;
+
+  /**
+   * In-place transform of one contiguous line. The butterflies are written
+   * out on real and imaginary parts, as std::complex multiplication is not
+   * inlined without -ffast-math.
+   */
+  void line (Complex* a, bool inverse) const {
+    for (int i = 1, j = 0; i < M; ++i) {
+      int bit = M >> 1;
+      for (; j & bit; bit >>= 1) j ^= bit;
+      j ^= bit;
+      if (i < j) std::swap(a[i], a[j]);
+    }
+
+    double sign = inverse ? -1.0 : 1.0;
+    for (int len = 2; len <= M; len <<= 1) {
+      int step = M/len;
+      for (int i = 0; i < M; i += len) {
+        for (int j = 0; j < len/2; ++j) {
+          double wr = roots[j*step].real();
+          double wi = sign*roots[j*step].imag();
+          Complex& u = a[i+j];
+          Complex& v = a[i+j+len/2];
+          double vr = v.real()*wr - v.imag()*wi;
+          double vi = v.real()*wi + v.imag()*wr;
+          v = Complex(u.real() - vr, u.imag() - vi);
+          u = Complex(u.real() + vr, u.imag() + vi);
+        }
+      }
+    }
+  }
+
+  void transform (std::vector<Complex>& data, bool inverse) {
+    const long MM = long(M)*M;
+
+    // lines along the last, middle and first index
+    for (int axis = 0; axis < 3; ++axis) {
+      const long stride = axis == 0 ? 1 : (axis == 1 ? M : MM);
+
+      #pragma omp parallel
+      {
+        std::vector<Complex> buffer(M);
+
+        #pragma omp for
+        for (long l = 0; l < MM; ++l) {
+          // first element of line l
+          long a = l / M, b = l % M;
+          long start = axis == 0 ? l*M : (axis == 1 ? a*MM + b : l);
+
+          if (stride == 1) {
+            line(&data[start], inverse);
+          }
+          else {
+            for (int k = 0; k < M; ++k) buffer[k] = data[start + k*stride];
+            line(&buffer[0], inverse);
+            for (int k = 0; k < M; ++k) data[start + k*stride] = buffer[k];
+          }
+        }
+      }
+    }
+  }
+#endif
+};
+
+#endif
@@ -0,0 +1,177 @@
+#include "NBodyScenario.h"
+#include "NBodyError.h"
+#include "NBodySimulation.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+using namespace NBodyScenario;
+
+namespace {
+  const uint32_t PhiloxM0 = 0xD2511F53;
+  const uint32_t PhiloxM1 = 0xCD9E8D57;
+  const uint32_t PhiloxW0 = 0x9E3779B9;
+  const uint32_t PhiloxW1 = 0xBB67AE85;
+
+  const double Pi = 3.14159265358979323846;
+
+  enum Kind { Uniform, Plummer, ColdCollapse, Lattice, Unknown };
+
+  Kind kindOf (const std::string& name) {
+    if (name == "uniform")       return Uniform;
+    if (name == "plummer")       return Plummer;
+    if (name == "cold-collapse") return ColdCollapse;
+    if (name == "lattice")       return Lattice;
+    return Unknown;
+  }
+
+  /**
+   * Vector of length r in a uniformly distributed direction.
+   */
+  void isotropic (Stream& random, double r, double& x, double& y, double& z) {
+    const double cosTheta = 2*random.uniform() - 1;
+    const double sinTheta = std::sqrt(1 - cosTheta*cosTheta);
+    const double phi      = 2*Pi*random.uniform();
+    x = r*sinTheta*std::cos(phi);
+    y = r*sinTheta*std::sin(phi);
+    z = r*cosTheta;
+  }
+
+  /**
+   * Position and velocity of a body of a Plummer sphere of scale radius a
+   * and mass 1. The speed is q times the escape speed, with q drawn from
+   * q^2 (1-q^2)^(7/2) by rejection.
+   */
+  void plummer (Stream& random, double a, double x[3], double v[3]) {
+    const double X = 0.999*random.uniform();
+    const double r = a / std::sqrt(std::pow(X, -2.0/3.0) - 1);
+    isotropic(random, r, x[0], x[1], x[2]);
+
+    double q, g;
+    do {
+      q = random.uniform();
+      g = 0.1*random.uniform();
+    } while (g > q*q*std::pow(1 - q*q, 3.5));
+    const double escape = std::sqrt(2/std::sqrt(r*r + a*a));
+    isotropic(random, q*escape, v[0], v[1], v[2]);
+  }
+
+  /**
+   * Point uniformly distributed in the unit ball.
+   */
+  void ball (Stream& random, double x[3]) {
+    isotropic(random, std::cbrt(random.uniform()), x[0], x[1], x[2]);
+  }
+}
+
+Philox::Philox (uint64_t seed) {
+  _key[0] = static_cast<uint32_t>(seed);
+  _key[1] = static_cast<uint32_t>(seed >> 32);
+}
+
+void Philox::operator() (const uint32_t counter[4], uint32_t result[4]) const {
+  uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+  uint32_t k0 = _key[0], k1 = _key[1];
+  for (int round = 0; round < 10; ++round) {
+    const uint64_t p0 = static_cast<uint64_t>(PhiloxM0) * c0;
+    const uint64_t p1 = static_cast<uint64_t>(PhiloxM1) * c2;
+    const uint32_t n0 = static_cast<uint32_t>(p1 >> 32) ^ c1 ^ k0;
+    const uint32_t n2 = static_cast<uint32_t>(p0 >> 32) ^ c3 ^ k1;
+    c1 = static_cast<uint32_t>(p1);
+    c3 = static_cast<uint32_t>(p0);
+    c0 = n0;
+    c2 = n2;
+    k0 += PhiloxW0;
+    k1 += PhiloxW1;
+  }
+  result[0] = c0; result[1] = c1; result[2] = c2; result[3] = c3;
+}
+
+Stream::Stream (const Philox& philox, uint64_t body, Domain domain) :
+  _philox(philox), _next(4) {
+  _counter[0] = static_cast<uint32_t>(body);
+  _counter[1] = static_cast<uint32_t>(body >> 32);
+  _counter[2] = 0;
+  _counter[3] = static_cast<uint32_t>(domain);
+}
+
+double Stream::uniform () {
+  if (_next == 4) {
+    _philox(_counter, _bits);
+    _counter[2]++;
+    _next = 0;
+  }
+  const uint64_t high = _bits[_next] >> 5, low = _bits[_next+1] >> 6;
+  _next += 2;
+  return ((high << 26) + low + 0.5) * (1.0/9007199254740992.0);
+}
+
+bool NBodyScenario::exists (const std::string& name) {
+  return kindOf(name) != Unknown;
+}
+
+const char* NBodyScenario::names () {
+  return "uniform, plummer, cold-collapse or lattice";
+}
+
+void NBodyScenario::generate (NBodySimulation& s, const std::string& name,
+                              int numberOfBodies, uint64_t seed) {
+  const Kind kind = kindOf(name);
+  if (kind == Unknown) {
+    throw NBodyError() << "unknown scenario " << name << " (use " << names() << ")";
+  }
+  if (numberOfBodies < 1) {
+    throw NBodyError() << "a scenario needs at least one body";
+  }
+  s.allocateBodies(numberOfBodies);
+  s.allocateTracers(0);
+
+  const Philox philox(seed);
+  const int    side = static_cast<int>(std::ceil(std::cbrt(static_cast<double>(numberOfBodies))));
+  const double a    = 3*Pi/16;
+
+  #pragma omp parallel for schedule(static)
+  for (int i = 0; i < numberOfBodies; ++i) {
+    Stream random(philox, i);
+    double x[3] = {0, 0, 0}, v[3] = {0, 0, 0}, mass = 1.0;
+
+    if (kind == Uniform) {
+      for (int d = 0; d < 3; ++d) x[d] = random.uniform() - 0.5;
+    }
+    else if (kind == Plummer) {
+      plummer(random, a, x, v);
+      mass = 1.0/numberOfBodies;
+    }
+    else if (kind == ColdCollapse) {
+      ball(random, x);
+      mass = 1.0/numberOfBodies;
+    }
+    else {
+      const int cell[3] = { i % side, i / side % side, i / side / side };
+      for (int d = 0; d < 3; ++d) {
+        x[d] = (cell[d] - 0.5*(side-1) + 0.2*(random.uniform() - 0.5)) * LatticeSpacing;
+      }
+    }
+
+    s.xx[i] = x[0]; s.xy[i] = x[1]; s.xz[i] = x[2];
+    s.vx[i] = v[0]; s.vy[i] = v[1]; s.vz[i] = v[2];
+    s.m[i]  = mass;
+    s.id[i] = i;
+  }
+
+  // the centre of mass is summed in order, so it does not depend on the
+  // number of threads either
+  if (kind == Plummer) {
+    double c[6] = {0, 0, 0, 0, 0, 0};
+    for (int i = 0; i < numberOfBodies; ++i) {
+      c[0] += s.m[i]*s.xx[i]; c[1] += s.m[i]*s.xy[i]; c[2] += s.m[i]*s.xz[i];
+      c[3] += s.m[i]*s.vx[i]; c[4] += s.m[i]*s.vy[i]; c[5] += s.m[i]*s.vz[i];
+    }
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < numberOfBodies; ++i) {
+      s.xx[i] -= c[0]; s.xy[i] -= c[1]; s.xz[i] -= c[2];
+      s.vx[i] -= c[3]; s.vy[i] -= c[4]; s.vz[i] -= c[5];
+    }
+  }
+}
@@ -0,0 +1,89 @@
+#ifndef NBODYSCENARIO_H
+#define NBODYSCENARIO_H
+
+#include <stdint.h>
+
+#include <string>
+
+class NBodySimulation;
+
+/**
+ * Built-in initial conditions, as an alternative to listing every body on
+ * the command line:
+ *
+ *   ./step-4-gcc plot-time final-time dt scenario bodies [seed]
+ *
+ * - uniform: bodies of mass 1 at rest, uniformly distributed in the unit
+ *   cube centred at the origin (the setup of the scaling tests).
+ * - plummer: Plummer sphere in equilibrium (Aarseth, Henon and Wielen
+ *   1974), total mass 1 and G = 1 in Henon units, truncated at 0.999 of the
+ *   mass, and moved to its centre-of-mass frame.
+ * - cold-collapse: bodies at rest, uniformly distributed in the unit
+ *   sphere, total mass 1.
+ * - lattice: bodies of mass 1 at rest on a cubic lattice of spacing
+ *   LatticeSpacing centred at the origin, each displaced by up to a tenth
+ *   of the spacing per coordinate. Meant for the molecular forces of step 2.
+ *
+ * The arrays are filled in parallel. Every body draws its random numbers
+ * from its own Philox stream, keyed on the seed and counting from the
+ * body's number, so the setup does not depend on the number of threads.
+ */
+namespace NBodyScenario {
+  const double LatticeSpacing = 0.05;
+
+  /**
+   * Philox4x32-10 (Salmon et al. 2011): a counter-based generator, which
+   * maps a 128-bit counter and a 64-bit key to 128 random bits.
+   */
+  class Philox {
+  public:
+    explicit Philox (uint64_t seed);
+    void operator() (const uint32_t counter[4], uint32_t result[4]) const;
+
+  private:
+    uint32_t _key[2];
+  };
+
+  /**
+   * Independent uses of the random numbers of a body. The scenarios draw
+   * from domain 0.
+   */
+  enum Domain { ScenarioDomain = 0, SnapshotSampleDomain = 1 };
+
+  /**
+   * Random numbers of one body: Philox of the counters (body, 0, domain),
+   * (body, 1, domain), ... Every counter gives two doubles. Streams of
+   * different domains do not overlap.
+   */
+  class Stream {
+  public:
+    Stream (const Philox& philox, uint64_t body, Domain domain = ScenarioDomain);
+
+    /**
+     * Uniform in (0,1), with 53 random bits.
+     */
+    double uniform ();
+
+  private:
+    const Philox& _philox;
+    uint32_t      _counter[4];
+    uint32_t      _bits[4];
+    int           _next;
+  };
+
+  /**
+   * Whether name is one of the scenarios, and the list of them for the
+   * usage message.
+   */
+  bool        exists (const std::string& name);
+  const char* names ();
+
+  /**
+   * Allocate numberOfBodies bodies of the simulation and fill them with the
+   * scenario. Throws NBodyError on unknown scenarios.
+   */
+  void generate (NBodySimulation& simulation, const std::string& name,
+                 int numberOfBodies, uint64_t seed);
+}
+
+#endif
@@ -0,0 +1,346 @@
+#include "NBodyServer.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <omp.h>
+
+namespace {
+  /**
+   * Largest system accepted, to reject corrupt headers before allocating.
+   */
+  const uint32_t MaximumNumberOfBodies = 1u << 26;
+
+  bool sendAll (int socket, const void* data, size_t bytes) {
+    const char* p = static_cast<const char*>(data);
+    while (bytes > 0) {
+      ssize_t sent = send(socket, p, bytes, MSG_NOSIGNAL);
+      if (sent <= 0) return false;
+      p     += sent;
+      bytes -= sent;
+    }
+    return true;
+  }
+
+  bool receiveAll (int socket, void* data, size_t bytes) {
+    char* p = static_cast<char*>(data);
+    while (bytes > 0) {
+      ssize_t received = recv(socket, p, bytes, 0);
+      if (received <= 0) return false;
+      p     += received;
+      bytes -= received;
+    }
+    return true;
+  }
+
+  bool sendArray (int socket, const std::vector<double>& a) {
+    return a.empty() || sendAll(socket, a.data(), a.size()*sizeof(double));
+  }
+
+  /**
+   * resize() keeps the capacity, so reused buffers do not allocate.
+   */
+  bool receiveArray (int socket, std::vector<double>& a, size_t n) {
+    a.resize(n);
+    return n == 0 || receiveAll(socket, a.data(), n*sizeof(double));
+  }
+
+  bool isAllPairsKernel (uint32_t kernel) {
+    return kernel == NBodyEngine::Scalar || kernel == NBodyEngine::Vectorised ||
+           kernel == NBodyEngine::Parallelised;
+  }
+}
+
+bool sendJob (int socket, const NBodyJob& job) {
+  return sendAll(socket, &job.header, sizeof(job.header)) &&
+         sendArray(socket, job.xx) && sendArray(socket, job.xy) && sendArray(socket, job.xz) &&
+         sendArray(socket, job.vx) && sendArray(socket, job.vy) && sendArray(socket, job.vz) &&
+         sendArray(socket, job.m);
+}
+
+bool receiveJob (int socket, NBodyJob& job) {
+  if (!receiveAll(socket, &job.header, sizeof(job.header)) ||
+      job.header.magic != NBodyProtocol::JobMagic ||
+      job.header.numberOfBodies > MaximumNumberOfBodies) return false;
+
+  const size_t n = job.header.command == NBodyProtocol::Run ? job.header.numberOfBodies : 0;
+  return receiveArray(socket, job.xx, n) && receiveArray(socket, job.xy, n) &&
+         receiveArray(socket, job.xz, n) && receiveArray(socket, job.vx, n) &&
+         receiveArray(socket, job.vy, n) && receiveArray(socket, job.vz, n) &&
+         receiveArray(socket, job.m, n);
+}
+
+bool sendResult (int socket, const NBodyJobResult& result) {
+  if (!sendAll(socket, &result.header, sizeof(result.header))) return false;
+  if (result.header.status != 0) {
+    return sendAll(socket, result.message.data(), result.message.size());
+  }
+  return sendArray(socket, result.xx)  && sendArray(socket, result.xy)  && sendArray(socket, result.xz)  &&
+         sendArray(socket, result.vx)  && sendArray(socket, result.vy)  && sendArray(socket, result.vz)  &&
+         sendArray(socket, result.m)   &&
+         sendArray(socket, result.txx) && sendArray(socket, result.txy) && sendArray(socket, result.txz) &&
+         sendArray(socket, result.tvx) && sendArray(socket, result.tvy) && sendArray(socket, result.tvz);
+}
+
+bool receiveResult (int socket, NBodyJobResult& result) {
+  if (!receiveAll(socket, &result.header, sizeof(result.header)) ||
+      result.header.magic != NBodyProtocol::ReplyMagic) return false;
+
+  if (result.header.status != 0) {
+    result.message.resize(result.header.messageLength);
+    return result.header.messageLength == 0 ||
+           receiveAll(socket, &result.message[0], result.header.messageLength);
+  }
+  const size_t n = result.header.numberOfBodies, t = result.header.numberOfTracers;
+  result.message.clear();
+  return receiveArray(socket, result.xx, n)  && receiveArray(socket, result.xy, n)  &&
+         receiveArray(socket, result.xz, n)  && receiveArray(socket, result.vx, n)  &&
+         receiveArray(socket, result.vy, n)  && receiveArray(socket, result.vz, n)  &&
+         receiveArray(socket, result.m, n)   &&
+         receiveArray(socket, result.txx, t) && receiveArray(socket, result.txy, t) &&
+         receiveArray(socket, result.txz, t) && receiveArray(socket, result.tvx, t) &&
+         receiveArray(socket, result.tvy, t) && receiveArray(socket, result.tvz, t);
+}
+
+std::string defaultSocketPath () {
+  const char* value = std::getenv("NBODY_SOCKET");
+  return value != nullptr ? value : "/tmp/nbody.sock";
+}
+
+int connectToServer (const std::string& socketPath) {
+  sockaddr_un address;
+  if (socketPath.size() >= sizeof(address.sun_path)) return -1;
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  std::strcpy(address.sun_path, socketPath.c_str());
+
+  int s = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s < 0) return -1;
+  if (connect(s, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+    close(s);
+    return -1;
+  }
+  return s;
+}
+
+NBodyServer::NBodyServer (const std::string& socketPath, int workers) :
+  _socketPath(socketPath), _workers(std::max(1, workers)), _listenSocket(-1),
+  _stopping(false) {}
+
+NBodyServer::~NBodyServer () {
+  if (_listenSocket >= 0) {
+    close(_listenSocket);
+    unlink(_socketPath.c_str());
+  }
+}
+
+int NBodyServer::run () {
+  sockaddr_un address;
+  if (_socketPath.size() >= sizeof(address.sun_path)) {
+    std::cerr << "socket path " << _socketPath << " is too long" << std::endl;
+    return 1;
+  }
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  std::strcpy(address.sun_path, _socketPath.c_str());
+
+  // a socket file left behind by a server that was killed
+  unlink(_socketPath.c_str());
+
+  _listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (_listenSocket < 0 ||
+      bind(_listenSocket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+      listen(_listenSocket, 64) != 0) {
+    std::cerr << "cannot listen on " << _socketPath << ": " << std::strerror(errno) << std::endl;
+    return 1;
+  }
+
+  // split the cores this process may use into one partition per worker
+  std::vector<int> cores;
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    for (int c = 0; c < CPU_SETSIZE; ++c) {
+      if (CPU_ISSET(c, &allowed)) cores.push_back(c);
+    }
+  }
+  const int workers = std::min<int>(_workers, std::max<size_t>(1, cores.size()));
+
+  std::vector<std::thread> threads;
+  for (int w = 0; w < workers; ++w) {
+    std::vector<int> partition;
+    for (size_t c = w; c < cores.size(); c += workers) partition.push_back(cores[c]);
+    threads.push_back(std::thread(&NBodyServer::work, this, w, partition));
+  }
+
+  std::cout << "serving on " << _socketPath << " with " << workers << " workers of "
+            << std::max<size_t>(1, cores.size()/workers) << " cores" << std::endl;
+
+  while (true) {
+    int connection = accept(_listenSocket, nullptr, nullptr);
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_stopping) {
+      if (connection >= 0) close(connection);
+      break;
+    }
+    if (connection < 0) continue;
+    _connections.push_back(connection);
+    _wakeUp.notify_one();
+  }
+
+  _wakeUp.notify_all();
+  for (size_t w = 0; w < threads.size(); ++w) threads[w].join();
+  return 0;
+}
+
+void NBodyServer::work (int worker, std::vector<int> cores) {
+  // The OpenMP team of this thread inherits the affinity, and it is kept
+  // alive by the runtime between the parallel regions of successive jobs
+  if (!cores.empty()) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t c = 0; c < cores.size(); ++c) CPU_SET(cores[c], &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+  omp_set_num_threads(std::max<int>(1, cores.size()));
+  #pragma omp parallel
+  {
+  }
+
+  std::vector<NBodyEngine*> engines(NBodyEngine::Respa + 1, nullptr);
+  NBodyJob       job;
+  NBodyJobResult result;
+
+  while (true) {
+    int connection;
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      while (_connections.empty() && !_stopping) _wakeUp.wait(lock);
+      if (_connections.empty()) break;
+      connection = _connections.front();
+      _connections.pop_front();
+    }
+
+    if (receiveJob(connection, job)) {
+      if (job.header.command == NBodyProtocol::Shutdown) {
+        std::memset(&result.header, 0, sizeof(result.header));
+        result.header.magic = NBodyProtocol::ReplyMagic;
+        sendResult(connection, result);
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+        // wakes up the accept() of run()
+        shutdown(_listenSocket, SHUT_RDWR);
+        _wakeUp.notify_all();
+      }
+      else {
+        runJob(engines, job, result);
+        sendResult(connection, result);
+      }
+    }
+    close(connection);
+  }
+
+  for (size_t k = 0; k < engines.size(); ++k) delete engines[k];
+  (void) worker;
+}
+
+std::string NBodyServer::validate (const NBodyJob& job) {
+  const NBodyProtocol::JobHeader& h = job.header;
+  if (!isAllPairsKernel(h.kernel)) {
+    return "the server offers the scalar, vectorised and parallel kernels only";
+  }
+  if (h.integrator != NBodySimulation::StoermerVerlet &&
+      h.integrator != NBodySimulation::Yoshida4 &&
+      h.integrator != NBodySimulation::Hermite4) {
+    return "unknown integrator";
+  }
+  if (!(h.timeStepSize > 0) || !(h.finalTime >= 0)) {
+    return "time step size and final time have to be positive";
+  }
+
+  int tracers = 0;
+  for (uint32_t i = 0; i < h.numberOfBodies; ++i) {
+    if (!(job.m[i] >= 0)) return "invalid mass";
+    if (job.m[i] == 0) tracers++;
+  }
+  if (tracers == static_cast<int>(h.numberOfBodies)) {
+    return "at least one body needs a positive mass";
+  }
+  if (h.integrator == NBodySimulation::Hermite4 && (tracers > 0 || h.reproducible)) {
+    return "the Hermite integrator supports neither tracers nor reproducible summation";
+  }
+  return "";
+}
+
+void NBodyServer::runJob (std::vector<NBodyEngine*>& engines, const NBodyJob& job,
+                          NBodyJobResult& result) {
+  std::memset(&result.header, 0, sizeof(result.header));
+  result.header.magic = NBodyProtocol::ReplyMagic;
+
+  result.message = validate(job);
+  if (!result.message.empty()) {
+    result.header.status        = 1;
+    result.header.messageLength = result.message.size();
+    return;
+  }
+
+  const NBodyProtocol::JobHeader& h = job.header;
+  NBodyEngine*& engine = engines[h.kernel];
+  if (engine == nullptr) engine = new NBodyEngine(static_cast<NBodyEngine::Kernel>(h.kernel));
+
+  auto start = std::chrono::steady_clock::now();
+
+  NBodySimulation* simulation = nullptr;
+  try {
+    engine->create(h.numberOfBodies, job.xx.data(), job.xy.data(), job.xz.data(),
+                   job.vx.data(), job.vy.data(), job.vz.data(), job.m.data(), h.timeStepSize);
+    simulation = &engine->simulation();
+    simulation->integrator   = static_cast<NBodySimulation::Integrator>(h.integrator);
+    simulation->reproducible = h.reproducible != 0;
+    simulation->tFinal       = h.finalTime;
+
+    while (!engine->hasReachedEnd()) {
+      engine->advance(1);
+    }
+  }
+  catch (const NBodyError& error) {
+    result.message              = error.what();
+    result.header.status        = 1;
+    result.header.messageLength = result.message.size();
+    return;
+  }
+  NBodySimulation& s = *simulation;
+
+  result.header.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  result.header.numberOfBodies  = s.NumberOfBodies;
+  result.header.numberOfTracers = s.NumberOfTracers;
+  result.header.timeSteps       = s.timeStepCounter;
+  result.header.t               = s.t;
+  result.header.kineticEnergy   = s.kineticEnergy;
+  result.header.potentialEnergy = s.potentialEnergy;
+  result.header.px = s.px; result.header.py = s.py; result.header.pz = s.pz;
+  result.header.Lx = s.Lx; result.header.Ly = s.Ly; result.header.Lz = s.Lz;
+
+  result.xx.assign(s.xx, s.xx+s.NumberOfBodies);
+  result.xy.assign(s.xy, s.xy+s.NumberOfBodies);
+  result.xz.assign(s.xz, s.xz+s.NumberOfBodies);
+  result.vx.assign(s.vx, s.vx+s.NumberOfBodies);
+  result.vy.assign(s.vy, s.vy+s.NumberOfBodies);
+  result.vz.assign(s.vz, s.vz+s.NumberOfBodies);
+  result.m.assign(s.m, s.m+s.NumberOfBodies);
+  result.txx.assign(s.txx, s.txx+s.NumberOfTracers);
+  result.txy.assign(s.txy, s.txy+s.NumberOfTracers);
+  result.txz.assign(s.txz, s.txz+s.NumberOfTracers);
+  result.tvx.assign(s.tvx, s.tvx+s.NumberOfTracers);
+  result.tvy.assign(s.tvy, s.tvy+s.NumberOfTracers);
+  result.tvz.assign(s.tvz, s.tvz+s.NumberOfTracers);
+}
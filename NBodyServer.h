@@ -0,0 +1,133 @@
+#ifndef NBODYSERVER_H
+#define NBODYSERVER_H
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "NBodyEngine.h"
+
+/**
+ * Binary protocol of the local simulation server.
+ *
+ * One job per connection: the client sends a JobHeader followed by the
+ * seven arrays x, y, z, vx, vy, vz, m of numberOfBodies doubles each, with
+ * mass 0 for tracers. The server answers with a ReplyHeader followed either,
+ * if status is 0, by the seven arrays of the remaining massive bodies and
+ * the six arrays x, y, z, vx, vy, vz of the tracers, or else by an error
+ * message of messageLength characters. Client and server run on the same
+ * machine, so all values are in its byte order.
+ */
+namespace NBodyProtocol {
+  const uint32_t JobMagic   = 0x314a424e; // "NBJ1"
+  const uint32_t ReplyMagic = 0x3152424e; // "NBR1"
+
+  enum Command { Run = 0, Shutdown = 1 };
+
+  struct JobHeader {
+    uint32_t magic;
+    uint32_t command;
+    uint32_t kernel;          // NBodyEngine::Kernel
+    uint32_t integrator;      // NBodySimulation::Integrator
+    uint32_t reproducible;
+    uint32_t numberOfBodies;  // including the tracers
+    double   timeStepSize;
+    double   finalTime;
+  };
+
+  struct ReplyHeader {
+    uint32_t magic;
+    int32_t  status;
+    uint32_t numberOfBodies;
+    uint32_t numberOfTracers;
+    uint32_t timeSteps;
+    uint32_t messageLength;
+    double   t;
+    double   seconds;         // wall time of the run on the server
+    double   kineticEnergy, potentialEnergy;
+    double   px, py, pz;
+    double   Lx, Ly, Lz;
+  };
+}
+
+struct NBodyJob {
+  NBodyProtocol::JobHeader header;
+  std::vector<double>      xx, xy, xz, vx, vy, vz, m;
+};
+
+struct NBodyJobResult {
+  NBodyProtocol::ReplyHeader header;
+  std::vector<double>        xx, xy, xz, vx, vy, vz, m;
+  std::vector<double>        txx, txy, txz, tvx, tvy, tvz;
+  std::string                message;
+};
+
+/**
+ * Transfer of jobs and results over a connected socket. They return false
+ * if the connection broke or the data is not a job or result.
+ */
+bool sendJob       (int socket, const NBodyJob& job);
+bool receiveJob    (int socket, NBodyJob& job);
+bool sendResult    (int socket, const NBodyJobResult& result);
+bool receiveResult (int socket, NBodyJobResult& result);
+
+/**
+ * Socket of the server, NBODY_SOCKET or /tmp/nbody.sock.
+ */
+std::string defaultSocketPath ();
+
+/**
+ * Connected socket, or -1.
+ */
+int connectToServer (const std::string& socketPath);
+
+/**
+ * Simulation daemon for many short runs.
+ *
+ * The server listens on a Unix domain socket and hands every connection to
+ * one of its worker threads. Each worker is pinned to its own partition of
+ * the cores and keeps its OpenMP team, its engines and its job buffers
+ * alive between jobs, so a job costs neither process start-up, thread
+ * creation nor allocation once a system of that size has been seen. With
+ * one worker jobs run back to back on all cores; with several they run
+ * concurrently on disjoint cores.
+ *
+ * Jobs are validated first, so that the kernels do not fail half-way;
+ * an NBodyError thrown nonetheless is reported as a failed job. Only the
+ * all-pairs kernels of steps 1, 3 and 4 are offered.
+ */
+class NBodyServer {
+public:
+  NBodyServer (const std::string& socketPath, int workers);
+  ~NBodyServer ();
+
+  /**
+   * Serve until a shutdown job arrives. Returns 0, or a non-zero value if
+   * the socket could not be set up.
+   */
+  int run ();
+
+private:
+  NBodyServer (const NBodyServer&);
+  NBodyServer& operator= (const NBodyServer&);
+
+  void work (int worker, std::vector<int> cores);
+  void runJob (std::vector<NBodyEngine*>& engines, const NBodyJob& job,
+               NBodyJobResult& result);
+  static std::string validate (const NBodyJob& job);
+
+  std::string             _socketPath;
+  int                     _workers;
+  int                     _listenSocket;
+  bool                    _stopping;
+  std::deque<int>         _connections;
+  std::mutex              _mutex;
+  std::condition_variable _wakeUp;
+};
+
+#endif
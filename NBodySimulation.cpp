@@ -1,14 +1,43 @@
 #include "NBodySimulation.h"
+#include "NBodyScenario.h"
+#include "NBodyTrajectory.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <memory>
+#include <vector>
+
+#include <omp.h>
 
 NBodySimulation::NBodySimulation () :
   t(0), tFinal(0), tPlot(0), tPlotDelta(0), NumberOfBodies(0),
   xx(nullptr), xy(nullptr), xz(nullptr),
   vx(nullptr), vy(nullptr), vz(nullptr),
-  ax(nullptr), ay(nullptr), az(nullptr),
-  timeStepSize(0), maxV(0), minDx(0), videoFile(nullptr),
+  ax(nullptr), ay(nullptr), az(nullptr), m(nullptr), id(nullptr),
+  NumberOfTracers(0),
+  txx(nullptr), txy(nullptr), txz(nullptr),
+  tvx(nullptr), tvy(nullptr), tvz(nullptr),
+  tax(nullptr), tay(nullptr), taz(nullptr), tid(nullptr),
+  tracerSourceTile(TRACER_SOURCE_TILE), bodyCapacity(0), tracerCapacity(0),
+  timeStepSize(0), maxV(0), minDx(0),
+  kineticEnergy(0), potentialEnergy(0),
+  px(0), py(0), pz(0), Lx(0), Ly(0), Lz(0), angularMomentumScale(0),
+  referenceEnergy(0), referenceLx(0), referenceLy(0), referenceLz(0),
+  referenceLScale(0), referenceNumberOfBodies(0),
+  driftTolerance(1e-3), driftAlarmRaised(false), reproducible(false),
+  integrator(StoermerVerlet), forceEvaluations(0),
+  accelerationValid(false), jerkValid(false),
+  jx(nullptr), jy(nullptr), jz(nullptr), hermiteSaved(nullptr), hermiteStride(0),
+  trajectoryFloat32(false), trajectory(nullptr),
   snapshotCounter(0), timeStepCounter(0) {};
 
 NBodySimulation::~NBodySimulation () {
+  freeHermiteData();
+  delete trajectory;
   if (xx != nullptr) free(xx);
   if (xy != nullptr) free(xy);
   if (xz != nullptr) free(xz);
@@ -19,6 +48,17 @@ NBodySimulation::~NBodySimulation () {
   if (ay != nullptr) free(ay);
   if (az != nullptr) free(az);
   if (m  != nullptr) free(m);
+  if (id != nullptr) free(id);
+  if (txx != nullptr) free(txx);
+  if (txy != nullptr) free(txy);
+  if (txz != nullptr) free(txz);
+  if (tvx != nullptr) free(tvx);
+  if (tvy != nullptr) free(tvy);
+  if (tvz != nullptr) free(tvz);
+  if (tax != nullptr) free(tax);
+  if (tay != nullptr) free(tay);
+  if (taz != nullptr) free(taz);
+  if (tid != nullptr) free(tid);
 }
 
 void NBodySimulation::checkInput(int argc, char** argv) {
@@ -32,6 +72,7 @@ void NBodySimulation::checkInput(int argc, char** argv) {
               << "  final-time:      simulated time (greater 0)" << std::endl
               << "  dt:              time step size (greater 0)" << std::endl
               << "  objects:         any number of bodies, specified by position, velocity, mass" << std::endl
+              << "                   (mass 0 for a tracer, which feels gravity but exerts none)" << std::endl
               << std::endl
               << "Examples of arguments:" << std::endl
               << "+ One body moving form the coordinate system's centre along x axis with speed 1" << std::endl
@@ -42,6 +83,11 @@ void NBodySimulation::checkInput(int argc, char** argv) {
               << "    0.01  100.0  0.001    3.0 0.0 0.0  0.0 1.0 0.0  0.4     0.0 0.0 0.0  0.0 0.0 0.0  0.2     2.0 0.0 0.0  0.0 0.0 0.0  1.0" << std::endl
               << "+ Five-body setup" << std::endl
               << "    0.01  100.0  0.001    3.0 0.0 0.0  0.0 1.0 0.0  0.4     0.0 0.0 0.0  0.0 0.0 0.0  0.2     2.0 0.0 0.0  0.0 0.0 0.0  1.0     2.0 1.0 0.0  0.0 0.0 0.0  1.0     2.0 0.0 1.0  0.0 0.0 0.0  1.0" << std::endl
+              << std::endl
+              << "Instead of the objects, a built-in scenario can be given as" << std::endl
+              << "    plot-time final-time dt scenario bodies [seed]" << std::endl
+              << "  with scenario " << NBodyScenario::names() << ", e.g." << std::endl
+              << "    0.01  1.0  0.001    plummer 1000000" << std::endl
               << std::endl;
 
     throw -1;
@@ -58,48 +104,66 @@ void NBodySimulation::checkInput(int argc, char** argv) {
 
 void NBodySimulation::setUp (int argc, char** argv) {
 
-  checkInput(argc, argv);
+  if (argc >= 6 && argc <= 7 && std::isalpha(argv[4][0])) {
+    // plot-time final-time dt scenario bodies [seed]
+    tPlotDelta   = std::stof(argv[1]);
+    tFinal       = std::stof(argv[2]);
+    timeStepSize = std::stof(argv[3]);
+    NBodyScenario::generate(*this, argv[4], std::stoi(argv[5]),
+                            argc > 6 ? std::stoull(argv[6]) : 1);
+  }
+  else {
+    checkInput(argc, argv);
 
-  NumberOfBodies = (argc-4) / 7;
-  C = 1e-2/NumberOfBodies;
+    // mass 0 marks a tracer
+    int numberOfTracers = 0;
+    for (int i=0; i<(argc-4) / 7; i++) {
+      if (std::stof(argv[4 + 7*i + 6])==0.0) numberOfTracers++;
+    }
+    if (numberOfTracers==(argc-4) / 7) {
+      throw NBodyError() << "at least one body needs a positive mass";
+    }
+    allocateBodies((argc-4) / 7 - numberOfTracers);
+    allocateTracers(numberOfTracers);
+
+    int readArgument = 1;
 
-  xx = static_cast<double*>(aligned_alloc(64, NumberOfBodies * sizeof(double)));
-  xy = static_cast<double*>(aligned_alloc(64, NumberOfBodies * sizeof(double)));
-  xz = static_cast<double*>(aligned_alloc(64, NumberOfBodies * sizeof(double)));
-  vx = static_cast<double*>(aligned_alloc(64, NumberOfBodies * sizeof(double)));
-  vy = static_cast<double*>(aligned_alloc(64, NumberOfBodies * sizeof(double)));
-  vz = static_cast<double*>(aligned_alloc(64, NumberOfBodies * sizeof(double)));
-  ax = static_cast<double*>(aligned_alloc(64, NumberOfBodies * sizeof(double)));
-  ay = static_cast<double*>(aligned_alloc(64, NumberOfBodies * sizeof(double)));
-  az = static_cast<double*>(aligned_alloc(64, NumberOfBodies * sizeof(double)));
-  m  = static_cast<double*>(aligned_alloc(64, NumberOfBodies * sizeof(double)));
-
-  int readArgument = 1;
-
-  tPlotDelta   = std::stof(argv[readArgument]); readArgument++;
-  tFinal       = std::stof(argv[readArgument]); readArgument++;
-  timeStepSize = std::stof(argv[readArgument]); readArgument++;
-
-  //maxV = 0.0;
-  for (int i=0; i<NumberOfBodies; i++) {
-    xx[i] = std::stof(argv[readArgument]); readArgument++;
-    xy[i] = std::stof(argv[readArgument]); readArgument++;
-    xz[i] = std::stof(argv[readArgument]); readArgument++;
-
-    vx[i] = std::stof(argv[readArgument]); readArgument++;
-    vy[i] = std::stof(argv[readArgument]); readArgument++;
-    vz[i] = std::stof(argv[readArgument]); readArgument++;
-    //maxV = std::max(maxV, std::sqrt(vx[i]*vx[i] + vy[i]*vy[i] + vz[i]*vz[i]));
-
-    m[i] = std::stof(argv[readArgument]); readArgument++;
-    if (m[i]<=0.0 ) {
-      std::cerr << "invalid mass for body " << i << std::endl;
-      exit(-2);
+    tPlotDelta   = std::stof(argv[readArgument]); readArgument++;
+    tFinal       = std::stof(argv[readArgument]); readArgument++;
+    timeStepSize = std::stof(argv[readArgument]); readArgument++;
+
+    //maxV = 0.0;
+    int body = 0, tracer = 0;
+    for (int i=0; i<(argc-4) / 7; i++) {
+      double x[7];
+      for (int k=0; k<7; k++) {
+        x[k] = std::stof(argv[readArgument]); readArgument++;
+      }
+
+      if (x[6]<0.0 ) {
+        throw NBodyError() << "invalid mass for body " << i;
+      }
+      else if (x[6]==0.0) {
+        txx[tracer] = x[0]; txy[tracer] = x[1]; txz[tracer] = x[2];
+        tvx[tracer] = x[3]; tvy[tracer] = x[4]; tvz[tracer] = x[5];
+        tid[tracer] = i;
+        tracer++;
+      }
+      else {
+        xx[body] = x[0]; xy[body] = x[1]; xz[body] = x[2];
+        vx[body] = x[3]; vy[body] = x[4]; vz[body] = x[5];
+        m[body]  = x[6];
+        id[body] = i;
+        body++;
+      }
     }
   }
 
-  std::cout << "created setup with " << NumberOfBodies << " bodies"
-            << std::endl;
+  std::cout << "created setup with " << NumberOfBodies << " bodies";
+  if (NumberOfTracers>0) std::cout << " and " << NumberOfTracers << " tracers";
+  std::cout << std::endl;
+
+  readEnvironmentOptions();
 
   if (tPlotDelta<=0.0) {
     std::cout << "plotting switched off" << std::endl;
@@ -112,57 +176,548 @@ void NBodySimulation::setUp (int argc, char** argv) {
   }
 }
 
-void NBodySimulation::handle_collision(int i, int j)
-{
-  // Update position, velocity and mass of body i
-  double Minv = 1.0/(m[i]+m[j]);
-  xx[i] = (m[i]*xx[i] + m[j]*xx[j])*Minv;
-  xy[i] = (m[i]*xy[i] + m[j]*xy[j])*Minv;
-  xz[i] = (m[i]*xz[i] + m[j]*xz[j])*Minv;
-  
-  vx[i] = (m[i]*vx[i] + m[j]*vx[j])*Minv;
-  vy[i] = (m[i]*vy[i] + m[j]*vy[j])*Minv;
-  vz[i] = (m[i]*vz[i] + m[j]*vz[j])*Minv;
+double* NBodySimulation::allocateAligned (int n) {
+  // aligned_alloc wants a multiple of the alignment
+  size_t bytes = ((n * sizeof(double) + 63) / 64) * 64;
+  return static_cast<double*>(aligned_alloc(64, bytes));
+}
 
-  m[i] += m[j];
+void NBodySimulation::freeHermiteData () {
+  if (jx != nullptr) free(jx);
+  if (jy != nullptr) free(jy);
+  if (jz != nullptr) free(jz);
+  if (hermiteSaved != nullptr) free(hermiteSaved);
+  jx = jy = jz = hermiteSaved = nullptr;
+}
 
+void NBodySimulation::allocateBodies (int numberOfBodies) {
+  freeHermiteData();
 
-  // Remove body j by replacing it with the last one in the array
-  xx[j] = xx[NumberOfBodies-1];
-  xy[j] = xy[NumberOfBodies-1];
-  vx[j] = xz[NumberOfBodies-1];
-  
-  xz[j] = vx[NumberOfBodies-1];
-  vx[j] = vy[NumberOfBodies-1];
-  vz[j] = vz[NumberOfBodies-1];
+  if (numberOfBodies > bodyCapacity) {
+    if (xx != nullptr) free(xx);
+    if (xy != nullptr) free(xy);
+    if (xz != nullptr) free(xz);
+    if (vx != nullptr) free(vx);
+    if (vy != nullptr) free(vy);
+    if (vz != nullptr) free(vz);
+    if (ax != nullptr) free(ax);
+    if (ay != nullptr) free(ay);
+    if (az != nullptr) free(az);
+    if (m  != nullptr) free(m);
+    if (id != nullptr) free(id);
 
-  m[j] = m[NumberOfBodies-1]; 
-  
+    xx = allocateAligned(numberOfBodies);
+    xy = allocateAligned(numberOfBodies);
+    xz = allocateAligned(numberOfBodies);
+    vx = allocateAligned(numberOfBodies);
+    vy = allocateAligned(numberOfBodies);
+    vz = allocateAligned(numberOfBodies);
+    ax = allocateAligned(numberOfBodies);
+    ay = allocateAligned(numberOfBodies);
+    az = allocateAligned(numberOfBodies);
+    m  = allocateAligned(numberOfBodies);
+    id = static_cast<int*>(malloc(std::max(1, numberOfBodies) * sizeof(int)));
+    bodyCapacity = numberOfBodies;
+  }
+
+  NumberOfBodies = numberOfBodies;
+  C = 1e-2/NumberOfBodies;
+  accelerationValid = false;
+
+  // The first half-kick reads the acceleration, which is not known yet
+  std::fill(ax, ax+NumberOfBodies, 0);
+  std::fill(ay, ay+NumberOfBodies, 0);
+  std::fill(az, az+NumberOfBodies, 0);
+}
+
+void NBodySimulation::allocateTracers (int numberOfTracers) {
+  if (numberOfTracers > tracerCapacity) {
+    if (txx != nullptr) free(txx);
+    if (txy != nullptr) free(txy);
+    if (txz != nullptr) free(txz);
+    if (tvx != nullptr) free(tvx);
+    if (tvy != nullptr) free(tvy);
+    if (tvz != nullptr) free(tvz);
+    if (tax != nullptr) free(tax);
+    if (tay != nullptr) free(tay);
+    if (taz != nullptr) free(taz);
+    if (tid != nullptr) free(tid);
+
+    txx = allocateAligned(numberOfTracers);
+    txy = allocateAligned(numberOfTracers);
+    txz = allocateAligned(numberOfTracers);
+    tvx = allocateAligned(numberOfTracers);
+    tvy = allocateAligned(numberOfTracers);
+    tvz = allocateAligned(numberOfTracers);
+    tax = allocateAligned(numberOfTracers);
+    tay = allocateAligned(numberOfTracers);
+    taz = allocateAligned(numberOfTracers);
+    tid = static_cast<int*>(malloc(std::max(1, numberOfTracers) * sizeof(int)));
+    tracerCapacity = numberOfTracers;
+  }
+
+  NumberOfTracers = numberOfTracers;
+  accelerationValid = false;
 
-  // "Remove" the last body
-  NumberOfBodies--;
+  std::fill(tax, tax+NumberOfTracers, 0);
+  std::fill(tay, tay+NumberOfTracers, 0);
+  std::fill(taz, taz+NumberOfTracers, 0);
+}
+
+void NBodySimulation::swapState (NBodySimulation& other) {
+  std::swap(t, other.t);
+  std::swap(tFinal, other.tFinal);
+  std::swap(tPlot, other.tPlot);
+  std::swap(tPlotDelta, other.tPlotDelta);
+
+  std::swap(NumberOfBodies, other.NumberOfBodies);
+  std::swap(xx, other.xx); std::swap(xy, other.xy); std::swap(xz, other.xz);
+  std::swap(vx, other.vx); std::swap(vy, other.vy); std::swap(vz, other.vz);
+  std::swap(ax, other.ax); std::swap(ay, other.ay); std::swap(az, other.az);
+  std::swap(m,  other.m);
+  std::swap(id, other.id);
+
+  std::swap(NumberOfTracers, other.NumberOfTracers);
+  std::swap(txx, other.txx); std::swap(txy, other.txy); std::swap(txz, other.txz);
+  std::swap(tvx, other.tvx); std::swap(tvy, other.tvy); std::swap(tvz, other.tvz);
+  std::swap(tax, other.tax); std::swap(tay, other.tay); std::swap(taz, other.taz);
+  std::swap(tid, other.tid);
+  std::swap(tracerSourceTile, other.tracerSourceTile);
+  std::swap(bodyCapacity, other.bodyCapacity);
+  std::swap(tracerCapacity, other.tracerCapacity);
+
+  std::swap(C, other.C);
+  std::swap(timeStepSize, other.timeStepSize);
+  std::swap(maxV, other.maxV);
+  std::swap(minDx, other.minDx);
+
+  std::swap(kineticEnergy, other.kineticEnergy);
+  std::swap(potentialEnergy, other.potentialEnergy);
+  std::swap(px, other.px); std::swap(py, other.py); std::swap(pz, other.pz);
+  std::swap(Lx, other.Lx); std::swap(Ly, other.Ly); std::swap(Lz, other.Lz);
+  std::swap(referenceEnergy, other.referenceEnergy);
+  std::swap(angularMomentumScale, other.angularMomentumScale);
+  std::swap(referenceLx, other.referenceLx);
+  std::swap(referenceLy, other.referenceLy);
+  std::swap(referenceLz, other.referenceLz);
+  std::swap(referenceLScale, other.referenceLScale);
+  std::swap(referenceNumberOfBodies, other.referenceNumberOfBodies);
+  std::swap(driftTolerance, other.driftTolerance);
+  std::swap(driftAlarmRaised, other.driftAlarmRaised);
+
+  std::swap(reproducible, other.reproducible);
+  std::swap(integrator, other.integrator);
+  std::swap(forceEvaluations, other.forceEvaluations);
+  std::swap(accelerationValid, other.accelerationValid);
+  std::swap(jerkValid, other.jerkValid);
+  std::swap(jx, other.jx); std::swap(jy, other.jy); std::swap(jz, other.jz);
+  std::swap(hermiteSaved, other.hermiteSaved);
+  std::swap(hermiteStride, other.hermiteStride);
+
+  diagnosticsFile.swap(other.diagnosticsFile);
+  videoFile.swap(other.videoFile);
+  trajectoryFileName.swap(other.trajectoryFileName);
+  std::swap(trajectoryFloat32, other.trajectoryFloat32);
+  std::swap(trajectory, other.trajectory);
+  std::swap(snapshotFilter, other.snapshotFilter);
+  std::swap(snapshotCounter, other.snapshotCounter);
+  std::swap(timeStepCounter, other.timeStepCounter);
+}
+
+void NBodySimulation::readEnvironmentOptions () {
+  const char* value = std::getenv("NBODY_REPRODUCIBLE");
+  reproducible = value != nullptr && std::string(value) != "0";
+
+  value = std::getenv("NBODY_DRIFT_TOLERANCE");
+  if (value != nullptr) driftTolerance = std::stod(value);
+
+  value = std::getenv("NBODY_TRAJECTORY");
+  if (value != nullptr) trajectoryFileName = value;
+
+  value = std::getenv("NBODY_TRAJECTORY_PRECISION");
+  if (value != nullptr) {
+    std::string name(value);
+    if (name == "float32")      trajectoryFloat32 = true;
+    else if (name == "float64") trajectoryFloat32 = false;
+    else {
+      throw NBodyError() << "unknown trajectory precision " << name
+                         << " (use float64 or float32)";
+    }
+  }
+
+  snapshotFilter.readEnvironmentOptions();
+
+  value = std::getenv("NBODY_INTEGRATOR");
+  if (value != nullptr) {
+    std::string name(value);
+    if (name == "verlet")                                integrator = StoermerVerlet;
+    else if (name == "yoshida" || name == "forest-ruth") integrator = Yoshida4;
+    else if (name == "hermite")                          integrator = Hermite4;
+    else if (name == "respa")                            integrator = Respa;
+    else {
+      throw NBodyError() << "unknown integrator " << name
+                         << " (use verlet, yoshida, forest-ruth, hermite or respa)";
+    }
+  }
+  if (integrator == Hermite4 && reproducible) {
+    throw NBodyError() << "the Hermite integrator has no reproducible-summation mode";
+  }
+}
+
+namespace {
+  /**
+   * Replace a[0..n) by its exclusive prefix sum, in parallel. Returns the
+   * total.
+   */
+  int exclusiveScan(int* a, int n)
+  {
+    std::vector<int> partial(omp_get_max_threads()+1, 0);
+    int threads = 1;
+    #pragma omp parallel
+    {
+      const int t = omp_get_thread_num();
+      #pragma omp single
+      threads = omp_get_num_threads();
+      const int begin = static_cast<long>(n)*t/threads;
+      const int end   = static_cast<long>(n)*(t+1)/threads;
+
+      int sum = 0;
+      for (int i = begin; i < end; ++i) sum += a[i];
+      partial[t+1] = sum;
+      #pragma omp barrier
+      #pragma omp single
+      for (int k = 1; k <= threads; ++k) partial[k] += partial[k-1];
+
+      int offset = partial[t];
+      for (int i = begin; i < end; ++i){
+        const int count = a[i];
+        a[i] = offset;
+        offset += count;
+      }
+    }
+    return partial[threads];
+  }
+
+  /**
+   * Lock-free union-find in which every set is linked to its smallest
+   * element, so the roots do not depend on the order of the unions.
+   */
+  int findRoot(std::atomic<int>* parent, int i)
+  {
+    for (;;){
+      int p = parent[i].load(std::memory_order_relaxed);
+      if (p == i) return i;
+      const int gp = parent[p].load(std::memory_order_relaxed);
+      if (gp == p) return p;
+      // path halving; parents only ever decrease, so a lost race is harmless
+      parent[i].compare_exchange_weak(p, gp, std::memory_order_relaxed);
+      i = gp;
+    }
+  }
+
+  void unite(std::atomic<int>* parent, int a, int b)
+  {
+    for (;;){
+      a = findRoot(parent, a);
+      b = findRoot(parent, b);
+      if (a == b) return;
+      if (a > b) std::swap(a, b);
+      int expected = b;
+      if (parent[b].compare_exchange_strong(expected, a, std::memory_order_relaxed)) return;
+    }
+  }
 }
 
 /**
- * On a rare occasion of two bodies colliding, we need to find out which ones
- * and deal with them. We could remember the collision data while computing 
- * force interactions, but this makes vectorisation and parallelisation 
- * harder, while potential time savings are not worth the messy code.
-*/
+ * Merge all bodies closer than C*(m_i+m_j), in parallel:
+ *
+ * 1. Candidate pairs are found with a spatial hash of cells of the largest
+ *    merge radius 2*C*max(m), counting sorted into 2^k >= 2N buckets.
+ * 2. Pairs that collide are united in a union-find, so chains and clusters
+ *    merge into one body. The root of a group is its smallest index.
+ * 3. The groups are combined in index order: mass, momentum and centre of
+ *    mass of all members at once, stored at the root, which keeps its id.
+ * 4. The remaining bodies are compacted, in order, with a prefix sum.
+ *
+ * The result does not depend on the number of threads.
+ */
 void NBodySimulation::process_collisions()
 {
-  for (int i = 0; i < NumberOfBodies; ++i){
-    for (int j = i+1; j < NumberOfBodies; ++j){
-      double dx = xx[j]-xx[i];
-      double dy = xy[j]-xy[i];
-      double dz = xz[j]-xz[i];
-      double dst = sqrt(dx*dx + dy*dy + dz*dz);
-      
-      if (dst / (m[i] + m[j]) <= C){
-        handle_collision(i,j);
+  const int n = NumberOfBodies;
+
+  double mMax = 0;
+  #pragma omp parallel for reduction(max:mMax)
+  for (int i = 0; i < n; ++i) mMax = std::max(mMax, m[i]);
+  // a little larger, so that rounding cannot move a pair two cells apart
+  const double h = 2*C*mMax*(1+1e-9);
+
+  int buckets = 1;
+  while (buckets < 2*n) buckets *= 2;
+  auto cellOf = [this, h](int i, int d) -> long long {
+    const double x = d == 0 ? xx[i] : (d == 1 ? xy[i] : xz[i]);
+    return static_cast<long long>(std::floor(x/h));
+  };
+  auto bucketOf = [buckets](long long cx, long long cy, long long cz) -> int {
+    const unsigned long long key =
+      static_cast<unsigned long long>(cx) * 73856093ull ^
+      static_cast<unsigned long long>(cy) * 19349663ull ^
+      static_cast<unsigned long long>(cz) * 83492791ull;
+    return static_cast<int>((key ^ (key >> 29)) & (buckets-1));
+  };
+
+  // 1. bodies sorted by bucket
+  std::vector<int> bucket(n), bucketStart(buckets+1, 0), sorted(n);
+  #pragma omp parallel for
+  for (int i = 0; i < n; ++i){
+    bucket[i] = bucketOf(cellOf(i,0), cellOf(i,1), cellOf(i,2));
+    #pragma omp atomic
+    bucketStart[bucket[i]]++;
+  }
+  exclusiveScan(bucketStart.data(), buckets+1);
+  std::vector<int> fill(bucketStart.begin(), bucketStart.end()-1);
+  #pragma omp parallel for
+  for (int i = 0; i < n; ++i){
+    int slot;
+    #pragma omp atomic capture
+    slot = fill[bucket[i]]++;
+    sorted[slot] = i;
+  }
+
+  // 2. groups of colliding bodies
+  std::unique_ptr<std::atomic<int>[]> parent(new std::atomic<int>[n]);
+  #pragma omp parallel for
+  for (int i = 0; i < n; ++i) parent[i].store(i, std::memory_order_relaxed);
+
+  // the own cell and the 13 neighbours in the upper half shell, so that
+  // pairs of different cells are checked once
+  #pragma omp parallel for schedule(dynamic, 256)
+  for (int i = 0; i < n; ++i){
+    const long long cx = cellOf(i,0), cy = cellOf(i,1), cz = cellOf(i,2);
+    for (int d = 13; d < 27; ++d){
+      const int b = bucketOf(cx + d/9-1, cy + d/3%3-1, cz + d%3-1);
+      for (int k = bucketStart[b]; k < bucketStart[b+1]; ++k){
+        const int j = sorted[k];
+        if (d == 13 ? j <= i : j == i) continue;
+        const double ddx = xx[j]-xx[i];
+        const double ddy = xy[j]-xy[i];
+        const double ddz = xz[j]-xz[i];
+        const double dst = std::sqrt(ddx*ddx + ddy*ddy + ddz*ddz);
+        if (dst / (m[i] + m[j]) <= C) unite(parent.get(), i, j);
+      }
+    }
+  }
+
+  std::vector<int> root(n), keep(n+1, 0), merged(n+1, 0);
+  #pragma omp parallel for
+  for (int i = 0; i < n; ++i){
+    root[i]   = findRoot(parent.get(), i);
+    keep[i]   = root[i] == i;
+    merged[i] = root[i] != i;
+  }
+  const int remaining = exclusiveScan(keep.data(), n+1);
+  const int members   = exclusiveScan(merged.data(), n+1);
+  if (members == 0) return;
+
+  // 3. combine every group, members in index order
+  std::vector<int> member(members);
+  #pragma omp parallel for
+  for (int i = 0; i < n; ++i){
+    if (merged[i+1] != merged[i]) member[merged[i]] = i;
+  }
+  std::stable_sort(member.begin(), member.end(),
+                   [&root](int a, int b) { return root[a] < root[b]; });
+  std::vector<int> groupStart;
+  for (int k = 0; k < members; ++k){
+    if (k == 0 || root[member[k]] != root[member[k-1]]) groupStart.push_back(k);
+  }
+  groupStart.push_back(members);
+
+  #pragma omp parallel for schedule(dynamic)
+  for (int g = 0; g < static_cast<int>(groupStart.size())-1; ++g){
+    const int r = root[member[groupStart[g]]];
+    double M = m[r];
+    double X = m[r]*xx[r], Y = m[r]*xy[r], Z = m[r]*xz[r];
+    double U = m[r]*vx[r], V = m[r]*vy[r], W = m[r]*vz[r];
+    for (int k = groupStart[g]; k < groupStart[g+1]; ++k){
+      const int j = member[k];
+      M += m[j];
+      X += m[j]*xx[j]; Y += m[j]*xy[j]; Z += m[j]*xz[j];
+      U += m[j]*vx[j]; V += m[j]*vy[j]; W += m[j]*vz[j];
+    }
+    const double Minv = 1.0/M;
+    xx[r] = X*Minv; xy[r] = Y*Minv; xz[r] = Z*Minv;
+    vx[r] = U*Minv; vy[r] = V*Minv; vz[r] = W*Minv;
+    m[r]  = M;
+  }
+
+  // 4. compaction. The caller recomputes the accelerations of the merged
+  // bodies, so ax is free to receive every field in turn and to swap places
+  // with it. The ids go through the bucket indices, which are not needed
+  // any more.
+  double** fields[7] = { &xx, &xy, &xz, &vx, &vy, &vz, &m };
+  for (int f = 0; f < 7; ++f){
+    const double* from = *fields[f];
+    double*       to   = ax;
+    #pragma omp parallel for
+    for (int i = 0; i < n; ++i){
+      if (keep[i+1] != keep[i]) to[keep[i]] = from[i];
+    }
+    std::swap(ax, *fields[f]);
+  }
+  #pragma omp parallel for
+  for (int i = 0; i < n; ++i){
+    if (keep[i+1] != keep[i]) bucket[keep[i]] = id[i];
+  }
+  std::copy(bucket.begin(), bucket.begin()+remaining, id);
+
+  NumberOfBodies = remaining;
+}
+
+double NBodySimulation::pairwiseSum(const double* a, int n)
+{
+  if (n <= 16) {
+    double sum = 0;
+    for (int i = 0; i < n; ++i) sum += a[i];
+    return sum;
+  }
+  return pairwiseSum(a, n/2) + pairwiseSum(a + n/2, n - n/2);
+}
+
+/**
+ * Symmetry is not exploited and every body sums its own contributions in
+ * index order of the other bodies, so the result does not depend on how the
+ * bodies are distributed among threads. The contributions are evaluated
+ * element-wise into scratch arrays (which vectorises without reordering any
+ * sum) and then added with pairwiseSum().
+ *
+ * This relies on the compiler not reassociating floating point sums, which
+ * holds for g++ without -ffast-math. icpc needs -fp-model precise.
+ */
+bool NBodySimulation::process_gravity_reproducible()
+{
+  double m_minDx = std::numeric_limits<double>::max();
+  double m_minC = std::numeric_limits<double>::max();
+  std::vector<double> epot(NumberOfBodies);
+
+  #pragma omp parallel
+  {
+    std::vector<double> gx(NumberOfBodies), gy(NumberOfBodies),
+                        gz(NumberOfBodies), ep(NumberOfBodies);
+    double* pgx = gx.data();
+    double* pgy = gy.data();
+    double* pgz = gz.data();
+    double* pep = ep.data();
+
+    #pragma omp for reduction(min:m_minDx,m_minC)
+    for (int i = 0; i < NumberOfBodies; ++i){
+      double xxi(xx[i]), xyi(xy[i]), xzi(xz[i]), mi(m[i]);
+
+      #pragma omp simd reduction(min:m_minDx,m_minC)
+      for (int j = 0; j < NumberOfBodies; ++j){
+        double dx = xx[j]-xxi;
+        double dy = xy[j]-xyi;
+        double dz = xz[j]-xzi;
+        double dst2 = dx*dx + dy*dy + dz*dz;
+        double dst = std::sqrt(dst2);
+        bool self = j == i;
+        double inv3 = self ? 0.0 : 1.0/(dst2*dst);
+        double inv  = self ? 0.0 : 1.0/dst;
+
+        pgx[j] = dx*inv3*m[j];
+        pgy[j] = dy*inv3*m[j];
+        pgz[j] = dz*inv3*m[j];
+        pep[j] = m[j]*inv;
+
+        double far = std::numeric_limits<double>::max();
+        m_minDx = std::min(m_minDx, self ? far : dst);
+        m_minC  = std::min(m_minC,  self ? far : dst/(mi + m[j]));
       }
+
+      ax[i] = pairwiseSum(pgx, NumberOfBodies);
+      ay[i] = pairwiseSum(pgy, NumberOfBodies);
+      az[i] = pairwiseSum(pgz, NumberOfBodies);
+      epot[i] = -0.5*mi*pairwiseSum(pep, NumberOfBodies);
     }
   }
+
+  minDx = m_minDx;
+  potentialEnergy = pairwiseSum(epot.data(), NumberOfBodies);
+  return m_minC <= C;
+}
+
+/**
+ * The tracers sum the contributions of the massive bodies in the same way.
+ */
+void NBodySimulation::process_tracers_reproducible()
+{
+  #pragma omp parallel
+  {
+    std::vector<double> gx(NumberOfBodies), gy(NumberOfBodies), gz(NumberOfBodies);
+    double* pgx = gx.data();
+    double* pgy = gy.data();
+    double* pgz = gz.data();
+
+    #pragma omp for
+    for (int i = 0; i < NumberOfTracers; ++i){
+      double xxi(txx[i]), xyi(txy[i]), xzi(txz[i]);
+
+      #pragma omp simd
+      for (int j = 0; j < NumberOfBodies; ++j){
+        double dx = xx[j]-xxi;
+        double dy = xy[j]-xyi;
+        double dz = xz[j]-xzi;
+        double dst2 = dx*dx + dy*dy + dz*dz;
+        double g = m[j]/(dst2*std::sqrt(dst2));
+
+        pgx[j] = g*dx;
+        pgy[j] = g*dy;
+        pgz[j] = g*dz;
+      }
+
+      tax[i] = pairwiseSum(pgx, NumberOfBodies);
+      tay[i] = pairwiseSum(pgy, NumberOfBodies);
+      taz[i] = pairwiseSum(pgz, NumberOfBodies);
+    }
+  }
+}
+
+/**
+ * Replaces the diagnostics reduced in the closing kick, whose summation
+ * order depends on the thread count, by fixed-order sums.
+ */
+void NBodySimulation::accumulate_diagnostics_reproducible()
+{
+  std::vector<double> q(8*NumberOfBodies);
+  double* ekin = q.data();
+  double* mvx = ekin + NumberOfBodies;
+  double* mvy = mvx + NumberOfBodies;
+  double* mvz = mvy + NumberOfBodies;
+  double* lx  = mvz + NumberOfBodies;
+  double* ly  = lx + NumberOfBodies;
+  double* lz  = ly + NumberOfBodies;
+  double* ls  = lz + NumberOfBodies;
+
+  #pragma omp parallel for simd
+  for (int i = 0; i < NumberOfBodies; ++i){
+    ekin[i] = 0.5*m[i]*(vx[i]*vx[i] + vy[i]*vy[i] + vz[i]*vz[i]);
+    mvx[i]  = m[i]*vx[i];
+    mvy[i]  = m[i]*vy[i];
+    mvz[i]  = m[i]*vz[i];
+    lx[i]   = m[i]*(xy[i]*vz[i] - xz[i]*vy[i]);
+    ly[i]   = m[i]*(xz[i]*vx[i] - xx[i]*vz[i]);
+    lz[i]   = m[i]*(xx[i]*vy[i] - xy[i]*vx[i]);
+    ls[i]   = m[i]*std::sqrt((xx[i]*xx[i] + xy[i]*xy[i] + xz[i]*xz[i])*
+                             (vx[i]*vx[i] + vy[i]*vy[i] + vz[i]*vz[i]));
+  }
+
+  kineticEnergy = pairwiseSum(ekin, NumberOfBodies);
+  px = pairwiseSum(mvx, NumberOfBodies);
+  py = pairwiseSum(mvy, NumberOfBodies);
+  pz = pairwiseSum(mvz, NumberOfBodies);
+  Lx = pairwiseSum(lx, NumberOfBodies);
+  Ly = pairwiseSum(ly, NumberOfBodies);
+  Lz = pairwiseSum(lz, NumberOfBodies);
+  angularMomentumScale = pairwiseSum(ls, NumberOfBodies);
 }
 
 /**
@@ -171,14 +726,18 @@ void NBodySimulation::process_collisions()
 */
 bool NBodySimulation::process_gravity_and_detect_collision()
 {
+  if (reproducible) return process_gravity_reproducible();
+
   // Clear acceleration data
   std::fill(ax, ax+NumberOfBodies, 0);
   std::fill(ay, ay+NumberOfBodies, 0);
   std::fill(az, az+NumberOfBodies, 0);
+  potentialEnergy = 0;
 
   for (int i = 0; i<NumberOfBodies; ++i){
     double axi(0),ayi(0),azi(0);
     double xxi(xx[i]), xyi(xy[i]), xzi(xz[i]), mi(m[i]);
+    double epi(0);
 
     for (int j=i+1; j<NumberOfBodies; ++j){
       double dx = xx[j]-xxi;
@@ -203,6 +762,7 @@ bool NBodySimulation::process_gravity_and_detect_collision()
       ax[j] -= gx*mi;
       ay[j] -= gy*mi;
       az[j] -= gz*mi;
+      epi   += m[j]/dst;
 
       minDx = std::min(minDx, dst);
     }
@@ -210,54 +770,334 @@ bool NBodySimulation::process_gravity_and_detect_collision()
     ax[i] += axi;
     ay[i] += ayi;
     az[i] += azi;
+    potentialEnergy -= mi*epi;
   }
 
   return false;
 }
 
-void NBodySimulation::updateBody () {
+/**
+ * Acceleration and jerk (its time derivative) for the Hermite integrator,
+ * using the symmetry of both.
+ */
+bool NBodySimulation::process_gravity_jerk_and_detect_collision()
+{
+  std::fill(ax, ax+NumberOfBodies, 0);
+  std::fill(ay, ay+NumberOfBodies, 0);
+  std::fill(az, az+NumberOfBodies, 0);
+  std::fill(jx, jx+NumberOfBodies, 0);
+  std::fill(jy, jy+NumberOfBodies, 0);
+  std::fill(jz, jz+NumberOfBodies, 0);
+  potentialEnergy = 0;
 
-  timeStepCounter++;
-  maxV   = 0.0;
-  minDx  = std::numeric_limits<double>::max();
+  for (int i = 0; i<NumberOfBodies; ++i){
+    double axi(0),ayi(0),azi(0),jxi(0),jyi(0),jzi(0),epi(0);
+    double xxi(xx[i]), xyi(xy[i]), xzi(xz[i]), mi(m[i]);
+    double vxi(vx[i]), vyi(vy[i]), vzi(vz[i]);
 
-  for (int i = 0; i<NumberOfBodies; ++i){    
-    // 1. Compute half an Euler time step for v
-    // v(t + dt/2) = v(t) + dt/2 * a(t)
-    vx[i] += timeStepSize/2 * ax[i];
-    vy[i] += timeStepSize/2 * ay[i];
-    vz[i] += timeStepSize/2 * az[i];
-  
-    // 2. Update positions
-    // x(t+dt) = d(t) + dt * v(t + dt/2)
-    xx[i] += timeStepSize * vx[i];
-    xy[i] += timeStepSize * vy[i];
-    xz[i] += timeStepSize * vz[i];
+    for (int j=i+1; j<NumberOfBodies; ++j){
+      double dx = xx[j]-xxi;
+      double dy = xy[j]-xyi;
+      double dz = xz[j]-xzi;
+      double dvx = vx[j]-vxi;
+      double dvy = vy[j]-vyi;
+      double dvz = vz[j]-vzi;
+      double dst2 = dx*dx + dy*dy + dz*dz;
+      double dst = std::sqrt(dst2);
+
+      if (dst/(mi + m[j]) <= C) return true;
+
+      double dst3 = dst2 * dst;
+      double rv = 3*(dx*dvx + dy*dvy + dz*dvz)/dst2;
+
+      double gx = dx/dst3;
+      double gy = dy/dst3;
+      double gz = dz/dst3;
+      double hx = (dvx - rv*dx)/dst3;
+      double hy = (dvy - rv*dy)/dst3;
+      double hz = (dvz - rv*dz)/dst3;
+
+      axi += gx*m[j];
+      ayi += gy*m[j];
+      azi += gz*m[j];
+      jxi += hx*m[j];
+      jyi += hy*m[j];
+      jzi += hz*m[j];
+      ax[j] -= gx*mi;
+      ay[j] -= gy*mi;
+      az[j] -= gz*mi;
+      jx[j] -= hx*mi;
+      jy[j] -= hy*mi;
+      jz[j] -= hz*mi;
+      epi   += m[j]/dst;
+
+      minDx = std::min(minDx, dst);
+    }
+
+    ax[i] += axi;
+    ay[i] += ayi;
+    az[i] += azi;
+    jx[i] += jxi;
+    jy[i] += jyi;
+    jz[i] += jzi;
+    potentialEnergy -= mi*epi;
+  }
+
+  return false;
+}
+
+/**
+ * Plain M x T loop. The tracers only read the massive bodies, so there are
+ * no collisions to detect.
+ */
+void NBodySimulation::process_tracers()
+{
+  if (reproducible) return process_tracers_reproducible();
+
+  for (int i = 0; i < NumberOfTracers; ++i){
+    double axi(0), ayi(0), azi(0);
+    for (int j = 0; j < NumberOfBodies; ++j){
+      double dx = xx[j]-txx[i];
+      double dy = xy[j]-txy[i];
+      double dz = xz[j]-txz[i];
+      double dst2 = dx*dx + dy*dy + dz*dz;
+      double g = m[j]/(dst2*std::sqrt(dst2));
+
+      axi += g*dx;
+      ayi += g*dy;
+      azi += g*dz;
+    }
+    tax[i] = axi;
+    tay[i] = ayi;
+    taz[i] = azi;
   }
+}
 
-  // 3. Calculate acceleration
+/**
+ * Force evaluation including the handling of collisions. The tracers are
+ * pushed by the bodies left after merging.
+ */
+void NBodySimulation::evaluateForces () {
   if (process_gravity_and_detect_collision())
   {
     // if there are collisions - process them and recalculate acceleration
     process_collisions();
     process_gravity_and_detect_collision();
   }
+  if (NumberOfTracers > 0) process_tracers();
+  forceEvaluations++;
+  accelerationValid = true;
+}
+
+bool NBodySimulation::evaluateForcesAndJerk () {
+  bool collided = process_gravity_jerk_and_detect_collision();
+  if (collided)
+  {
+    process_collisions();
+    process_gravity_jerk_and_detect_collision();
+  }
+  forceEvaluations++;
+  accelerationValid = true;
+  jerkValid = true;
+  return collided;
+}
+
+void NBodySimulation::updateBody () {
+
+  timeStepCounter++;
+  maxV   = 0.0;
+  minDx  = std::numeric_limits<double>::max();
+
+  const double dt = timeStepSize;
+
+  switch (integrator) {
+    case StoermerVerlet:
+      // The first half-kick needs a(t), which is only known after the
+      // first step
+      if (!accelerationValid) evaluateForces();
+
+      // 1. Compute half an Euler time step for v
+      // v(t + dt/2) = v(t) + dt/2 * a(t)
+      // 2. Update positions
+      // x(t+dt) = d(t) + dt * v(t + dt/2)
+      kickDrift(dt/2, dt);
+      kickDriftTracers(dt/2, dt);
+
+      // 3. Calculate acceleration
+      evaluateForces();
+
+      // 4. Update the velocities
+      // v(t + dt) = v(t + dt/2) + dt/2 * a(t + dt)
+      closingKick(dt/2);
+      kickDriftTracers(dt/2, 0);
+      break;
 
-  // 4. Update the velocities
-  // v(t + dt) = v(t + dt/2) + dt/2 * a(t + dt)
-  // Euler time step
+    case Yoshida4: {
+      // Triple-jump composition of three Stoermer-Verlet steps of length
+      // w1*dt, w0*dt, w1*dt. Consecutive half-kicks are merged, so a step
+      // costs three force evaluations.
+      const double w1 = 1.0/(2.0 - std::cbrt(2.0));
+      const double w0 = 1.0 - 2.0*w1;
+
+      if (!accelerationValid) evaluateForces();
+      kickDrift(w1/2*dt, w1*dt);
+      kickDriftTracers(w1/2*dt, w1*dt);
+      evaluateForces();
+      kickDrift((w1+w0)/2*dt, w0*dt);
+      kickDriftTracers((w1+w0)/2*dt, w0*dt);
+      evaluateForces();
+      kickDrift((w0+w1)/2*dt, w1*dt);
+      kickDriftTracers((w0+w1)/2*dt, w1*dt);
+      evaluateForces();
+      closingKick(w1/2*dt);
+      kickDriftTracers(w1/2*dt, 0);
+      break;
+    }
+
+    case Hermite4:
+      hermiteStep();
+      break;
+
+    case Respa:
+      throw NBodyError() << "the RESPA integrator needs the kernel of "
+                            "NBodySimulationRespa";
+  }
+
+  t += timeStepSize;
+}
+
+/**
+ * Fourth order Hermite predictor-corrector (Makino & Aarseth 1992) with one
+ * evaluation of acceleration and jerk per step:
+ *
+ *   x_p = x + v dt + a dt^2/2 + j dt^3/6,   v_p = v + a dt + j dt^2/2
+ *   a_1, j_1 at (x_p, v_p)
+ *   v_1 = v + (a + a_1) dt/2 + (j - j_1) dt^2/12
+ *   x_1 = x + (v + v_1) dt/2 + (a - a_1) dt^2/12
+ *
+ * If bodies merge at the predicted positions, the bodies no longer match the
+ * saved state, and the predicted state is taken as the new one.
+ */
+void NBodySimulation::hermiteStep () {
+  if (NumberOfTracers > 0) {
+    throw NBodyError() << "the Hermite integrator does not support tracers";
+  }
+  if (hermiteSaved == nullptr) {
+    hermiteStride = ((NumberOfBodies + 7)/8)*8;
+    jx = allocateAligned(hermiteStride);
+    jy = allocateAligned(hermiteStride);
+    jz = allocateAligned(hermiteStride);
+    hermiteSaved = allocateAligned(12*hermiteStride);
+    jerkValid = false;
+  }
+  if (!jerkValid) evaluateForcesAndJerk();
+
+  const int n = hermiteStride;
+  double* x0 = hermiteSaved;
+  double* v0 = x0 + 3*n;
+  double* a0 = v0 + 3*n;
+  double* j0 = a0 + 3*n;
+  std::copy(xx, xx+NumberOfBodies, x0);
+  std::copy(xy, xy+NumberOfBodies, x0+n);
+  std::copy(xz, xz+NumberOfBodies, x0+2*n);
+  std::copy(vx, vx+NumberOfBodies, v0);
+  std::copy(vy, vy+NumberOfBodies, v0+n);
+  std::copy(vz, vz+NumberOfBodies, v0+2*n);
+  std::copy(ax, ax+NumberOfBodies, a0);
+  std::copy(ay, ay+NumberOfBodies, a0+n);
+  std::copy(az, az+NumberOfBodies, a0+2*n);
+  std::copy(jx, jx+NumberOfBodies, j0);
+  std::copy(jy, jy+NumberOfBodies, j0+n);
+  std::copy(jz, jz+NumberOfBodies, j0+2*n);
+
+  hermitePredict(timeStepSize);
+  if (!evaluateForcesAndJerk()) hermiteCorrect(timeStepSize);
+
+  // only the reductions
+  closingKick(0);
+}
+
+void NBodySimulation::kickDrift (double kick, double drift) {
   for (int i = 0; i<NumberOfBodies; ++i){    
-    vx[i] += timeStepSize/2 * ax[i];
-    vy[i] += timeStepSize/2 * ay[i];
-    vz[i] += timeStepSize/2 * az[i];
+    vx[i] += kick * ax[i];
+    vy[i] += kick * ay[i];
+    vz[i] += kick * az[i];
+  
+    xx[i] += drift * vx[i];
+    xy[i] += drift * vy[i];
+    xz[i] += drift * vz[i];
+  }
+}
+
+void NBodySimulation::closingKick (double kick) {
+  double ekin(0), mvx(0), mvy(0), mvz(0), lx(0), ly(0), lz(0), ls(0);
+  for (int i = 0; i<NumberOfBodies; ++i){    
+    vx[i] += kick * ax[i];
+    vy[i] += kick * ay[i];
+    vz[i] += kick * az[i];
     
-    maxV = std::max(maxV, std::sqrt(vx[i]*vx[i] + vy[i]*vy[i] + vz[i]*vz[i]));
+    double v2 = vx[i]*vx[i] + vy[i]*vy[i] + vz[i]*vz[i];
+    maxV = std::max(maxV, std::sqrt(v2));
+
+    // Diagnostics: kinetic energy, momentum and angular momentum
+    ekin += m[i]*v2;
+    mvx  += m[i]*vx[i];
+    mvy  += m[i]*vy[i];
+    mvz  += m[i]*vz[i];
+    lx   += m[i]*(xy[i]*vz[i] - xz[i]*vy[i]);
+    ly   += m[i]*(xz[i]*vx[i] - xx[i]*vz[i]);
+    lz   += m[i]*(xx[i]*vy[i] - xy[i]*vx[i]);
+    ls   += m[i]*std::sqrt((xx[i]*xx[i] + xy[i]*xy[i] + xz[i]*xz[i])*v2);
   }
 
-  t += timeStepSize;
+  kineticEnergy = 0.5*ekin;
+  px = mvx; py = mvy; pz = mvz;
+  Lx = lx;  Ly = ly;  Lz = lz;
+  angularMomentumScale = ls;
+  if (reproducible) accumulate_diagnostics_reproducible();
 }
 
+void NBodySimulation::kickDriftTracers (double kick, double drift) {
+  for (int i = 0; i<NumberOfTracers; ++i){
+    tvx[i] += kick * tax[i];
+    tvy[i] += kick * tay[i];
+    tvz[i] += kick * taz[i];
 
+    txx[i] += drift * tvx[i];
+    txy[i] += drift * tvy[i];
+    txz[i] += drift * tvz[i];
+  }
+}
+
+void NBodySimulation::hermitePredict (double dt) {
+  const double dt2 = dt*dt/2, dt3 = dt*dt*dt/6;
+  for (int i = 0; i<NumberOfBodies; ++i){
+    xx[i] += vx[i]*dt + ax[i]*dt2 + jx[i]*dt3;
+    xy[i] += vy[i]*dt + ay[i]*dt2 + jy[i]*dt3;
+    xz[i] += vz[i]*dt + az[i]*dt2 + jz[i]*dt3;
+    vx[i] += ax[i]*dt + jx[i]*dt2;
+    vy[i] += ay[i]*dt + jy[i]*dt2;
+    vz[i] += az[i]*dt + jz[i]*dt2;
+  }
+}
+
+void NBodySimulation::hermiteCorrect (double dt) {
+  const int n = hermiteStride;
+  const double* x0 = hermiteSaved;
+  const double* v0 = x0 + 3*n;
+  const double* a0 = v0 + 3*n;
+  const double* j0 = a0 + 3*n;
+  const double h = dt/2, h2 = dt*dt/12;
+
+  for (int i = 0; i<NumberOfBodies; ++i){
+    vx[i] = v0[i]     + (a0[i]     + ax[i])*h + (j0[i]     - jx[i])*h2;
+    vy[i] = v0[i+n]   + (a0[i+n]   + ay[i])*h + (j0[i+n]   - jy[i])*h2;
+    vz[i] = v0[i+2*n] + (a0[i+2*n] + az[i])*h + (j0[i+2*n] - jz[i])*h2;
+    xx[i] = x0[i]     + (v0[i]     + vx[i])*h + (a0[i]     - ax[i])*h2;
+    xy[i] = x0[i+n]   + (v0[i+n]   + vy[i])*h + (a0[i+n]   - ay[i])*h2;
+    xz[i] = x0[i+2*n] + (v0[i+2*n] + vz[i])*h + (a0[i+2*n] - az[i])*h2;
+  }
+}
 
 /**
  * Check if simulation has been completed.
@@ -268,7 +1108,8 @@ bool NBodySimulation::hasReachedEnd () {
 
 void NBodySimulation::takeSnapshot () {
   if (t >= tPlot) {
-    printParaviewSnapshot();
+    if (trajectory != nullptr) trajectory->append(*this);
+    else printParaviewSnapshot();
     printSnapshotSummary();
     tPlot += tPlotDelta;
   }
@@ -276,6 +1117,15 @@ void NBodySimulation::takeSnapshot () {
 
 
 void NBodySimulation::openParaviewVideoFile () {
+  // a simulation object that is reused finalises its previous output first
+  if (trajectory != nullptr || videoFile.is_open()) closeParaviewVideoFile();
+
+  if (!trajectoryFileName.empty()) {
+    trajectory = new NBodyTrajectoryWriter(trajectoryFileName,
+      trajectoryFloat32 ? NBodyTrajectory::Float32 : NBodyTrajectory::Float64);
+    return;
+  }
+  snapshotCounter = 0;
   videoFile.open("paraview-output/result.pvd");
   videoFile << "<?xml version=\"1.0\"?>" << std::endl
             << "<VTKFile type=\"Collection\""
@@ -286,32 +1136,74 @@ void NBodySimulation::openParaviewVideoFile () {
 }
 
 void NBodySimulation::closeParaviewVideoFile () {
+  if (trajectory != nullptr) {
+    // close() reports write errors, which the destructor would drop
+    std::unique_ptr<NBodyTrajectoryWriter> writer(trajectory);
+    trajectory = nullptr;
+    writer->close();
+    return;
+  }
   videoFile << "</Collection>"
             << "</VTKFile>" << std::endl;
   videoFile.close();
 }
 
 void NBodySimulation::printParaviewSnapshot () {
-  static int counter = -1;
-  counter++;
+  const int counter = snapshotCounter++;
+  const bool full   = snapshotFilter.fullResolution(t);
+
+  if (snapshotFilter.densityCells > 0) {
+    std::stringstream density;
+    density << "density-" << counter << ".vti";
+    snapshotFilter.writeDensity(*this, "paraview-output/" + density.str());
+    videoFile << "<DataSet timestep=\"" << counter
+              << "\" group=\"\" part=\"1\" file=\"" << density.str()
+              << "\"/>" << std::endl;
+  }
+  if (!full && !snapshotFilter.filtersBodies()) return;
+
   std::stringstream filename, filename_nofolder;
   filename << "paraview-output/result-" << counter <<  ".vtp";
   filename_nofolder << "result-" << counter <<  ".vtp";
+
+  // the bodies and tracers to write, selected in parallel
+  std::vector<int> bodies, tracers;
+  snapshotFilter.select(*this, full, bodies, tracers);
+  const int numberOfBodies  = bodies.size();
+  const int numberOfTracers = tracers.size();
+
   std::ofstream out( filename.str().c_str() );
   out << "<VTKFile type=\"PolyData\" >" << std::endl
       << "<PolyData>" << std::endl
-      << " <Piece NumberOfPoints=\"" << NumberOfBodies << "\">" << std::endl
+      << " <Piece NumberOfPoints=\"" << numberOfBodies + numberOfTracers << "\">" << std::endl
       << "  <Points>" << std::endl
       << "   <DataArray type=\"Float64\""
     " NumberOfComponents=\"3\""
     " format=\"ascii\">";
 
-  for (int i=0; i<NumberOfBodies; i++) {
+  for (int k=0; k<numberOfBodies; k++) {
+    const int i = bodies[k];
     out << xx[i] << " " << xy[i] << " " << xz[i] << " ";
   }
+  for (int k=0; k<numberOfTracers; k++) {
+    const int i = tracers[k];
+    out << txx[i] << " " << txy[i] << " " << txz[i] << " ";
+  }
 
   out << "   </DataArray>" << std::endl
-      << "  </Points>" << std::endl
+      << "  </Points>" << std::endl;
+
+  // the tracers follow the massive bodies, flagged so ParaView can tell them apart
+  if (NumberOfTracers>0) {
+    out << "  <PointData Scalars=\"tracer\">" << std::endl
+        << "   <DataArray type=\"Int8\" Name=\"tracer\" format=\"ascii\">";
+    for (int i=0; i<numberOfBodies; i++)  out << "0 ";
+    for (int i=0; i<numberOfTracers; i++) out << "1 ";
+    out << "   </DataArray>" << std::endl
+        << "  </PointData>" << std::endl;
+  }
+
+  out
       << " </Piece>" << std::endl
       << "</PolyData>" << std::endl
       << "</VTKFile>"  << std::endl;
@@ -333,8 +1225,81 @@ void NBodySimulation::printSnapshotSummary () {
             << std::endl;
 }
 
+void NBodySimulation::openDiagnosticsFile () {
+  diagnosticsFile.open("paraview-output/diagnostics.dat");
+  diagnosticsFile << std::setprecision(15)
+                  << "# time_step t N E_kin E_pot E_tot dE_rel"
+                     " p_x p_y p_z L_x L_y L_z" << std::endl;
+}
+
+void NBodySimulation::closeDiagnosticsFile () {
+  diagnosticsFile.close();
+}
+
+/**
+ * The forces of the initial state are those the first time step starts
+ * with, so they are not evaluated twice. The closing kick without a kick
+ * only sums up the diagnostics.
+ */
+void NBodySimulation::evaluateDiagnostics () {
+  if (!accelerationValid) evaluateForces();
+  closingKick(0);
+}
+
+/**
+ * Merging bodies loses energy, so the reference state is re-taken whenever
+ * the number of bodies changes - the alarm is about integration error only.
+ *
+ * The angular momentum is compared as a vector, so a rotation of L counts
+ * as well. Its drift is relative to the larger of the reference and the
+ * current sum of m|r||v|, as |L| may be close to 0, e.g. for a collapse
+ * from rest.
+ */
+void NBodySimulation::logDiagnostics () {
+  if (!diagnosticsConsistent()) return;
+
+  double E = kineticEnergy + potentialEnergy;
+
+  if (referenceNumberOfBodies != NumberOfBodies) {
+    referenceEnergy = E;
+    referenceLx = Lx;
+    referenceLy = Ly;
+    referenceLz = Lz;
+    referenceLScale = angularMomentumScale;
+    referenceNumberOfBodies = NumberOfBodies;
+    driftAlarmRaised = false;
+  }
+
+  double dE = referenceEnergy != 0.0 ?
+    std::abs((E - referenceEnergy)/referenceEnergy) : std::abs(E);
+  double dLx = Lx - referenceLx, dLy = Ly - referenceLy, dLz = Lz - referenceLz;
+  double dL = std::sqrt(dLx*dLx + dLy*dLy + dLz*dLz);
+  double scale = std::max(referenceLScale, angularMomentumScale);
+  if (scale > 0.0) dL /= scale;
+
+  if (!driftAlarmRaised && (dE > driftTolerance || dL > driftTolerance)) {
+    std::cerr << "warning: conservation drift at time step " << timeStepCounter
+              << ", t=" << t
+              << ": relative energy drift " << dE
+              << ", relative angular momentum drift " << dL
+              << " (tolerance " << driftTolerance << ")" << std::endl;
+    driftAlarmRaised = true;
+  }
+
+  if (diagnosticsFile.is_open()) {
+    diagnosticsFile << timeStepCounter << " " << t << " " << NumberOfBodies
+                    << " " << kineticEnergy << " " << potentialEnergy
+                    << " " << E << " " << dE
+                    << " " << px << " " << py << " " << pz
+                    << " " << Lx << " " << Ly << " " << Lz << std::endl;
+  }
+}
+
 void NBodySimulation::printSummary () {
   std::cout << "Number of remaining objects: " << NumberOfBodies << std::endl;
+  if (NumberOfTracers>0) {
+    std::cout << "Number of tracers: " << NumberOfTracers << std::endl;
+  }
   std::cout << "Position of first remaining object: "
             << xx[0] << ", " << xy[0] << ", " << xz[0] << std::endl;
 }
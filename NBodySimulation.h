@@ -1,9 +1,26 @@
+#ifndef NBODYSIMULATION_H
+#define NBODYSIMULATION_H
+
 #include <cmath>
 
 #include <fstream>
 #include <iostream>
 #include <limits>
 #include <sstream>
+#include <string>
+
+#include "NBodyError.h"
+#include "NBodySnapshotFilter.h"
+
+class NBodyTrajectoryWriter;
+
+/**
+ * Default number of massive bodies streamed through the cache at a time by
+ * the tracer kernel of steps 3 and 4. Four arrays of 512 doubles take 16 kB.
+ */
+#ifndef TRACER_SOURCE_TILE
+#define TRACER_SOURCE_TILE 512
+#endif
 
 class NBodySimulation {
 public:
@@ -32,6 +49,48 @@ public:
   
   double* m  __attribute__((aligned(64)));
 
+  /**
+   * Identity of every body, its position in the setup. A merged body keeps
+   * the id of its member with the smallest index, see process_collisions().
+   */
+  int* id;
+
+  /**
+   * Tracers: bodies of mass zero, given with mass 0 on the command line.
+   * They feel the gravity of the massive bodies above but exert none and
+   * never merge, so they are kept in a separate partition of the same
+   * layout and NumberOfBodies counts the massive bodies only.
+   */
+  int NumberOfTracers;
+
+  double* txx __attribute__((aligned(64)));
+  double* txy __attribute__((aligned(64)));
+  double* txz __attribute__((aligned(64)));
+
+  double* tvx __attribute__((aligned(64)));
+  double* tvy __attribute__((aligned(64)));
+  double* tvz __attribute__((aligned(64)));
+
+  double* tax __attribute__((aligned(64)));
+  double* tay __attribute__((aligned(64)));
+  double* taz __attribute__((aligned(64)));
+
+  int* tid;
+
+  /**
+   * Tile of massive bodies of the tracer kernel, see TRACER_SOURCE_TILE.
+   * Set by the auto-tuner.
+   */
+  int tracerSourceTile;
+
+  /**
+   * Length of the allocated body and tracer arrays. They are only
+   * reallocated if a system does not fit, so a simulation object can be
+   * reused for many systems.
+   */
+  int bodyCapacity;
+  int tracerCapacity;
+
   // C = 10^(-2)/NumberOfBodies
   double C;
 
@@ -50,13 +109,114 @@ public:
    */
   double minDx;
 
+  /**
+   * Conserved quantities of the current state. The potential energy is
+   * accumulated in the force pass, where the pairwise distance is already
+   * known, and the rest in the closing kick of the time step, so no extra
+   * pass over the bodies is needed.
+   */
+  double kineticEnergy;
+  double potentialEnergy;
+  double px, py, pz;
+  double Lx, Ly, Lz;
+
+  /**
+   * Sum of m|r||v| over the bodies, the scale of the angular momentum
+   * drift. Unlike |L| it does not vanish for systems without rotation.
+   */
+  double angularMomentumScale;
+
+  /**
+   * Reference values the drift alarms compare against, taken at t=0. They
+   * are re-taken whenever bodies merge, as merging does not conserve
+   * energy.
+   */
+  double referenceEnergy;
+  double referenceLx, referenceLy, referenceLz;
+  double referenceLScale;
+  int    referenceNumberOfBodies;
+
+  /**
+   * Relative drift of total energy, or drift of the angular momentum
+   * vector relative to angularMomentumScale, above which a warning is
+   * printed to the error stream.
+   */
+  double driftTolerance;
+  bool   driftAlarmRaised;
+
+  /**
+   * Reproducible-summation mode. All kernels then compute the acceleration
+   * of every body as a fixed-order pairwise sum over all other bodies, so
+   * results are bitwise identical for any kernel, thread count and SIMD
+   * width. Switched on with NBODY_REPRODUCIBLE=1.
+   */
+  bool reproducible;
+
+  /**
+   * Time integration scheme, selected with NBODY_INTEGRATOR:
+   *
+   * - StoermerVerlet (verlet): second order, one force evaluation per step.
+   * - Yoshida4 (yoshida or forest-ruth): fourth order symplectic
+   *   composition of three Stoermer-Verlet steps, three force evaluations
+   *   per step.
+   * - Hermite4 (hermite): fourth order predictor-corrector using the jerk,
+   *   one force and jerk evaluation per step.
+   * - Respa (respa): multiple time stepping with separate near and far
+   *   forces, only provided by NBodySimulationRespa.
+   */
+  enum Integrator { StoermerVerlet, Yoshida4, Hermite4, Respa };
+  Integrator integrator;
+
+  /**
+   * Number of force evaluations so far.
+   */
+  int forceEvaluations;
+
+  /**
+   * Whether ax, ay, az (and jx, jy, jz) belong to the current positions.
+   */
+  bool accelerationValid;
+  bool jerkValid;
+
+  /**
+   * Jerk and the state at the beginning of the step, only allocated for the
+   * Hermite integrator. The saved state holds x, v, a and j as twelve arrays
+   * of length hermiteStride.
+   */
+  double* jx __attribute__((aligned(64)));
+  double* jy __attribute__((aligned(64)));
+  double* jz __attribute__((aligned(64)));
+  double* hermiteSaved __attribute__((aligned(64)));
+  int     hermiteStride;
+
+  /**
+   * Stream for the diagnostics time series.
+   */
+  std::ofstream diagnosticsFile;
+
   /**
    * Stream for video output file.
    */
   std::ofstream videoFile;
 
   /**
-   * Output counters.
+   * Single-file trajectory replacing the .vtp snapshots, written if
+   * NBODY_TRAJECTORY names a file. NBODY_TRAJECTORY_PRECISION=float32
+   * selects the quantised format, see NBodyTrajectory.h.
+   */
+  std::string            trajectoryFileName;
+  bool                   trajectoryFloat32;
+  NBodyTrajectoryWriter* trajectory;
+
+  /**
+   * Subsampling, region of interest and density output of the ParaView
+   * snapshots, see NBodySnapshotFilter.h.
+   */
+  NBodySnapshotFilter snapshotFilter;
+
+  /**
+   * Output counters. snapshotCounter numbers the ParaView files of this
+   * simulation and restarts with every openParaviewVideoFile().
    */
   int snapshotCounter;
   int timeStepCounter;
@@ -64,7 +224,7 @@ public:
 
 // public:
   NBodySimulation ();
-  ~NBodySimulation ();
+  virtual ~NBodySimulation ();
 
   /**
    * Check that the number command line parameters is correct.
@@ -83,14 +243,89 @@ public:
    */
   void setUp (int argc, char** argv);
 
-  bool process_gravity_and_detect_collision();
-  void process_collisions();
-  void handle_collision(int i, int j);
+  /**
+   * Allocate the aligned body arrays for a given number of bodies, or reuse
+   * them if they are large enough. Used by setUp() and by the engine when
+   * creating a system from memory.
+   */
+  void allocateBodies (int numberOfBodies);
+  void allocateTracers (int numberOfTracers);
+  static double* allocateAligned (int n);
+  void freeHermiteData ();
+
+  /**
+   * Exchange the complete state, including the arrays and output streams,
+   * with another simulation. Used to move a running system to a different
+   * kernel, so it has to list every member of this class.
+   */
+  void swapState (NBodySimulation& other);
+
+  /**
+   * Read the optional settings that are not part of the command line from
+   * NBODY_* environment variables.
+   */
+  virtual void readEnvironmentOptions ();
+
+  virtual bool process_gravity_and_detect_collision();
+
+  /**
+   * Merge all bodies that collide, including chains of collisions, into
+   * one body per group. Parallel and independent of the number of threads.
+   * The accelerations are overwritten, the caller has to recompute them.
+   */
+  virtual void process_collisions();
+
+  /**
+   * Force pass computing the jerk as well, for the Hermite integrator.
+   */
+  virtual bool process_gravity_jerk_and_detect_collision();
+
+  /**
+   * Acceleration of the tracers due to the massive bodies, an
+   * N_massive x N_tracer pass.
+   */
+  virtual void process_tracers();
+
+  /**
+   * Force evaluation including collision handling and the tracers. The jerk
+   * variant returns whether bodies merged.
+   */
+  void evaluateForces ();
+  bool evaluateForcesAndJerk ();
+
+  /**
+   * Building blocks of the integrators, implemented by every kernel:
+   * v += kick*a followed by x += drift*v; the last kick of a step, which also
+   * reduces maxV and the diagnostics; and prediction and correction of the
+   * Hermite scheme.
+   */
+  virtual void kickDrift (double kick, double drift);
+  virtual void closingKick (double kick);
+  virtual void hermitePredict (double dt);
+  virtual void hermiteCorrect (double dt);
+  void hermiteStep ();
+
+  /**
+   * kickDrift() for the tracers. The closing kick is the one with drift 0.
+   */
+  virtual void kickDriftTracers (double kick, double drift);
+
+  /**
+   * Force pass and diagnostics of the reproducible-summation mode.
+   */
+  bool process_gravity_reproducible();
+  void process_tracers_reproducible();
+  void accumulate_diagnostics_reproducible();
+
+  /**
+   * Sum of a[0..n) in an order that depends on n only.
+   */
+  static double pairwiseSum(const double* a, int n);
   
   /**
    * Implement timestepping scheme and force updates.
    */
-  void updateBody ();
+  virtual void updateBody ();
 
   /**
    * Check if the last time step has been reached (simulation is completed).
@@ -107,7 +342,11 @@ public:
   void takeSnapshot ();
 
   /**
-   * Handle Paraview output.
+   * Handle Paraview output. With NBODY_TRAJECTORY set, the snapshots go to
+   * the trajectory file instead. The NBODY_SNAPSHOT_* options reduce the
+   * .vtp snapshots, see snapshotFilter. Opening again closes the previous
+   * output first; closing throws NBodyError if the trajectory cannot be
+   * written.
    *
    * These operations are not to be changed in the assignment.
    *
@@ -126,4 +365,28 @@ public:
   void printSnapshotSummary ();
   void printSummary ();
 
+  /**
+   * Handle diagnostics output.
+   *
+   * One line per time step with energy, momentum and angular momentum. The
+   * values are the ones accumulated by the last call to updateBody(), so
+   * logging is O(1). Before the first step, evaluateDiagnostics() computes
+   * them for the initial state, so the drift is measured from t=0. The
+   * molecular forces of step 2 accumulate no energy, so step 2 writes no
+   * diagnostics and has no drift alarm. Steps after which
+   * diagnosticsConsistent() is false are not logged.
+   */
+  void openDiagnosticsFile ();
+  void closeDiagnosticsFile ();
+  void evaluateDiagnostics ();
+  void logDiagnostics ();
+
+  /**
+   * Whether the kinetic and the potential energy belong to the same state.
+   * RESPA updates the potential energy only at the end of a block.
+   */
+  virtual bool diagnosticsConsistent () const { return true; }
+
 };
+
+#endif
@@ -0,0 +1,310 @@
+#ifndef NBODYSIMULATIONDISTRIBUTED_CPP
+#define NBODYSIMULATIONDISTRIBUTED_CPP
+
+#include <mpi.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "NBodySimulationParallelised.cpp"
+
+/**
+ * Number of pieces the local bodies are split into while a block travels
+ * around the ring. MPI is polled between the pieces, so that the transfer
+ * of the next block progresses during the force computation.
+ */
+#ifndef RING_PROGRESS_CHUNKS
+#define RING_PROGRESS_CHUNKS 8
+#endif
+
+/**
+ * Hybrid MPI+OpenMP version of step 4 (systolic ring, e.g. Pacheco,
+ * Parallel Programming with MPI, ch. 13).
+ *
+ * Every rank owns a contiguous slice of the bodies, N*rank/P to
+ * N*(rank+1)/P, in the usual aligned SoA arrays, so NumberOfBodies is the
+ * local count and the integrators of the base classes work unchanged on
+ * the slice. For the forces, the positions and masses of the slices are
+ * passed around a ring of the ranks in P-1 shifts. While one block is sent
+ * on with MPI_Isend and the next one received with MPI_Irecv, the local
+ * bodies interact with the current block in the vectorised, OpenMP
+ * parallel loop of step 4. Symmetry is not exploited, as the reaction
+ * forces would have to travel back.
+ *
+ * maxV, minDx, the collision test and the conserved quantities are reduced
+ * over all ranks, so every rank sees the global values. When bodies
+ * collide, all bodies are gathered on every rank, merged with
+ * process_collisions() of the base class, which gives the same result
+ * everywhere, and distributed anew.
+ *
+ * MPI is only called outside of parallel regions (MPI_THREAD_FUNNELED).
+ * Tracers, the Hermite and RESPA integrators and the reproducible mode are
+ * not supported.
+ */
+class NBodySimulationDistributed : public NBodySimulationParallelised {
+public:
+  explicit NBodySimulationDistributed (MPI_Comm communicator) :
+    comm(communicator), globalNumberOfBodies(0), ringCapacity(0) {
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &ranks);
+    ring[0] = ring[1] = nullptr;
+  }
+
+  ~NBodySimulationDistributed () {
+    if (ring[0] != nullptr) free(ring[0]);
+    if (ring[1] != nullptr) free(ring[1]);
+  }
+
+  int rankOf () const { return rank; }
+
+  void readEnvironmentOptions () {
+    NBodySimulationParallelised::readEnvironmentOptions();
+    if (reproducible) {
+      throw NBodyError() << "the MPI version has no reproducible-summation mode";
+    }
+    if (integrator == Hermite4 || integrator == Respa) {
+      throw NBodyError() << "the MPI version supports the verlet and yoshida integrators only";
+    }
+  }
+
+  /**
+   * Keep this rank's slice of the system that every rank has set up.
+   */
+  void distribute () {
+    if (NumberOfTracers > 0) {
+      throw NBodyError() << "the MPI version does not support tracers";
+    }
+    globalNumberOfBodies = NumberOfBodies;
+    partition();
+
+    const int begin = offsets[rank], count = counts[rank];
+    double* fields[] = { xx, xy, xz, vx, vy, vz, m };
+    for (int f = 0; f < 7; ++f) std::copy(fields[f]+begin, fields[f]+begin+count, fields[f]);
+    std::copy(id+begin, id+begin+count, id);
+    NumberOfBodies = count;
+  }
+
+  /**
+   * Copy the time, counters and global diagnostics into output on rank 0,
+   * and with bodies set all bodies as well, in the order of the setup.
+   * Collective.
+   */
+  void gather (NBodySimulation& output, bool bodies) {
+    if (bodies) {
+      if (rank == 0) output.allocateBodies(globalNumberOfBodies);
+      double* local[]  = { xx, xy, xz, vx, vy, vz, m };
+      double* global[] = { output.xx, output.xy, output.xz,
+                           output.vx, output.vy, output.vz, output.m };
+      for (int f = 0; f < 7; ++f) {
+        MPI_Gatherv(local[f], NumberOfBodies, MPI_DOUBLE,
+                    global[f], counts.data(), offsets.data(), MPI_DOUBLE, 0, comm);
+      }
+      MPI_Gatherv(id, NumberOfBodies, MPI_INT,
+                  output.id, counts.data(), offsets.data(), MPI_INT, 0, comm);
+    }
+    if (rank != 0) return;
+
+    output.NumberOfBodies  = globalNumberOfBodies;
+    output.t               = t;
+    output.tFinal          = tFinal;
+    output.tPlot           = tPlot;
+    output.tPlotDelta      = tPlotDelta;
+    output.timeStepSize    = timeStepSize;
+    output.timeStepCounter = timeStepCounter;
+    output.maxV            = maxV;
+    output.minDx           = minDx;
+    output.kineticEnergy   = kineticEnergy;
+    output.potentialEnergy = potentialEnergy;
+    output.px = px; output.py = py; output.pz = pz;
+    output.Lx = Lx; output.Ly = Ly; output.Lz = Lz;
+    output.angularMomentumScale = angularMomentumScale;
+  }
+
+private:
+  MPI_Comm         comm;
+  int              rank, ranks;
+  int              globalNumberOfBodies;
+  std::vector<int> counts, offsets;
+
+  /**
+   * Two blocks of ringCapacity positions x, y, z and masses each, one for
+   * the block in use and one for the block arriving.
+   */
+  int     ringCapacity;
+  double* ring[2];
+
+  /**
+   * All bodies, only while collisions are processed.
+   */
+  NBodySimulation all;
+
+  void partition () {
+    counts.resize(ranks);
+    offsets.resize(ranks);
+    for (int r = 0; r < ranks; ++r) {
+      offsets[r] = static_cast<long>(globalNumberOfBodies)*r/ranks;
+      counts[r]  = static_cast<long>(globalNumberOfBodies)*(r+1)/ranks - offsets[r];
+    }
+    const int largest = *std::max_element(counts.begin(), counts.end());
+    if (largest > ringCapacity) {
+      if (ring[0] != nullptr) free(ring[0]);
+      if (ring[1] != nullptr) free(ring[1]);
+      ringCapacity = ((largest + 7)/8)*8;
+      ring[0] = allocateAligned(4*ringCapacity);
+      ring[1] = allocateAligned(4*ringCapacity);
+    }
+    // allocateBodies() sets C for the local count
+    C = 1e-2/globalNumberOfBodies;
+  }
+
+  /**
+   * Forces of the block on the local bodies [begin, end). In the own block
+   * (self) body i skips itself.
+   */
+  void interact (const double* block, int count, bool self, int begin, int end,
+                 double& minDst, double& minC, double& epot) {
+    const double* bxx = block;
+    const double* bxy = block + ringCapacity;
+    const double* bxz = block + 2*ringCapacity;
+    const double* bm  = block + 3*ringCapacity;
+    double m_minDx(minDst), m_minC(minC), m_epot(epot);
+
+    #pragma omp parallel for reduction(min:m_minDx,m_minC) reduction(+:m_epot)
+    for (int i = begin; i < end; ++i){
+      double axi(0),ayi(0),azi(0),epi(0);
+      const double xxi(xx[i]), xyi(xy[i]), xzi(xz[i]), mi(m[i]);
+      const int skip = self ? i : -1;
+
+      double t_minDx = std::numeric_limits<double>::max();
+      double t_minC  = std::numeric_limits<double>::max();
+
+      #pragma omp simd reduction(+:axi,ayi,azi,epi) reduction(min:t_minDx,t_minC)
+      for (int j = 0; j < count; ++j){
+        double dx = bxx[j]-xxi;
+        double dy = bxy[j]-xyi;
+        double dz = bxz[j]-xzi;
+        double dst2 = dx*dx + dy*dy + dz*dz;
+        double dst = std::sqrt(dst2);
+        bool same = j == skip;
+        double inv  = same ? 0.0 : 1.0/dst;
+        double inv3 = inv*inv*inv;
+
+        axi += dx*inv3*bm[j];
+        ayi += dy*inv3*bm[j];
+        azi += dz*inv3*bm[j];
+        epi += bm[j]*inv;
+
+        double far = std::numeric_limits<double>::max();
+        t_minC  = std::min(t_minC,  same ? far : dst/(mi + bm[j]));
+        t_minDx = std::min(t_minDx, same ? far : dst);
+      }
+
+      ax[i] += axi;
+      ay[i] += ayi;
+      az[i] += azi;
+      m_epot  -= mi*epi;
+      m_minC  = std::min(m_minC, t_minC);
+      m_minDx = std::min(m_minDx, t_minDx);
+    }
+
+    minDst = m_minDx;
+    minC   = m_minC;
+    epot   = m_epot;
+  }
+
+  bool process_gravity_and_detect_collision () {
+    const int n = NumberOfBodies;
+    std::fill(ax, ax+n, 0);
+    std::fill(ay, ay+n, 0);
+    std::fill(az, az+n, 0);
+    double m_minDx = std::numeric_limits<double>::max();
+    double m_minC  = std::numeric_limits<double>::max();
+    double m_epot  = 0;
+
+    std::copy(xx, xx+n, ring[0]);
+    std::copy(xy, xy+n, ring[0] + ringCapacity);
+    std::copy(xz, xz+n, ring[0] + 2*ringCapacity);
+    std::copy(m,  m+n,  ring[0] + 3*ringCapacity);
+
+    const int right = (rank + 1) % ranks;
+    const int left  = (rank + ranks - 1) % ranks;
+    const int chunk = std::max(1, (n + RING_PROGRESS_CHUNKS - 1)/RING_PROGRESS_CHUNKS);
+
+    for (int shift = 0; shift < ranks; ++shift) {
+      double* block = ring[shift % 2];
+      double* next  = ring[(shift+1) % 2];
+      const int source = (rank + ranks - shift) % ranks;
+
+      MPI_Request requests[2];
+      bool pending = shift < ranks-1;
+      if (pending) {
+        MPI_Irecv(next,  4*ringCapacity, MPI_DOUBLE, left,  shift, comm, &requests[0]);
+        MPI_Isend(block, 4*ringCapacity, MPI_DOUBLE, right, shift, comm, &requests[1]);
+      }
+
+      for (int begin = 0; begin < n; begin += chunk) {
+        interact(block, counts[source], shift == 0, begin, std::min(n, begin+chunk),
+                 m_minDx, m_minC, m_epot);
+        if (pending) {
+          int done = 0;
+          MPI_Testall(2, requests, &done, MPI_STATUSES_IGNORE);
+          pending = !done;
+        }
+      }
+      if (pending) MPI_Waitall(2, requests, MPI_STATUSES_IGNORE);
+    }
+
+    double minima[2] = { m_minDx, m_minC };
+    MPI_Allreduce(MPI_IN_PLACE, minima, 2, MPI_DOUBLE, MPI_MIN, comm);
+    MPI_Allreduce(MPI_IN_PLACE, &m_epot, 1, MPI_DOUBLE, MPI_SUM, comm);
+
+    minDx = minima[0];
+    // every pair has been visited twice
+    potentialEnergy = 0.5*m_epot;
+    return minima[1] <= C;
+  }
+
+  void process_collisions () {
+    all.allocateBodies(globalNumberOfBodies);
+    double* local[]  = { xx, xy, xz, vx, vy, vz, m };
+    double* global[] = { all.xx, all.xy, all.xz, all.vx, all.vy, all.vz, all.m };
+    for (int f = 0; f < 7; ++f) {
+      MPI_Allgatherv(local[f], NumberOfBodies, MPI_DOUBLE,
+                     global[f], counts.data(), offsets.data(), MPI_DOUBLE, comm);
+    }
+    MPI_Allgatherv(id, NumberOfBodies, MPI_INT,
+                   all.id, counts.data(), offsets.data(), MPI_INT, comm);
+
+    all.C = C;
+    all.process_collisions();
+
+    globalNumberOfBodies = all.NumberOfBodies;
+    const double c = C;
+    partition();
+    allocateBodies(counts[rank]);
+    C = c;
+
+    const int begin = offsets[rank];
+    double* merged[] = { all.xx, all.xy, all.xz, all.vx, all.vy, all.vz, all.m };
+    double* fields[] = { xx, xy, xz, vx, vy, vz, m };
+    for (int f = 0; f < 7; ++f) {
+      std::copy(merged[f]+begin, merged[f]+begin+NumberOfBodies, fields[f]);
+    }
+    std::copy(all.id+begin, all.id+begin+NumberOfBodies, id);
+  }
+
+public:
+  void closingKick (double kick) {
+    NBodySimulationParallelised::closingKick(kick);
+
+    MPI_Allreduce(MPI_IN_PLACE, &maxV, 1, MPI_DOUBLE, MPI_MAX, comm);
+    double sums[8] = { kineticEnergy, px, py, pz, Lx, Ly, Lz, angularMomentumScale };
+    MPI_Allreduce(MPI_IN_PLACE, sums, 8, MPI_DOUBLE, MPI_SUM, comm);
+    kineticEnergy = sums[0];
+    px = sums[1]; py = sums[2]; pz = sums[3];
+    Lx = sums[4]; Ly = sums[5]; Lz = sums[6];
+    angularMomentumScale = sums[7];
+  }
+};
+
+#endif
@@ -0,0 +1,353 @@
+#ifndef NBODYSIMULATIONMOLECULARFORCES_CPP
+#define NBODYSIMULATIONMOLECULARFORCES_CPP
+
+#ifndef CUTOFF_RADIUS
+#define CUTOFF_RADIUS 1e-1      // cutoff radius for short-distance force
+#endif
+
+/**
+ * Cells are packed into blocks whose length is a multiple of this many
+ * doubles, one cache line, so that every block starts aligned.
+ */
+#ifndef MOLECULAR_CELL_PADDING
+#define MOLECULAR_CELL_PADDING 8
+#endif
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "Grid.h"
+#include "NBodySimulation.h"
+#include "PairForceTable.h"
+
+/**
+ * Force factor f(r^2) of the model, such that body i feels f (x_i-x_j).
+ */
+struct MolecularForce {
+  inline double operator() (double dst2) const {
+    double a = 0.1/std::sqrt(dst2);   // 0.1/r
+    double b = a*a; b*=b;             // b := (0.1/r)^4
+    double c = b*b*a;                 // c := (0.1/r)^9
+    return 10 * c * (b - 1);
+  }
+};
+
+/**
+ * O(N) simulation of molecular forces with cutoff radius
+*/
+class NBodySimulationMolecularForces : public NBodySimulation {
+private:
+  Grid grid;
+
+  /**
+   * Positions of the bodies packed cell by cell, and the forces on them.
+   * Cells are numbered by their grid slot, and cell c occupies
+   * [cellStart[c], cellStart[c]+cellSize[c]), padded up to cellStart[c+1].
+   * packedBody maps back to the body arrays, and is -1 for the padding.
+   * Each occupied cell lists the occupied neighbour cells with a larger
+   * slot, so every pair of cells is visited once.
+   *
+   * The kernel works on one cell at a time. The cell and its listed
+   * neighbours are gathered into the block arrays bx, ..., so that every
+   * body of the cell interacts with one contiguous range: the bodies after
+   * it in the block. With some 20 bodies per cell, the 27 ranges of one
+   * body per cell would be too short for SIMD.
+   */
+  int     packedCapacity;
+  double* px  __attribute__((aligned(64)));
+  double* py  __attribute__((aligned(64)));
+  double* pz  __attribute__((aligned(64)));
+  double* pfx __attribute__((aligned(64)));
+  double* pfy __attribute__((aligned(64)));
+  double* pfz __attribute__((aligned(64)));
+  std::vector<int> packedBody;
+  std::vector<int> cellStart, cellSize;
+  std::vector<int> neighbourStart, neighbours;
+
+  int     blockCapacity;
+  double* bx  __attribute__((aligned(64)));
+  double* by  __attribute__((aligned(64)));
+  double* bz  __attribute__((aligned(64)));
+  double* bfx __attribute__((aligned(64)));
+  double* bfy __attribute__((aligned(64)));
+  double* bfz __attribute__((aligned(64)));
+
+public:
+  /**
+   * Tabulated pair force, used instead of MolecularForce unless empty.
+   * Selected by NBODY_MOLECULAR_FORCE: analytic (the default), table for
+   * the tabulated MolecularForce, or the name of a file with the force to
+   * use (see PairForceTable::load).
+   */
+  PairForceTable forceTable;
+
+  NBodySimulationMolecularForces () :
+    packedCapacity(0), px(nullptr), py(nullptr), pz(nullptr),
+    pfx(nullptr), pfy(nullptr), pfz(nullptr),
+    blockCapacity(0), bx(nullptr), by(nullptr), bz(nullptr),
+    bfx(nullptr), bfy(nullptr), bfz(nullptr) {}
+
+  ~NBodySimulationMolecularForces () {
+    if (px  != nullptr) free(px);
+    if (py  != nullptr) free(py);
+    if (pz  != nullptr) free(pz);
+    if (pfx != nullptr) free(pfx);
+    if (pfy != nullptr) free(pfy);
+    if (pfz != nullptr) free(pfz);
+    if (bx  != nullptr) free(bx);
+    if (by  != nullptr) free(by);
+    if (bz  != nullptr) free(bz);
+    if (bfx != nullptr) free(bfx);
+    if (bfy != nullptr) free(bfy);
+    if (bfz != nullptr) free(bfz);
+  }
+
+  void readEnvironmentOptions () {
+    NBodySimulation::readEnvironmentOptions();
+
+    const char* value = std::getenv("NBODY_MOLECULAR_FORCE");
+    std::string name = value != nullptr ? value : "analytic";
+    if (name == "analytic") {
+      forceTable = PairForceTable();
+      return;
+    }
+    if (name == "table") forceTable.tabulate(MolecularForce(), CUTOFF_RADIUS);
+    else                 forceTable.load(name, CUTOFF_RADIUS);
+
+    std::cout << "pair force table " << (name == "table" ? "of the analytic force" : name)
+              << ": r in [" << forceTable.minR << ", " << std::sqrt(forceTable.cutoff2)
+              << "], max relative error " << forceTable.maxError << std::endl;
+  }
+
+  void setUpGrid(double cell_size){
+    grid = Grid(cell_size);
+    grid.build(NumberOfBodies, xx, xy, xz);
+  }
+
+  const Grid& cellGrid() const { return grid; }
+
+  /**
+   * Copy the positions into per-cell blocks and list the neighbour cells.
+   * All vectors keep their capacity from step to step.
+   */
+  void packCells(){
+    const int numberOfCells = grid.numberOfSlots;
+    cellStart.resize(numberOfCells+1);
+    cellSize.resize(numberOfCells);
+    cellStart[0] = 0;
+    for (int c = 0; c < numberOfCells; ++c){
+      cellSize[c] = grid.members[c].size();
+      int padded = (cellSize[c] + MOLECULAR_CELL_PADDING-1) / MOLECULAR_CELL_PADDING;
+      cellStart[c+1] = cellStart[c] + padded*MOLECULAR_CELL_PADDING;
+    }
+
+    const int packedSize = cellStart.back();
+    if (packedSize > packedCapacity){
+      if (px  != nullptr) free(px);
+      if (py  != nullptr) free(py);
+      if (pz  != nullptr) free(pz);
+      if (pfx != nullptr) free(pfx);
+      if (pfy != nullptr) free(pfy);
+      if (pfz != nullptr) free(pfz);
+      packedCapacity = packedSize + packedSize/2;
+      px  = allocateAligned(packedCapacity);
+      py  = allocateAligned(packedCapacity);
+      pz  = allocateAligned(packedCapacity);
+      pfx = allocateAligned(packedCapacity);
+      pfy = allocateAligned(packedCapacity);
+      pfz = allocateAligned(packedCapacity);
+    }
+    packedBody.resize(packedSize);
+
+    neighbourStart.resize(numberOfCells+1);
+    neighbourStart[0] = 0;
+    neighbours.clear();
+    for (int c = 0; c < numberOfCells; ++c){
+      int k = cellStart[c];
+      for (int i : grid.members[c]){
+        px[k] = xx[i];
+        py[k] = xy[i];
+        pz[k] = xz[i];
+        packedBody[k] = i;
+        k++;
+      }
+      // the padding only aligns the next cell and is never interacted with
+      for ( ; k < cellStart[c+1]; ++k){
+        px[k] = py[k] = pz[k] = 0;
+        packedBody[k] = -1;
+      }
+
+      if (cellSize[c] > 0){
+        for (int d = 0; d < 27; ++d){
+          const int neighbour = grid.adjacency[27*c + d];
+          if (neighbour > c && cellSize[neighbour] > 0) neighbours.push_back(neighbour);
+        }
+      }
+      neighbourStart[c+1] = neighbours.size();
+    }
+
+    std::fill(pfx, pfx+packedSize, 0);
+    std::fill(pfy, pfy+packedSize, 0);
+    std::fill(pfz, pfz+packedSize, 0);
+  }
+
+  /**
+   * Gather cell c and its listed neighbours into the block arrays. Returns
+   * the length of the block.
+   */
+  int gatherBlock(int c){
+    int length = cellSize[c];
+    for (int n = neighbourStart[c]; n < neighbourStart[c+1]; ++n){
+      length += cellSize[neighbours[n]];
+    }
+    if (length > blockCapacity){
+      if (bx  != nullptr) free(bx);
+      if (by  != nullptr) free(by);
+      if (bz  != nullptr) free(bz);
+      if (bfx != nullptr) free(bfx);
+      if (bfy != nullptr) free(bfy);
+      if (bfz != nullptr) free(bfz);
+      blockCapacity = 2*length;
+      bx  = allocateAligned(blockCapacity);
+      by  = allocateAligned(blockCapacity);
+      bz  = allocateAligned(blockCapacity);
+      bfx = allocateAligned(blockCapacity);
+      bfy = allocateAligned(blockCapacity);
+      bfz = allocateAligned(blockCapacity);
+    }
+
+    int k = 0;
+    for (int n = neighbourStart[c]-1; n < neighbourStart[c+1]; ++n){
+      const int b = n < neighbourStart[c] ? c : neighbours[n];
+      std::copy(px+cellStart[b], px+cellStart[b]+cellSize[b], bx+k);
+      std::copy(py+cellStart[b], py+cellStart[b]+cellSize[b], by+k);
+      std::copy(pz+cellStart[b], pz+cellStart[b]+cellSize[b], bz+k);
+      k += cellSize[b];
+    }
+    std::fill(bfx, bfx+length, 0);
+    std::fill(bfy, bfy+length, 0);
+    std::fill(bfz, bfz+length, 0);
+    return length;
+  }
+
+  /**
+   * Add the forces of the block to the packed forces of its cells.
+   */
+  void scatterBlock(int c){
+    int k = 0;
+    for (int n = neighbourStart[c]-1; n < neighbourStart[c+1]; ++n){
+      const int b = n < neighbourStart[c] ? c : neighbours[n];
+      for (int j = 0; j < cellSize[b]; ++j, ++k){
+        pfx[cellStart[b]+j] += bfx[k];
+        pfy[cellStart[b]+j] += bfy[k];
+        pfz[cellStart[b]+j] += bfz[k];
+      }
+    }
+  }
+
+  /**
+   * Forces between block body i and the block bodies [i+1, length), added
+   * to both sides. The cutoff is a mask, so the loop has no branch.
+   */
+  template <class Force>
+  void interact(int i, int length, const Force& force, double cutoff2, double& minDst2){
+    double fxi(0), fyi(0), fzi(0), m_minDst2(minDst2);
+    const double xi(bx[i]), yi(by[i]), zi(bz[i]);
+    #pragma omp simd reduction(+:fxi,fyi,fzi) reduction(min:m_minDst2)
+    for (int j = i+1; j < length; ++j){
+      double dx = xi - bx[j];
+      double dy = yi - by[j];
+      double dz = zi - bz[j];
+      double dst2 = dx*dx + dy*dy + dz*dz;
+      m_minDst2 = std::min(m_minDst2, dst2);
+
+      double fmag = dst2 <= cutoff2 ? force(dst2) : 0.0;
+
+      fxi += fmag*dx;
+      fyi += fmag*dy;
+      fzi += fmag*dz;
+      bfx[j] -= fmag*dx;
+      bfy[j] -= fmag*dy;
+      bfz[j] -= fmag*dz;
+    }
+    bfx[i] += fxi;
+    bfy[i] += fyi;
+    bfz[i] += fzi;
+    minDst2 = m_minDst2;
+  }
+
+  /**
+   * Cell-pair kernel: the bodies of every cell interact with the later
+   * bodies of the same cell and with all bodies of the neighbour cells it
+   * lists, each pair once.
+   */
+  void process_interactions(){
+    packCells();
+
+    double minDst2 = std::numeric_limits<double>::max();
+    for (int c = 0; c < static_cast<int>(cellSize.size()); ++c){
+      if (cellSize[c] == 0) continue;
+      const int length = gatherBlock(c);
+      for (int i = 0; i < cellSize[c]; ++i){
+        if (forceTable.empty()) interact(i, length, MolecularForce(), CUTOFF_RADIUS*CUTOFF_RADIUS, minDst2);
+        else                    interact(i, length, forceTable, forceTable.cutoff2, minDst2);
+      }
+      scatterBlock(c);
+    }
+    minDx = std::min(minDx, std::sqrt(minDst2));
+
+    for (int k = 0; k < cellStart.back(); ++k){
+      const int i = packedBody[k];
+      if (i < 0) continue;
+      ax[i] = pfx[k]/m[i];
+      ay[i] = pfy[k]/m[i];
+      az[i] = pfz[k]/m[i];
+    }
+  }
+
+  void updateBody(){
+    if (NumberOfTracers > 0) {
+      throw NBodyError() << "the molecular forces model does not support tracers";
+    }
+    timeStepCounter++;
+    maxV   = 0.0;
+    minDx  = std::numeric_limits<double>::max();
+
+    for (int i = 0; i<NumberOfBodies; ++i){    
+      // 1. Compute half an Euler time step for v
+      // v(t + dt/2) = v(t) + dt/2 * a(t)
+      vx[i] += timeStepSize/2 * ax[i];
+      vy[i] += timeStepSize/2 * ay[i];
+      vz[i] += timeStepSize/2 * az[i];
+    
+      // 2. Update positions (and cell membership)
+      // x(t+dt) = d(t) + dt * v(t + dt/2)
+      xx[i] += timeStepSize * vx[i];
+      xy[i] += timeStepSize * vy[i];
+      xz[i] += timeStepSize * vz[i];
+
+      double step = timeStepSize * std::max(std::abs(vx[i]), std::max(std::abs(vy[i]), std::abs(vz[i])));
+      grid.moved(i, xx[i], xy[i], xz[i], step);
+    }
+    grid.applyMoves(xx, xy, xz);
+
+    // 3. Calculate acceleration
+    process_interactions();
+
+    // 4. Update the velocities
+    // v(t + dt) = v(t + dt/2) + dt/2 * a(t + dt)
+    // Euler time step
+    for (int i = 0; i<NumberOfBodies; ++i){    
+      vx[i] += timeStepSize/2 * ax[i];
+      vy[i] += timeStepSize/2 * ay[i];
+      vz[i] += timeStepSize/2 * az[i];
+      
+      maxV = std::max(maxV, std::sqrt(vx[i]*vx[i] + vy[i]*vy[i] + vz[i]*vz[i]));
+    }
+
+    t += timeStepSize;
+  }
+};
+
+#endif
@@ -0,0 +1,265 @@
+#ifndef NBODYSIMULATIONPARALLELISED_CPP
+#define NBODYSIMULATIONPARALLELISED_CPP
+
+#include "NBodySimulationVectorised.cpp"
+
+/**
+ * Number of tracers per task of the tracer kernel.
+ */
+#ifndef TRACER_BLOCK
+#define TRACER_BLOCK 1024
+#endif
+
+class NBodySimulationParallelised : public NBodySimulationVectorised {
+
+  /**
+   * Due to data race, symmetry is not exploited.
+   * This could be mitigated by, for example, having each thread work on its own
+   * copy of the acceleration data, and then summing partial contributions from 
+   * each thread to the global array.
+   * But this would require O(N*<number of threads>) extra memory, which could 
+   * become problematic for very large scale simulations
+  */
+  bool process_gravity_and_detect_collision()
+  {
+    if (reproducible) return process_gravity_reproducible();
+
+    std::fill(ax, ax+NumberOfBodies, 0);
+    std::fill(ay, ay+NumberOfBodies, 0);
+    std::fill(az, az+NumberOfBodies, 0);
+    double m_minDx = std::numeric_limits<double>::max();
+    double m_minC = std::numeric_limits<double>::max();
+    double m_epot = 0;
+
+    #pragma omp parallel for reduction(min:m_minDx,m_minC) reduction(+:m_epot)
+    for (int i = 0; i < NumberOfBodies; ++i){
+      double axi(0),ayi(0),azi(0),epi(0);
+      double xxi(xx[i]), xyi(xy[i]), xzi(xz[i]), mi(m[i]);
+
+      double t_minDx = std::numeric_limits<double>::max();
+      double t_minC = std::numeric_limits<double>::max();
+
+      #pragma omp simd reduction(+:axi,ayi,azi,epi) reduction(min:t_minDx,t_minC)
+      for (int j=i-1; j>=0; --j){
+        double dx = xx[j]-xxi;
+        double dy = xy[j]-xyi;
+        double dz = xz[j]-xzi;
+        double dst2 = dx*dx + dy*dy + dz*dz;
+        double dst = std::sqrt(dst2);
+        double dst3 = dst2 * dst;
+        
+        double gx = dx/dst3;
+        double gy = dy/dst3;
+        double gz = dz/dst3;
+
+        axi += gx*m[j];
+        ayi += gy*m[j];
+        azi += gz*m[j];
+        epi += m[j]/dst;
+        t_minC  = std::min(t_minC, dst/(mi + m[j]));
+        t_minDx = std::min(t_minDx, dst);
+      }
+
+      #pragma omp simd reduction(+:axi,ayi,azi,epi) reduction(min:t_minDx,t_minC)
+      for (int j=i+1; j<NumberOfBodies; ++j){
+        double dx = xx[j]-xxi;
+        double dy = xy[j]-xyi;
+        double dz = xz[j]-xzi;
+        double dst2 = dx*dx + dy*dy + dz*dz;
+        double dst = std::sqrt(dst2);
+        double dst3 = dst2 * dst;
+        
+        double gx = dx/dst3;
+        double gy = dy/dst3;
+        double gz = dz/dst3;
+
+        axi += gx*m[j];
+        ayi += gy*m[j];
+        azi += gz*m[j];
+        epi += m[j]/dst;
+        t_minC  = std::min(t_minC, dst/(mi + m[j]));
+        t_minDx = std::min(t_minDx, dst);
+      }
+
+      ax[i] += axi;
+      ay[i] += ayi;
+      az[i] += azi;
+      m_epot  -= mi*epi;
+      m_minC  = std::min(m_minC, t_minC);
+      m_minDx = std::min(m_minDx, t_minDx);
+    }
+    
+    minDx = m_minDx;
+    // every pair has been visited twice
+    potentialEnergy = 0.5*m_epot;
+    return m_minC <= C;
+  }
+  
+  /**
+   * Acceleration and jerk for the Hermite integrator, again without symmetry.
+   */
+  bool process_gravity_jerk_and_detect_collision()
+  {
+    double m_minDx = std::numeric_limits<double>::max();
+    double m_minC = std::numeric_limits<double>::max();
+    double m_epot = 0;
+
+    #pragma omp parallel for reduction(min:m_minDx,m_minC) reduction(+:m_epot)
+    for (int i = 0; i < NumberOfBodies; ++i){
+      double axi(0),ayi(0),azi(0),jxi(0),jyi(0),jzi(0),epi(0);
+      double xxi(xx[i]), xyi(xy[i]), xzi(xz[i]), mi(m[i]);
+      double vxi(vx[i]), vyi(vy[i]), vzi(vz[i]);
+
+      double t_minDx = std::numeric_limits<double>::max();
+      double t_minC = std::numeric_limits<double>::max();
+
+      #pragma omp simd reduction(+:axi,ayi,azi,jxi,jyi,jzi,epi) reduction(min:t_minDx,t_minC)
+      for (int j=0; j<NumberOfBodies; ++j){
+        double dx = xx[j]-xxi;
+        double dy = xy[j]-xyi;
+        double dz = xz[j]-xzi;
+        double dvx = vx[j]-vxi;
+        double dvy = vy[j]-vyi;
+        double dvz = vz[j]-vzi;
+        double dst2 = dx*dx + dy*dy + dz*dz;
+        double dst = std::sqrt(dst2);
+        bool self = j == i;
+        double inv  = self ? 0.0 : 1.0/dst;
+        double inv3 = inv*inv*inv;
+        double rv = self ? 0.0 : 3*(dx*dvx + dy*dvy + dz*dvz)/dst2;
+
+        axi += dx*inv3*m[j];
+        ayi += dy*inv3*m[j];
+        azi += dz*inv3*m[j];
+        jxi += (dvx - rv*dx)*inv3*m[j];
+        jyi += (dvy - rv*dy)*inv3*m[j];
+        jzi += (dvz - rv*dz)*inv3*m[j];
+        epi += m[j]*inv;
+
+        double far = std::numeric_limits<double>::max();
+        t_minC  = std::min(t_minC,  self ? far : dst/(mi + m[j]));
+        t_minDx = std::min(t_minDx, self ? far : dst);
+      }
+
+      ax[i] = axi;
+      ay[i] = ayi;
+      az[i] = azi;
+      jx[i] = jxi;
+      jy[i] = jyi;
+      jz[i] = jzi;
+      m_epot  -= mi*epi;
+      m_minC  = std::min(m_minC, t_minC);
+      m_minDx = std::min(m_minDx, t_minDx);
+    }
+    
+    minDx = m_minDx;
+    potentialEnergy = 0.5*m_epot;
+    return m_minC <= C;
+  }
+
+  /**
+   * The tracers do not act on each other, so blocks of them are independent
+   * and there is no race to avoid.
+   */
+  void process_tracers()
+  {
+    if (reproducible) return process_tracers_reproducible();
+    const int blocks = (NumberOfTracers + TRACER_BLOCK - 1)/TRACER_BLOCK;
+    #pragma omp parallel for schedule(dynamic)
+    for (int b = 0; b < blocks; ++b){
+      tracer_block(b*TRACER_BLOCK, std::min((b+1)*TRACER_BLOCK, NumberOfTracers));
+    }
+  }
+
+public:
+  void kickDriftTracers (double kick, double drift) {
+    #pragma omp parallel for simd
+    for (int i = 0; i<NumberOfTracers; ++i){
+      tvx[i] += kick  * tax[i];
+      tvy[i] += kick  * tay[i];
+      tvz[i] += kick  * taz[i];
+
+      txx[i] += drift * tvx[i];
+      txy[i] += drift * tvy[i];
+      txz[i] += drift * tvz[i];
+    }
+  }
+
+  void kickDrift (double kick, double drift) {
+    #pragma omp parallel for simd
+    for (int i = 0; i<NumberOfBodies; ++i){    
+      vx[i] += kick  * ax[i];
+      vy[i] += kick  * ay[i];
+      vz[i] += kick  * az[i];
+
+      xx[i] += drift * vx[i];
+      xy[i] += drift * vy[i];
+      xz[i] += drift * vz[i];
+    }
+  }
+
+  void closingKick (double kick) {
+    double m_maxV = 0;
+    double ekin(0), mvx(0), mvy(0), mvz(0), lx(0), ly(0), lz(0), ls(0);
+    #pragma omp parallel for simd reduction(max:m_maxV) \
+      reduction(+:ekin,mvx,mvy,mvz,lx,ly,lz,ls)
+    for (int i = 0; i<NumberOfBodies; ++i){    
+      vx[i] += kick * ax[i];
+      vy[i] += kick * ay[i];
+      vz[i] += kick * az[i];
+      
+      double v2 = vx[i]*vx[i] + vy[i]*vy[i] + vz[i]*vz[i];
+      m_maxV = std::max(m_maxV, std::sqrt(v2));
+
+      ekin += m[i]*v2;
+      mvx  += m[i]*vx[i];
+      mvy  += m[i]*vy[i];
+      mvz  += m[i]*vz[i];
+      lx   += m[i]*(xy[i]*vz[i] - xz[i]*vy[i]);
+      ly   += m[i]*(xz[i]*vx[i] - xx[i]*vz[i]);
+      lz   += m[i]*(xx[i]*vy[i] - xy[i]*vx[i]);
+      ls   += m[i]*std::sqrt((xx[i]*xx[i] + xy[i]*xy[i] + xz[i]*xz[i])*v2);
+    }
+    
+    maxV = m_maxV;
+    kineticEnergy = 0.5*ekin;
+    px = mvx; py = mvy; pz = mvz;
+    Lx = lx;  Ly = ly;  Lz = lz;
+    angularMomentumScale = ls;
+    if (reproducible) accumulate_diagnostics_reproducible();
+  }
+
+  void hermitePredict (double dt) {
+    const double dt2 = dt*dt/2, dt3 = dt*dt*dt/6;
+    #pragma omp parallel for simd
+    for (int i = 0; i<NumberOfBodies; ++i){
+      xx[i] += vx[i]*dt + ax[i]*dt2 + jx[i]*dt3;
+      xy[i] += vy[i]*dt + ay[i]*dt2 + jy[i]*dt3;
+      xz[i] += vz[i]*dt + az[i]*dt2 + jz[i]*dt3;
+      vx[i] += ax[i]*dt + jx[i]*dt2;
+      vy[i] += ay[i]*dt + jy[i]*dt2;
+      vz[i] += az[i]*dt + jz[i]*dt2;
+    }
+  }
+
+  void hermiteCorrect (double dt) {
+    const int n = hermiteStride;
+    const double* x0 = hermiteSaved;
+    const double* v0 = x0 + 3*n;
+    const double* a0 = v0 + 3*n;
+    const double* j0 = a0 + 3*n;
+    const double h = dt/2, h2 = dt*dt/12;
+
+    #pragma omp parallel for simd
+    for (int i = 0; i<NumberOfBodies; ++i){
+      vx[i] = v0[i]     + (a0[i]     + ax[i])*h + (j0[i]     - jx[i])*h2;
+      vy[i] = v0[i+n]   + (a0[i+n]   + ay[i])*h + (j0[i+n]   - jy[i])*h2;
+      vz[i] = v0[i+2*n] + (a0[i+2*n] + az[i])*h + (j0[i+2*n] - jz[i])*h2;
+      xx[i] = x0[i]     + (v0[i]     + vx[i])*h + (a0[i]     - ax[i])*h2;
+      xy[i] = x0[i+n]   + (v0[i+n]   + vy[i])*h + (a0[i+n]   - ay[i])*h2;
+      xz[i] = x0[i+2*n] + (v0[i+2*n] + vz[i])*h + (a0[i+2*n] - az[i])*h2;
+    }
+  }
+};
+
+#endif
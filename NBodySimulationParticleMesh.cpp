@@ -0,0 +1,645 @@
+#ifndef NBODYSIMULATIONPARTICLEMESH_CPP
+#define NBODYSIMULATIONPARTICLEMESH_CPP
+
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "Grid.h"
+#include "NBodyFFT.h"
+#include "NBodySimulationParallelised.cpp"
+
+/**
+ * Particle-mesh gravity for near-uniform distributions, where all-pairs is
+ * too expensive and a tree would be overkill.
+ *
+ * The force is split into a smooth long-range part and a short-range
+ * correction (P3M), with a Gaussian of width r_s as in TreePM codes:
+ *
+ * - long range: the mass is assigned to a meshSize^3 grid with cloud-in-cell
+ *   weights, Poisson's equation is solved with an FFT and the mesh force is
+ *   interpolated back to the bodies with the same weights.
+ * - short range: pairs closer than 4.5 r_s are found with the cell list of
+ *   step 2 and get the erfc part of the force that the mesh misses. The
+ *   same pass detects collisions.
+ *
+ * Without the short-range correction (pure PM) the force is smoothed on the
+ * scale of r_s, i.e. about one mesh cell.
+ *
+ * Tracers get the same force: the mesh acceleration interpolated with
+ * cloud-in-cell weights plus the short-range term of the bodies in the
+ * neighbouring cells. With the isolated boundary, tracers outside the mesh
+ * are pushed by all bodies directly, as there the force is Newtonian.
+ *
+ * The boundary can be periodic (bodies are wrapped into a cube of side
+ * boxSize centred at the origin) or isolated (the mesh follows the bodies
+ * and the density is zero-padded to twice the mesh size, so the circular
+ * convolution with the Green's function equals the free-space one).
+ *
+ * Settings are read from NBODY_PM_MESH, NBODY_PM_BOUNDARY (isolated or
+ * periodic), NBODY_PM_BOX, NBODY_PM_SPLIT (r_s in mesh cells) and
+ * NBODY_PM_P3M (0 for pure PM).
+ */
+class NBodySimulationParticleMesh : public NBodySimulationParallelised {
+public:
+  enum Boundary { Isolated, Periodic };
+
+  /**
+   * Number of mesh cells per dimension. Has to be a power of two unless
+   * FFTW is used.
+   */
+  int      meshSize;
+  Boundary boundary;
+
+  /**
+   * Side length of the periodic box.
+   */
+  double   boxSize;
+
+  /**
+   * Splitting scale r_s in units of the mesh spacing.
+   */
+  double   splitCells;
+  bool     shortRangeCorrection;
+
+  NBodySimulationParticleMesh () :
+    meshSize(64), boundary(Isolated), boxSize(1.0), splitCells(1.25),
+    shortRangeCorrection(true), h(0), greensH(0), M(0), rs(0), rcut(0), cellsPerDim(0) {}
+
+  void readEnvironmentOptions () {
+    NBodySimulationParallelised::readEnvironmentOptions();
+
+    const char* value = std::getenv("NBODY_PM_MESH");
+    if (value != nullptr) meshSize = std::stoi(value);
+    value = std::getenv("NBODY_PM_BOUNDARY");
+    if (value != nullptr) {
+      const std::string name(value);
+      if (name != "isolated" && name != "periodic") {
+        throw NBodyError() << "unknown NBODY_PM_BOUNDARY " << name << " (use isolated or periodic)";
+      }
+      boundary = name == "periodic" ? Periodic : Isolated;
+    }
+    value = std::getenv("NBODY_PM_BOX");
+    if (value != nullptr) boxSize = std::stod(value);
+    value = std::getenv("NBODY_PM_SPLIT");
+    if (value != nullptr) splitCells = std::stod(value);
+    value = std::getenv("NBODY_PM_P3M");
+    if (value != nullptr) shortRangeCorrection = std::string(value) != "0";
+
+    if (integrator == Hermite4) {
+      throw NBodyError() << "the Hermite integrator needs the jerk, which the "
+                            "particle-mesh solver does not provide";
+    }
+    if (reproducible) {
+      throw NBodyError() << "the particle-mesh solver has no reproducible-summation mode";
+    }
+#ifndef NBODY_USE_FFTW
+    if (!FFT3D::isPowerOfTwo(meshSize)) {
+      throw NBodyError() << "invalid mesh size " << meshSize
+                         << ": the bundled FFT needs a power of two";
+    }
+#endif
+    if (meshSize < 8 || meshSize % 2 != 0) {
+      throw NBodyError() << "invalid mesh size " << meshSize
+                         << ": needs to be even and at least 8";
+    }
+  }
+
+protected:
+  bool process_gravity_and_detect_collision()
+  {
+    std::fill(ax, ax+NumberOfBodies, 0);
+    std::fill(ay, ay+NumberOfBodies, 0);
+    std::fill(az, az+NumberOfBodies, 0);
+
+    placeMesh();
+    assignMass();
+    solvePoisson();
+    double epot = interpolateForces();
+    bool collision = addShortRangeForces(epot);
+
+    potentialEnergy = epot;
+    return collision;
+  }
+
+  /**
+   * Called after the force evaluation of the bodies, so the mesh
+   * acceleration and the cell list are those of the current positions.
+   */
+  void process_tracers()
+  {
+    const bool periodic = boundary == Periodic;
+    const double L = boxSize;
+    const int n = meshSize;
+
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (int i = 0; i < NumberOfTracers; ++i) {
+      if (periodic) {
+        txx[i] -= L*std::floor(txx[i]/L + 0.5);
+        txy[i] -= L*std::floor(txy[i]/L + 0.5);
+        txz[i] -= L*std::floor(txz[i]/L + 0.5);
+      }
+      const double x[3] = { txx[i], txy[i], txz[i] };
+
+      bool onMesh = true;
+      for (int c = 0; c < 3 && !periodic; ++c) {
+        onMesh = onMesh && x[c] >= origin[c] + 2*h && x[c] < origin[c] + (n-3)*h;
+      }
+      if (!onMesh) {
+        double axi(0), ayi(0), azi(0);
+        for (int j = 0; j < NumberOfBodies; ++j) {
+          double dx = xx[j]-x[0];
+          double dy = xy[j]-x[1];
+          double dz = xz[j]-x[2];
+          double dst2 = dx*dx + dy*dy + dz*dz;
+          double g = m[j]/(dst2*std::sqrt(dst2));
+          axi += g*dx;
+          ayi += g*dy;
+          azi += g*dz;
+        }
+        tax[i] = axi;
+        tay[i] = ayi;
+        taz[i] = azi;
+        continue;
+      }
+
+      int d[3]; double f[3];
+      cic(x, d, f);
+      double axi(0), ayi(0), azi(0);
+      for (int a = 0; a < 2; ++a) {
+        for (int c = 0; c < 2; ++c) {
+          for (int e = 0; e < 2; ++e) {
+            double wq = (a ? f[0] : 1-f[0])*(c ? f[1] : 1-f[1])*(e ? f[2] : 1-f[2]);
+            long q = node(wrap(d[0]+a), wrap(d[1]+c), wrap(d[2]+e));
+            axi += wq*gx[q];
+            ayi += wq*gy[q];
+            azi += wq*gz[q];
+          }
+        }
+      }
+
+      if (rcut > 0) {
+        const double alpha = 1.0/(2*rs);
+        const double beta  = 1.0/(rs*std::sqrt(M_PI));
+        Grid::CellID neighbours[27];
+        const int count = neighbourCells(cellAt(x[0], x[1], x[2]), neighbours);
+        for (int q = 0; q < count; ++q) {
+          const std::vector<int>* cell = grid.find(neighbours[q]);
+          if (cell == nullptr) continue;
+
+          for (int j : *cell) {
+            double dx = xx[j]-x[0];
+            double dy = xy[j]-x[1];
+            double dz = xz[j]-x[2];
+            if (periodic) {
+              dx -= L*std::floor(dx/L + 0.5);
+              dy -= L*std::floor(dy/L + 0.5);
+              dz -= L*std::floor(dz/L + 0.5);
+            }
+            double dst2 = dx*dx + dy*dy + dz*dz;
+            double dst = std::sqrt(dst2);
+            if (dst < rcut && dst > 0) {
+              double factor = (std::erfc(alpha*dst) + beta*dst*std::exp(-alpha*alpha*dst2))/(dst2*dst);
+              axi += factor*dx*m[j];
+              ayi += factor*dy*m[j];
+              azi += factor*dz*m[j];
+            }
+          }
+        }
+      }
+
+      tax[i] = axi;
+      tay[i] = ayi;
+      taz[i] = azi;
+    }
+  }
+
+private:
+  typedef FFT3D::Complex Complex;
+
+  double origin[3];
+  double h;
+  double greensH;
+  int    M;
+  double rs;
+  double rcut;
+  int    cellsPerDim;
+  double selfKernel[27];
+
+  std::vector<double>  mass;
+  std::vector<double>  phi;
+  std::vector<double>  gx, gy, gz;
+  std::vector<Complex> work;
+  std::vector<Complex> greens;
+  std::vector<int>     slabStart, slabOrder;
+  FFT3D                fft;
+  Grid                 grid;
+
+  long node(int i, int j, int k) const {
+    return (long(i)*meshSize + j)*meshSize + k;
+  }
+
+  static double sinc(double x) {
+    return x == 0 ? 1.0 : std::sin(x)/x;
+  }
+
+  int wrap(int i) const {
+    return (i % meshSize + meshSize) % meshSize;
+  }
+
+  /**
+   * Lower mesh node and cloud-in-cell weight of the upper node.
+   */
+  void cic(int b, int d[3], double f[3]) const {
+    const double x[3] = { xx[b], xy[b], xz[b] };
+    cic(x, d, f);
+  }
+
+  void cic(const double x[3], int d[3], double f[3]) const {
+    for (int c = 0; c < 3; ++c) {
+      double u = (x[c] - origin[c])/h;
+      d[c] = static_cast<int>(std::floor(u));
+      f[c] = u - d[c];
+      if (boundary == Periodic) d[c] = wrap(d[c]);
+    }
+  }
+
+  /**
+   * Periodic: the mesh is the box. Isolated: the mesh is only moved when a
+   * body gets within two cells of its border (the gradient stencil is four
+   * points wide), and then grows with a margin, so the Green's function has
+   * to be recomputed only now and then.
+   */
+  void placeMesh() {
+    const int n = meshSize;
+
+    if (boundary == Periodic) {
+      double L = boxSize;
+      #pragma omp parallel for simd
+      for (int i = 0; i < NumberOfBodies; ++i) {
+        xx[i] -= L*std::floor(xx[i]/L + 0.5);
+        xy[i] -= L*std::floor(xy[i]/L + 0.5);
+        xz[i] -= L*std::floor(xz[i]/L + 0.5);
+      }
+      origin[0] = origin[1] = origin[2] = -0.5*L;
+      h = L/n;
+      M = n;
+    }
+    else {
+      double lo[3], hi[3];
+      double minX(xx[0]), minY(xy[0]), minZ(xz[0]);
+      double maxX(xx[0]), maxY(xy[0]), maxZ(xz[0]);
+      #pragma omp parallel for simd reduction(min:minX,minY,minZ) reduction(max:maxX,maxY,maxZ)
+      for (int i = 0; i < NumberOfBodies; ++i) {
+        minX = std::min(minX, xx[i]); maxX = std::max(maxX, xx[i]);
+        minY = std::min(minY, xy[i]); maxY = std::max(maxY, xy[i]);
+        minZ = std::min(minZ, xz[i]); maxZ = std::max(maxZ, xz[i]);
+      }
+      lo[0] = minX; lo[1] = minY; lo[2] = minZ;
+      hi[0] = maxX; hi[1] = maxY; hi[2] = maxZ;
+
+      bool inside = h > 0;
+      for (int c = 0; c < 3; ++c) {
+        inside = inside && lo[c] >= origin[c] + 2*h && hi[c] < origin[c] + (n-3)*h;
+      }
+
+      if (!inside) {
+        double extent = 0;
+        for (int c = 0; c < 3; ++c) extent = std::max(extent, hi[c] - lo[c]);
+        if (extent <= 0) extent = 1.0;
+
+        h = 1.25*extent/(n-5);
+        for (int c = 0; c < 3; ++c) origin[c] = 0.5*(lo[c] + hi[c]) - 0.5*(n-1)*h;
+      }
+      M = 2*n;
+    }
+
+    rs = splitCells*h;
+    if (h != greensH) computeGreensFunction();
+  }
+
+  /**
+   * Periodic: the Fourier space solution of Laplace(phi) = 4 pi rho with the
+   * long-range Gaussian filter, as in GADGET-2. Isolated: the transformed long-range part of
+   * -1/r on the doubled mesh, with distances taken the short way round.
+   */
+  void computeGreensFunction() {
+    const long M3 = long(M)*M*M;
+    greens.resize(M3);
+    work.resize(M3);
+    fft.plan(M, work);
+
+    if (boundary == Periodic) {
+      const double kf = 2*M_PI/boxSize;
+      const double cellVolume = h*h*h;
+      #pragma omp parallel for
+      for (int i = 0; i < M; ++i) {
+        for (int j = 0; j < M; ++j) {
+          for (int k = 0; k < M; ++k) {
+            double ki = kf*(i < M/2 ? i : i-M);
+            double kj = kf*(j < M/2 ? j : j-M);
+            double kk = kf*(k < M/2 ? k : k-M);
+            double k2 = ki*ki + kj*kj + kk*kk;
+            // deconvolve the cloud-in-cell window of assignment and
+            // interpolation, W = (sinc(k_x h/2) sinc(k_y h/2) sinc(k_z h/2))^2
+            double w = sinc(0.5*ki*h)*sinc(0.5*kj*h)*sinc(0.5*kk*h);
+            w *= w;
+            double g = k2 > 0 ? -4*M_PI*std::exp(-k2*rs*rs)/(k2*cellVolume*w*w) : 0;
+            greens[(long(i)*M + j)*M + k] = g;
+          }
+        }
+      }
+    }
+    else {
+      #pragma omp parallel for
+      for (int i = 0; i < M; ++i) {
+        for (int j = 0; j < M; ++j) {
+          for (int k = 0; k < M; ++k) {
+            double di = std::min(i, M-i), dj = std::min(j, M-j), dk = std::min(k, M-k);
+            double r = h*std::sqrt(di*di + dj*dj + dk*dk);
+            double g = r > 0 ? -std::erf(r/(2*rs))/r : -1.0/(rs*std::sqrt(M_PI));
+            greens[(long(i)*M + j)*M + k] = g;
+          }
+        }
+      }
+      fft.forward(greens);
+    }
+
+    // Mesh potential of a unit mass at the neighbouring nodes, to remove the
+    // self-energy of every body in interpolateForces()
+    for (long q = 0; q < M3; ++q) work[q] = greens[q];
+    fft.inverse(work);
+    for (int a = -1; a <= 1; ++a)
+      for (int c = -1; c <= 1; ++c)
+        for (int e = -1; e <= 1; ++e)
+          selfKernel[(a+1)*9 + (c+1)*3 + (e+1)] =
+            work[((long(a+M)%M)*M + (c+M)%M)*M + (e+M)%M].real();
+
+    greensH = h;
+  }
+
+  /**
+   * Cloud-in-cell assignment. The bodies are bucketed by the x-slab of
+   * their lower mesh node, and a body in slab s writes to slabs s and s+1
+   * only, so all even slabs can be processed in parallel and then all odd
+   * ones.
+   */
+  void assignMass() {
+    const int n = meshSize;
+    mass.assign(long(n)*n*n, 0);
+
+    slabStart.assign(n+2, 0);
+    slabOrder.resize(NumberOfBodies);
+    std::vector<int> slab(NumberOfBodies);
+
+    #pragma omp parallel for
+    for (int b = 0; b < NumberOfBodies; ++b) {
+      double u = (xx[b] - origin[0])/h;
+      int s = static_cast<int>(std::floor(u));
+      slab[b] = boundary == Periodic ? wrap(s) : std::max(0, std::min(n-2, s));
+    }
+    for (int b = 0; b < NumberOfBodies; ++b) slabStart[slab[b]+2]++;
+    for (int s = 2; s < n+2; ++s) slabStart[s] += slabStart[s-1];
+    for (int b = 0; b < NumberOfBodies; ++b) slabOrder[slabStart[slab[b]+1]++] = b;
+
+    for (int parity = 0; parity < 2; ++parity) {
+      #pragma omp parallel for schedule(dynamic)
+      for (int s = parity; s < n; s += 2) {
+        for (int q = slabStart[s]; q < slabStart[s+1]; ++q) {
+          int b = slabOrder[q];
+          int d[3]; double f[3];
+          cic(b, d, f);
+          for (int a = 0; a < 2; ++a) {
+            for (int c = 0; c < 2; ++c) {
+              for (int e = 0; e < 2; ++e) {
+                double w = (a ? f[0] : 1-f[0])*(c ? f[1] : 1-f[1])*(e ? f[2] : 1-f[2]);
+                mass[node(wrap(d[0]+a), wrap(d[1]+c), wrap(d[2]+e))] += w*m[b];
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+  /**
+   * Potential on the mesh by FFT convolution, then the mesh acceleration
+   * -grad(phi) with a fourth order central difference.
+   */
+  void solvePoisson() {
+    const int n = meshSize;
+    const long M3 = long(M)*M*M;
+
+    #pragma omp parallel for
+    for (long q = 0; q < M3; ++q) work[q] = 0;
+
+    #pragma omp parallel for
+    for (int i = 0; i < n; ++i)
+      for (int j = 0; j < n; ++j)
+        for (int k = 0; k < n; ++k)
+          work[(long(i)*M + j)*M + k] = mass[node(i,j,k)];
+
+    fft.forward(work);
+    #pragma omp parallel for
+    for (long q = 0; q < M3; ++q) work[q] *= greens[q];
+    fft.inverse(work);
+
+    phi.resize(long(n)*n*n);
+    #pragma omp parallel for
+    for (int i = 0; i < n; ++i)
+      for (int j = 0; j < n; ++j)
+        for (int k = 0; k < n; ++k)
+          phi[node(i,j,k)] = work[(long(i)*M + j)*M + k].real();
+
+    gx.assign(long(n)*n*n, 0);
+    gy.assign(long(n)*n*n, 0);
+    gz.assign(long(n)*n*n, 0);
+
+    // The isolated potential is only valid on the n^3 part of the padded
+    // mesh, and placeMesh() keeps the bodies away from its border.
+    const bool periodic = boundary == Periodic;
+    const int first = periodic ? 0 : 2;
+    const int last  = periodic ? n : n-2;
+    const double scale = 1.0/(12*h);
+
+    #pragma omp parallel for
+    for (int i = first; i < last; ++i) {
+      for (int j = first; j < last; ++j) {
+        for (int k = first; k < last; ++k) {
+          gx[node(i,j,k)] = -scale*(8*(phi[node(wrap(i+1),j,k)] - phi[node(wrap(i-1),j,k)])
+                                     -(phi[node(wrap(i+2),j,k)] - phi[node(wrap(i-2),j,k)]));
+          gy[node(i,j,k)] = -scale*(8*(phi[node(i,wrap(j+1),k)] - phi[node(i,wrap(j-1),k)])
+                                     -(phi[node(i,wrap(j+2),k)] - phi[node(i,wrap(j-2),k)]));
+          gz[node(i,j,k)] = -scale*(8*(phi[node(i,j,wrap(k+1))] - phi[node(i,j,wrap(k-1))])
+                                     -(phi[node(i,j,wrap(k+2))] - phi[node(i,j,wrap(k-2))]));
+        }
+      }
+    }
+  }
+
+  /**
+   * Interpolates the mesh acceleration and potential back to the bodies and
+   * returns the long-range potential energy, without the self-energy every
+   * body has with its own mass on the mesh.
+   */
+  double interpolateForces() {
+    double epot = 0;
+
+    #pragma omp parallel for reduction(+:epot)
+    for (int b = 0; b < NumberOfBodies; ++b) {
+      int d[3]; double f[3];
+      cic(b, d, f);
+      double axb(0), ayb(0), azb(0), phib(0);
+      double w[8];
+      for (int a = 0; a < 2; ++a) {
+        for (int c = 0; c < 2; ++c) {
+          for (int e = 0; e < 2; ++e) {
+            double wq = (a ? f[0] : 1-f[0])*(c ? f[1] : 1-f[1])*(e ? f[2] : 1-f[2]);
+            long q = node(wrap(d[0]+a), wrap(d[1]+c), wrap(d[2]+e));
+            axb  += wq*gx[q];
+            ayb  += wq*gy[q];
+            azb  += wq*gz[q];
+            phib += wq*phi[q];
+            w[a*4 + c*2 + e] = wq;
+          }
+        }
+      }
+
+      double self = 0;
+      for (int q = 0; q < 8; ++q) {
+        for (int r = 0; r < 8; ++r) {
+          int a = (q>>2) - (r>>2), c = ((q>>1)&1) - ((r>>1)&1), e = (q&1) - (r&1);
+          self += w[q]*w[r]*selfKernel[(a+1)*9 + (c+1)*3 + (e+1)];
+        }
+      }
+
+      ax[b] += axb;
+      ay[b] += ayb;
+      az[b] += azb;
+      epot  += 0.5*m[b]*(phib - m[b]*self);
+    }
+
+    return epot;
+  }
+
+  /**
+   * Short-range pass over the cell list. Adds the part of the force the
+   * mesh misses (P3M) and detects collisions. The cells are at least as
+   * large as the P3M cut-off 4.5 r_s and the largest possible merge
+   * distance.
+   */
+  bool addShortRangeForces(double& epot) {
+    const bool periodic = boundary == Periodic;
+    const double L = boxSize;
+    rcut = shortRangeCorrection ? 4.5*rs : 0.0;
+
+    double maxM = 0;
+    #pragma omp parallel for simd reduction(max:maxM)
+    for (int i = 0; i < NumberOfBodies; ++i) maxM = std::max(maxM, m[i]);
+
+    double cell = std::max(rcut, 2*C*maxM);
+    int nc = 0;
+    if (periodic) {
+      nc = std::max(1, static_cast<int>(std::floor(L/cell)));
+      cell = L/nc;
+    }
+
+    cellsPerDim = nc;
+    grid = Grid(cell);
+    for (int i = 0; i < NumberOfBodies; ++i) {
+      grid.add(i, cellAt(xx[i], xy[i], xz[i]));
+    }
+
+    const double alpha = 1.0/(2*rs);
+    const double beta  = 1.0/(rs*std::sqrt(M_PI));
+    double m_minDx = std::numeric_limits<double>::max();
+    double m_minC  = std::numeric_limits<double>::max();
+    double m_epot  = 0;
+
+    #pragma omp parallel for schedule(dynamic, 64) \
+      reduction(min:m_minDx,m_minC) reduction(+:m_epot)
+    for (int i = 0; i < NumberOfBodies; ++i) {
+      Grid::CellID neighbours[27];
+      const int count = neighbourCells(cellAt(xx[i], xy[i], xz[i]), neighbours);
+
+      double axi(0), ayi(0), azi(0);
+      for (int q = 0; q < count; ++q) {
+        const std::vector<int>* cell = grid.find(neighbours[q]);
+        if (cell == nullptr) continue;
+
+        for (int j : *cell) {
+          if (j == i) continue;
+          double dx = xx[j]-xx[i];
+          double dy = xy[j]-xy[i];
+          double dz = xz[j]-xz[i];
+          if (periodic) {
+            dx -= L*std::floor(dx/L + 0.5);
+            dy -= L*std::floor(dy/L + 0.5);
+            dz -= L*std::floor(dz/L + 0.5);
+          }
+          double dst2 = dx*dx + dy*dy + dz*dz;
+          double dst = std::sqrt(dst2);
+
+          m_minDx = std::min(m_minDx, dst);
+          m_minC  = std::min(m_minC, dst/(m[i] + m[j]));
+
+          if (dst < rcut) {
+            double erfcTerm = std::erfc(alpha*dst);
+            double factor = (erfcTerm + beta*dst*std::exp(-alpha*alpha*dst2))/(dst2*dst);
+            axi += factor*dx*m[j];
+            ayi += factor*dy*m[j];
+            azi += factor*dz*m[j];
+            m_epot -= 0.5*m[i]*m[j]*erfcTerm/dst;
+          }
+        }
+      }
+
+      ax[i] += axi;
+      ay[i] += ayi;
+      az[i] += azi;
+    }
+
+    minDx = m_minDx;
+    epot += m_epot;
+    return m_minC <= C;
+  }
+
+  Grid::CellID cellAt(double x, double y, double z) {
+    const int nc = cellsPerDim;
+    if (boundary == Periodic) {
+      Grid::CellID id = grid.coordsToCellID(x-origin[0], y-origin[1], z-origin[2]);
+      return Grid::CellID(((std::get<0>(id)%nc)+nc)%nc,
+                          ((std::get<1>(id)%nc)+nc)%nc,
+                          ((std::get<2>(id)%nc)+nc)%nc);
+    }
+    return grid.coordsToCellID(x, y, z);
+  }
+
+  /**
+   * The cell and the cells around it. With fewer than three cells per
+   * dimension the periodic neighbours coincide, and every cell must only be
+   * visited once.
+   */
+  int neighbourCells(const Grid::CellID& id, Grid::CellID neighbours[27]) const {
+    const int nc = cellsPerDim;
+    int cx, cy, cz;
+    std::tie(cx, cy, cz) = id;
+    int count = 0;
+    for (int a = -1; a <= 1; ++a) {
+      for (int b = -1; b <= 1; ++b) {
+        for (int c = -1; c <= 1; ++c) {
+          Grid::CellID nid(cx+a, cy+b, cz+c);
+          if (boundary == Periodic) {
+            nid = Grid::CellID(((cx+a)%nc+nc)%nc, ((cy+b)%nc+nc)%nc, ((cz+c)%nc+nc)%nc);
+            if (std::find(neighbours, neighbours+count, nid) != neighbours+count) continue;
+          }
+          neighbours[count++] = nid;
+        }
+      }
+    }
+    return count;
+  }
+};
+
+#endif
@@ -0,0 +1,357 @@
+#ifndef NBODYSIMULATIONRESPA_CPP
+#define NBODYSIMULATIONRESPA_CPP
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "NBodySimulationVectorised.cpp"
+
+/**
+ * Multiple time stepping (r-RESPA, Tuckerman et al. 1992) for gravity.
+ *
+ * The force is split with a smooth switch S(r), which goes from 0 at
+ * 0.8 r_c to 1 at the split radius r_c, into a short-range part F (1-S) and
+ * a long-range part F S. Close pairs need small steps, but the far field is
+ * smooth, so
+ *
+ * - the short-range part is evaluated every (inner) time step timeStepSize,
+ *   using a cell list with cells of size r_c as in step 2, and
+ * - the long-range part is evaluated every k-th step with an all-pairs
+ *   kernel vectorised as in step 3, and applied as a kick of k*dt/2 at the
+ *   beginning and the end of every block of k steps.
+ *
+ * The short-range pass also detects collisions. The potential energy is
+ * computed in the long-range pass, so the diagnostics are only logged, and
+ * the drift alarm only checked, at the end of a block.
+ *
+ * The split radius and k are read from NBODY_RESPA_RADIUS and
+ * NBODY_RESPA_STEPS.
+ */
+class NBodySimulationRespa : public NBodySimulationVectorised {
+public:
+  /**
+   * Split radius r_c.
+   */
+  double splitRadius;
+
+  /**
+   * Number of inner steps per long-range evaluation.
+   */
+  int    longRangeInterval;
+
+  /**
+   * Number of short- and long-range force evaluations so far.
+   */
+  int    shortRangeEvaluations;
+  int    longRangeEvaluations;
+
+  NBodySimulationRespa () :
+    splitRadius(0.1), longRangeInterval(4),
+    shortRangeEvaluations(0), longRangeEvaluations(0), phase(0),
+    alx(nullptr), aly(nullptr), alz(nullptr) {
+    integrator = Respa;
+  }
+
+  ~NBodySimulationRespa () {
+    freeLongRange();
+  }
+
+  void readEnvironmentOptions () {
+    NBodySimulationVectorised::readEnvironmentOptions();
+    integrator = Respa;
+
+    const char* value = std::getenv("NBODY_RESPA_RADIUS");
+    if (value != nullptr) splitRadius = std::stod(value);
+    value = std::getenv("NBODY_RESPA_STEPS");
+    if (value != nullptr) longRangeInterval = std::stoi(value);
+
+    if (splitRadius <= 0 || longRangeInterval < 1) {
+      throw NBodyError() << "invalid RESPA split radius " << splitRadius
+                         << " or number of inner steps " << longRangeInterval;
+    }
+  }
+
+  /**
+   * One inner step. The long-range kicks open and close every block of
+   * longRangeInterval steps.
+   */
+  void updateBody () {
+    if (NumberOfTracers > 0) {
+      throw NBodyError() << "the RESPA integrator does not support tracers";
+    }
+    timeStepCounter++;
+    maxV   = 0.0;
+    minDx  = std::numeric_limits<double>::max();
+
+    const double dt = timeStepSize;
+    const double outer = longRangeInterval*dt;
+
+    // first step after setUp() or create()
+    if (timeStepCounter == 1) {
+      freeLongRange();
+      phase = 0;
+      alx = allocateAligned(NumberOfBodies);
+      aly = allocateAligned(NumberOfBodies);
+      alz = allocateAligned(NumberOfBodies);
+      evaluateLongRange();
+      evaluateShortRange();
+    }
+
+    if (phase == 0) kickLongRange(outer/2);
+
+    kickDrift(dt/2, dt);
+    evaluateShortRange();
+
+    phase++;
+    if (phase == longRangeInterval) {
+      evaluateLongRange();
+      kickLongRange(outer/2);
+      phase = 0;
+    }
+
+    closingKick(dt/2);
+    t += timeStepSize;
+  }
+
+  /**
+   * The potential energy of the long-range pass is stale within a block.
+   */
+  bool diagnosticsConsistent () const {
+    return phase == 0;
+  }
+
+protected:
+  /**
+   * Long-range part F S(r) of all pairs, using the symmetry as in step 3.
+   * Stored in alx, aly, alz, as ax, ay, az hold the short-range part.
+   */
+  void long_range_gravity()
+  {
+    std::fill(alx, alx+NumberOfBodies, 0);
+    std::fill(aly, aly+NumberOfBodies, 0);
+    std::fill(alz, alz+NumberOfBodies, 0);
+    double m_epot = 0;
+    const double rc = splitRadius, rin = 0.8*splitRadius;
+    const double width = 1.0/(rc - rin);
+
+    for (int i = 0; i<NumberOfBodies; ++i){
+      double axi(0),ayi(0),azi(0),epi(0);
+      double xxi(xx[i]), xyi(xy[i]), xzi(xz[i]), mi(m[i]);
+     #pragma omp simd reduction(+:axi,ayi,azi,epi)
+      for (int j=i+1; j<NumberOfBodies; ++j){
+        double dx = xx[j]-xxi;
+        double dy = xy[j]-xyi;
+        double dz = xz[j]-xzi;
+        double dst2 = dx*dx + dy*dy + dz*dz;
+        double dst = std::sqrt(dst2);
+        double dst3 = dst2 * dst;
+        double s = switching(dst, rin, width);
+
+        double gx = s*dx/dst3;
+        double gy = s*dy/dst3;
+        double gz = s*dz/dst3;
+
+        axi += gx*m[j];
+        ayi += gy*m[j];
+        azi += gz*m[j];
+        alx[j] -= gx*mi;
+        aly[j] -= gy*mi;
+        alz[j] -= gz*mi;
+        epi   += m[j]/dst;
+      }
+
+      alx[i] += axi;
+      aly[i] += ayi;
+      alz[i] += azi;
+      m_epot -= mi*epi;
+    }
+
+    potentialEnergy = m_epot;
+  }
+
+  /**
+   * Short-range part F (1-S(r)) from a cell list, in parallel over the
+   * bodies without symmetry, as in step 4. The cells are at least as large
+   * as the split radius and the largest possible merge distance. Unlike the
+   * hashed Grid of step 2, the cells cover the bounding box densely and
+   * copies of the positions and masses are counting-sorted by cell, so a row
+   * of neighbour cells is a contiguous range that the inner loop vectorises
+   * over without gathers.
+   */
+  bool short_range_gravity_and_detect_collision()
+  {
+    const double rc = splitRadius, rin = 0.8*splitRadius;
+    const double width = 1.0/(rc - rin);
+
+    buildCellList();
+
+    double m_minDx = std::numeric_limits<double>::max();
+    double m_minC  = std::numeric_limits<double>::max();
+
+    #pragma omp parallel for schedule(dynamic, 64) reduction(min:m_minDx,m_minC)
+    for (int i = 0; i < NumberOfBodies; ++i) {
+      const int cx = cellOf[i] % cells[0];
+      const int cy = cellOf[i] / cells[0] % cells[1];
+      const int cz = cellOf[i] / cells[0] / cells[1];
+      const int slot = sortedSlot[i];
+      const double xxi(xx[i]), xyi(xy[i]), xzi(xz[i]), mi(m[i]);
+      double axi(0), ayi(0), azi(0);
+
+      for (int c = std::max(cz-1, 0); c <= std::min(cz+1, cells[2]-1); ++c) {
+        for (int b = std::max(cy-1, 0); b <= std::min(cy+1, cells[1]-1); ++b) {
+          const int row = (c*cells[1] + b)*cells[0];
+          const int first = cellStart[row + std::max(cx-1, 0)];
+          const int last  = cellStart[row + std::min(cx+1, cells[0]-1) + 1];
+
+          #pragma omp simd reduction(+:axi,ayi,azi) reduction(min:m_minDx,m_minC)
+          for (int k = first; k < last; ++k) {
+            double dx = sortedX[k]-xxi;
+            double dy = sortedY[k]-xyi;
+            double dz = sortedZ[k]-xzi;
+            double dst2 = dx*dx + dy*dy + dz*dz;
+            double dst = std::sqrt(dst2);
+            bool   self = k == slot;
+
+            m_minDx = std::min(m_minDx, self ? m_minDx : dst);
+            m_minC  = std::min(m_minC,  self ? m_minC  : dst/(mi + sortedM[k]));
+
+            double g = (self || dst >= rc) ? 0.0 : (1 - switching(dst, rin, width))*sortedM[k]/(dst2*dst);
+            axi += g*dx;
+            ayi += g*dy;
+            azi += g*dz;
+          }
+        }
+      }
+
+      ax[i] = axi;
+      ay[i] = ayi;
+      az[i] = azi;
+    }
+
+    minDx = m_minDx;
+    return m_minC <= C;
+  }
+
+private:
+  int     phase;
+  int     cells[3];
+  std::vector<int> cellOf, cellStart, sortedSlot;
+  std::vector<double> sortedX, sortedY, sortedZ, sortedM;
+  double* alx __attribute__((aligned(64)));
+  double* aly __attribute__((aligned(64)));
+  double* alz __attribute__((aligned(64)));
+
+  /**
+   * Smootherstep x^3 (10 - 15x + 6x^2) of x = (r - r_in)/(r_c - r_in),
+   * clamped to [0,1]. Twice continuously differentiable.
+   */
+  static double switching(double r, double rin, double width) {
+    double x = std::min(1.0, std::max(0.0, (r - rin)*width));
+    return x*x*x*(10 + x*(6*x - 15));
+  }
+
+  /**
+   * Sorts the bodies into cells of size max(r_c, 2 C max m) over their
+   * bounding box. The cells are coarsened if there would be more than 64
+   * per body, e.g. when a body escapes far from the cluster, down to a
+   * single cell, i.e. all pairs. The cell counts are computed in double, so
+   * they cannot overflow.
+   */
+  void buildCellList() {
+    double lo[3] = { std::numeric_limits<double>::max(), std::numeric_limits<double>::max(), std::numeric_limits<double>::max() };
+    double hi[3] = { std::numeric_limits<double>::lowest(), std::numeric_limits<double>::lowest(), std::numeric_limits<double>::lowest() };
+    double maxM = 0;
+    for (int i = 0; i < NumberOfBodies; ++i) {
+      lo[0] = std::min(lo[0], xx[i]); hi[0] = std::max(hi[0], xx[i]);
+      lo[1] = std::min(lo[1], xy[i]); hi[1] = std::max(hi[1], xy[i]);
+      lo[2] = std::min(lo[2], xz[i]); hi[2] = std::max(hi[2], xz[i]);
+      maxM  = std::max(maxM, m[i]);
+    }
+
+    for (int d = 0; d < 3; ++d) {
+      if (!std::isfinite(hi[d] - lo[d])) {
+        throw NBodyError() << "a body has left the representable range at t=" << t;
+      }
+    }
+
+    double h = std::max(splitRadius, 2*C*maxM);
+    const double maxCells = 64.0*NumberOfBodies + 4096;
+    for (;;) {
+      double count = 1;
+      for (int d = 0; d < 3; ++d) count *= std::floor((hi[d] - lo[d])/h) + 1;
+      if (count <= maxCells) break;
+      h *= std::max(2.0, std::cbrt(count/maxCells));
+    }
+
+    long int total = 1;
+    for (int d = 0; d < 3; ++d) {
+      cells[d] = static_cast<int>((hi[d] - lo[d])/h) + 1;
+      total   *= cells[d];
+    }
+
+    cellOf.resize(NumberOfBodies);
+    sortedSlot.resize(NumberOfBodies);
+    sortedX.resize(NumberOfBodies);
+    sortedY.resize(NumberOfBodies);
+    sortedZ.resize(NumberOfBodies);
+    sortedM.resize(NumberOfBodies);
+    cellStart.assign(total + 1, 0);
+    for (int i = 0; i < NumberOfBodies; ++i) {
+      int cx = std::min(static_cast<int>((xx[i] - lo[0])/h), cells[0]-1);
+      int cy = std::min(static_cast<int>((xy[i] - lo[1])/h), cells[1]-1);
+      int cz = std::min(static_cast<int>((xz[i] - lo[2])/h), cells[2]-1);
+      cellOf[i] = (cz*cells[1] + cy)*cells[0] + cx;
+      cellStart[cellOf[i] + 1]++;
+    }
+    for (long int c = 0; c < total; ++c) cellStart[c+1] += cellStart[c];
+
+    std::vector<int> next(cellStart.begin(), cellStart.end()-1);
+    for (int i = 0; i < NumberOfBodies; ++i) {
+      const int k = next[cellOf[i]]++;
+      sortedSlot[i] = k;
+      sortedX[k] = xx[i];
+      sortedY[k] = xy[i];
+      sortedZ[k] = xz[i];
+      sortedM[k] = m[i];
+    }
+  }
+
+  void freeLongRange() {
+    if (alx != nullptr) free(alx);
+    if (aly != nullptr) free(aly);
+    if (alz != nullptr) free(alz);
+    alx = aly = alz = nullptr;
+  }
+
+  void evaluateLongRange() {
+    long_range_gravity();
+    longRangeEvaluations++;
+  }
+
+  /**
+   * Merging changes the body indices, so the long-range part has to be
+   * recomputed for the merged bodies.
+   */
+  void evaluateShortRange() {
+    if (short_range_gravity_and_detect_collision()) {
+      process_collisions();
+      short_range_gravity_and_detect_collision();
+      long_range_gravity();
+      longRangeEvaluations++;
+    }
+    shortRangeEvaluations++;
+    forceEvaluations++;
+  }
+
+  void kickLongRange(double kick) {
+    #pragma omp simd
+    for (int i = 0; i<NumberOfBodies; ++i){
+      vx[i] += kick * alx[i];
+      vy[i] += kick * aly[i];
+      vz[i] += kick * alz[i];
+    }
+  }
+};
+
+#endif
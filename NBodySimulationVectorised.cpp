@@ -1,3 +1,6 @@
+#ifndef NBODYSIMULATIONVECTORISED_CPP
+#define NBODYSIMULATIONVECTORISED_CPP
+
 #include "NBodySimulation.h"
 
 class NBodySimulationVectorised : public NBodySimulation {
@@ -9,17 +12,20 @@ protected:
   */
   bool process_gravity_and_detect_collision()
   {
+    if (reproducible) return process_gravity_reproducible();
+
     std::fill(ax, ax+NumberOfBodies, 0);
     std::fill(ay, ay+NumberOfBodies, 0);
     std::fill(az, az+NumberOfBodies, 0);
     double m_minDx = std::numeric_limits<double>::max();
     double m_minC = std::numeric_limits<double>::max();
+    double m_epot = 0;
 
     for (int i = 0; i<NumberOfBodies; ++i){
-      double axi(0),ayi(0),azi(0);
+      double axi(0),ayi(0),azi(0),epi(0);
       double xxi(xx[i]), xyi(xy[i]), xzi(xz[i]), mi(m[i]);
      #pragma omp simd \
-        reduction(+:axi,ayi,azi) \
+        reduction(+:axi,ayi,azi,epi) \
         reduction(min:m_minDx,m_minC)
       for (int j=i+1; j<NumberOfBodies; ++j){
         double dx = xx[j]-xxi;
@@ -39,6 +45,7 @@ protected:
         ax[j] -= gx*mi;
         ay[j] -= gy*mi;
         az[j] -= gz*mi;
+        epi   += m[j]/dst;
 
         m_minDx = std::min(m_minDx, dst);
         m_minC = std::min(m_minC, dst/(mi + m[j]));
@@ -48,48 +55,222 @@ protected:
       ax[i] += axi;
       ay[i] += ayi;
       az[i] += azi;
+      m_epot -= mi*epi;
     }
 
     minDx = m_minDx;
+    potentialEnergy = m_epot;
     return false;
   }
 
 
-public:
-  void updateBody () {
-    timeStepCounter++;
-    maxV   = 0.0;
-    minDx  = std::numeric_limits<double>::max();
+  /**
+   * Same as process_gravity_and_detect_collision() with the jerk for the
+   * Hermite integrator.
+   */
+  bool process_gravity_jerk_and_detect_collision()
+  {
+    std::fill(ax, ax+NumberOfBodies, 0);
+    std::fill(ay, ay+NumberOfBodies, 0);
+    std::fill(az, az+NumberOfBodies, 0);
+    std::fill(jx, jx+NumberOfBodies, 0);
+    std::fill(jy, jy+NumberOfBodies, 0);
+    std::fill(jz, jz+NumberOfBodies, 0);
+    double m_minDx = std::numeric_limits<double>::max();
+    double m_minC = std::numeric_limits<double>::max();
+    double m_epot = 0;
 
+    for (int i = 0; i<NumberOfBodies; ++i){
+      double axi(0),ayi(0),azi(0),jxi(0),jyi(0),jzi(0),epi(0);
+      double xxi(xx[i]), xyi(xy[i]), xzi(xz[i]), mi(m[i]);
+      double vxi(vx[i]), vyi(vy[i]), vzi(vz[i]);
+     #pragma omp simd \
+        reduction(+:axi,ayi,azi,jxi,jyi,jzi,epi) \
+        reduction(min:m_minDx,m_minC)
+      for (int j=i+1; j<NumberOfBodies; ++j){
+        double dx = xx[j]-xxi;
+        double dy = xy[j]-xyi;
+        double dz = xz[j]-xzi;
+        double dvx = vx[j]-vxi;
+        double dvy = vy[j]-vyi;
+        double dvz = vz[j]-vzi;
+        double dst2 = dx*dx + dy*dy + dz*dz;
+        double dst = std::sqrt(dst2);
+        double dst3 = dst2 * dst;
+        double rv = 3*(dx*dvx + dy*dvy + dz*dvz)/dst2;
+
+        double gx = dx/dst3;
+        double gy = dy/dst3;
+        double gz = dz/dst3;
+        double hx = (dvx - rv*dx)/dst3;
+        double hy = (dvy - rv*dy)/dst3;
+        double hz = (dvz - rv*dz)/dst3;
+
+        axi += gx*m[j];
+        ayi += gy*m[j];
+        azi += gz*m[j];
+        jxi += hx*m[j];
+        jyi += hy*m[j];
+        jzi += hz*m[j];
+        ax[j] -= gx*mi;
+        ay[j] -= gy*mi;
+        az[j] -= gz*mi;
+        jx[j] -= hx*mi;
+        jy[j] -= hy*mi;
+        jz[j] -= hz*mi;
+        epi   += m[j]/dst;
+
+        m_minDx = std::min(m_minDx, dst);
+        m_minC = std::min(m_minC, dst/(mi + m[j]));
+      }
+
+      if (m_minC < C) return true;
+      ax[i] += axi;
+      ay[i] += ayi;
+      az[i] += azi;
+      jx[i] += jxi;
+      jy[i] += jyi;
+      jz[i] += jzi;
+      m_epot -= mi*epi;
+    }
+
+    minDx = m_minDx;
+    potentialEnergy = m_epot;
+    return false;
+  }
+
+  /**
+   * Tracers first to last against all massive bodies. The massive bodies
+   * are processed in tiles that stay in the L1 cache while all tracers of
+   * the range stream past them; each tracer reduces over the tile in SIMD
+   * lanes, as the massive bodies do in the kernel above.
+   */
+  void tracer_block(int first, int last)
+  {
+    std::fill(tax+first, tax+last, 0);
+    std::fill(tay+first, tay+last, 0);
+    std::fill(taz+first, taz+last, 0);
+
+    for (int tile = 0; tile < NumberOfBodies; tile += tracerSourceTile){
+      const int tileEnd = std::min(tile + tracerSourceTile, NumberOfBodies);
+
+      for (int i = first; i < last; ++i){
+        double axi(0), ayi(0), azi(0);
+        double xxi(txx[i]), xyi(txy[i]), xzi(txz[i]);
+       #pragma omp simd reduction(+:axi,ayi,azi)
+        for (int j = tile; j < tileEnd; ++j){
+          double dx = xx[j]-xxi;
+          double dy = xy[j]-xyi;
+          double dz = xz[j]-xzi;
+          double dst2 = dx*dx + dy*dy + dz*dz;
+          double g = m[j]/(dst2*std::sqrt(dst2));
+
+          axi += g*dx;
+          ayi += g*dy;
+          azi += g*dz;
+        }
+        tax[i] += axi;
+        tay[i] += ayi;
+        taz[i] += azi;
+      }
+    }
+  }
+
+  void process_tracers()
+  {
+    if (reproducible) return process_tracers_reproducible();
+    tracer_block(0, NumberOfTracers);
+  }
+
+  void kickDriftTracers (double kick, double drift) {
     #pragma omp simd
-    for (int i = 0; i<NumberOfBodies; ++i){    
-      vx[i] += timeStepSize/2 * ax[i];
-      vy[i] += timeStepSize/2 * ay[i];
-      vz[i] += timeStepSize/2 * az[i];
+    for (int i = 0; i<NumberOfTracers; ++i){
+      tvx[i] += kick  * tax[i];
+      tvy[i] += kick  * tay[i];
+      tvz[i] += kick  * taz[i];
 
-      xx[i] += timeStepSize   * vx[i];
-      xy[i] += timeStepSize   * vy[i];
-      xz[i] += timeStepSize   * vz[i];
+      txx[i] += drift * tvx[i];
+      txy[i] += drift * tvy[i];
+      txz[i] += drift * tvz[i];
     }
+  }
+
+  void kickDrift (double kick, double drift) {
+    #pragma omp simd
+    for (int i = 0; i<NumberOfBodies; ++i){    
+      vx[i] += kick  * ax[i];
+      vy[i] += kick  * ay[i];
+      vz[i] += kick  * az[i];
 
-    if (process_gravity_and_detect_collision())
-    {
-      process_collisions();
-      process_gravity_and_detect_collision();
+      xx[i] += drift * vx[i];
+      xy[i] += drift * vy[i];
+      xz[i] += drift * vz[i];
     }
+  }
 
+  void closingKick (double kick) {
     double m_maxV = 0;
-    #pragma omp simd reduction(max:m_maxV)
+    double ekin(0), mvx(0), mvy(0), mvz(0), lx(0), ly(0), lz(0), ls(0);
+    #pragma omp simd reduction(max:m_maxV) \
+      reduction(+:ekin,mvx,mvy,mvz,lx,ly,lz,ls)
     for (int i = 0; i<NumberOfBodies; ++i){    
-      vx[i] += timeStepSize/2 * ax[i];
-      vy[i] += timeStepSize/2 * ay[i];
-      vz[i] += timeStepSize/2 * az[i];
+      vx[i] += kick * ax[i];
+      vy[i] += kick * ay[i];
+      vz[i] += kick * az[i];
       
-      m_maxV = std::max(maxV, std::sqrt(vx[i]*vx[i] + vy[i]*vy[i] + vz[i]*vz[i]));
+      double v2 = vx[i]*vx[i] + vy[i]*vy[i] + vz[i]*vz[i];
+      m_maxV = std::max(m_maxV, std::sqrt(v2));
+
+      ekin += m[i]*v2;
+      mvx  += m[i]*vx[i];
+      mvy  += m[i]*vy[i];
+      mvz  += m[i]*vz[i];
+      lx   += m[i]*(xy[i]*vz[i] - xz[i]*vy[i]);
+      ly   += m[i]*(xz[i]*vx[i] - xx[i]*vz[i]);
+      lz   += m[i]*(xx[i]*vy[i] - xy[i]*vx[i]);
+      ls   += m[i]*std::sqrt((xx[i]*xx[i] + xy[i]*xy[i] + xz[i]*xz[i])*v2);
     }
     
     maxV = m_maxV;
-    t += timeStepSize;
+    kineticEnergy = 0.5*ekin;
+    px = mvx; py = mvy; pz = mvz;
+    Lx = lx;  Ly = ly;  Lz = lz;
+    angularMomentumScale = ls;
+    if (reproducible) accumulate_diagnostics_reproducible();
+  }
+
+  void hermitePredict (double dt) {
+    const double dt2 = dt*dt/2, dt3 = dt*dt*dt/6;
+    #pragma omp simd
+    for (int i = 0; i<NumberOfBodies; ++i){
+      xx[i] += vx[i]*dt + ax[i]*dt2 + jx[i]*dt3;
+      xy[i] += vy[i]*dt + ay[i]*dt2 + jy[i]*dt3;
+      xz[i] += vz[i]*dt + az[i]*dt2 + jz[i]*dt3;
+      vx[i] += ax[i]*dt + jx[i]*dt2;
+      vy[i] += ay[i]*dt + jy[i]*dt2;
+      vz[i] += az[i]*dt + jz[i]*dt2;
+    }
+  }
+
+  void hermiteCorrect (double dt) {
+    const int n = hermiteStride;
+    const double* x0 = hermiteSaved;
+    const double* v0 = x0 + 3*n;
+    const double* a0 = v0 + 3*n;
+    const double* j0 = a0 + 3*n;
+    const double h = dt/2, h2 = dt*dt/12;
+
+    #pragma omp simd
+    for (int i = 0; i<NumberOfBodies; ++i){
+      vx[i] = v0[i]     + (a0[i]     + ax[i])*h + (j0[i]     - jx[i])*h2;
+      vy[i] = v0[i+n]   + (a0[i+n]   + ay[i])*h + (j0[i+n]   - jy[i])*h2;
+      vz[i] = v0[i+2*n] + (a0[i+2*n] + az[i])*h + (j0[i+2*n] - jz[i])*h2;
+      xx[i] = x0[i]     + (v0[i]     + vx[i])*h + (a0[i]     - ax[i])*h2;
+      xy[i] = x0[i+n]   + (v0[i+n]   + vy[i])*h + (a0[i+n]   - ay[i])*h2;
+      xz[i] = x0[i+2*n] + (v0[i+2*n] + vz[i])*h + (a0[i+2*n] - az[i])*h2;
+    }
   }
 
 };
+
+#endif
@@ -0,0 +1,224 @@
+#include "NBodySnapshotFilter.h"
+#include "NBodyError.h"
+#include "NBodyScenario.h"
+#include "NBodySimulation.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <sstream>
+
+#include <omp.h>
+
+namespace {
+  /**
+   * Append the i in [0,n) with keep(i) to out, in order. Every thread
+   * collects one contiguous range of the static schedule, and the ranges
+   * are joined in thread order.
+   */
+  template <class Keep>
+  void compact (int n, const Keep& keep, std::vector<int>& out) {
+    std::vector<std::vector<int> > parts(omp_get_max_threads());
+    #pragma omp parallel
+    {
+      std::vector<int>& part = parts[omp_get_thread_num()];
+      #pragma omp for schedule(static)
+      for (int i = 0; i < n; ++i) {
+        if (keep(i)) part.push_back(i);
+      }
+    }
+    for (size_t t = 0; t < parts.size(); ++t) {
+      out.insert(out.end(), parts[t].begin(), parts[t].end());
+    }
+  }
+
+  int positiveOption (const char* name, const char* value) {
+    const int n = std::atoi(value);
+    if (n < 1) {
+      throw NBodyError() << name << " has to be a positive integer";
+    }
+    return n;
+  }
+}
+
+NBodySnapshotFilter::NBodySnapshotFilter () :
+  stride(1), sample(0), seed(1), region(false),
+  densityCells(0), fullDelta(0), tFull(0) {
+  for (int d = 0; d < 3; ++d) regionMin[d] = regionMax[d] = 0;
+}
+
+void NBodySnapshotFilter::readEnvironmentOptions () {
+  const char* value = std::getenv("NBODY_SNAPSHOT_STRIDE");
+  if (value != nullptr) stride = positiveOption("NBODY_SNAPSHOT_STRIDE", value);
+
+  value = std::getenv("NBODY_SNAPSHOT_SAMPLE");
+  if (value != nullptr) sample = positiveOption("NBODY_SNAPSHOT_SAMPLE", value);
+
+  value = std::getenv("NBODY_SNAPSHOT_SEED");
+  if (value != nullptr) seed = std::strtoull(value, nullptr, 10);
+
+  value = std::getenv("NBODY_SNAPSHOT_DENSITY");
+  if (value != nullptr) densityCells = positiveOption("NBODY_SNAPSHOT_DENSITY", value);
+
+  value = std::getenv("NBODY_SNAPSHOT_FULL_DELTA");
+  if (value != nullptr) fullDelta = std::max(0.0, std::atof(value));
+
+  value = std::getenv("NBODY_SNAPSHOT_REGION");
+  if (value != nullptr) {
+    std::string box(value);
+    std::replace(box.begin(), box.end(), ',', ' ');
+    std::istringstream in(box);
+    in >> regionMin[0] >> regionMin[1] >> regionMin[2]
+       >> regionMax[0] >> regionMax[1] >> regionMax[2];
+    if (!in || regionMin[0] >= regionMax[0] || regionMin[1] >= regionMax[1] ||
+        regionMin[2] >= regionMax[2]) {
+      throw NBodyError() << "NBODY_SNAPSHOT_REGION has to be x0,y0,z0,x1,y1,z1"
+                            " with x0<x1, y0<y1 and z0<z1";
+    }
+    region = true;
+  }
+}
+
+bool NBodySnapshotFilter::fullResolution (double t) {
+  if (fullDelta > 0 && t >= tFull) {
+    while (tFull <= t) tFull += fullDelta;
+    return true;
+  }
+  // the density alone stands in for the bodies between the full dumps
+  if (densityCells > 0 && fullDelta > 0) return false;
+  return !filtersBodies();
+}
+
+bool NBodySnapshotFilter::filtersBodies () const {
+  return stride > 1 || sample > 0 || region;
+}
+
+void NBodySnapshotFilter::select (const NBodySimulation& s, bool full,
+                                  std::vector<int>& bodies, std::vector<int>& tracers) const {
+  bodies.clear();
+  tracers.clear();
+  if (full) {
+    bodies.resize(s.NumberOfBodies);
+    tracers.resize(s.NumberOfTracers);
+    for (int i = 0; i < s.NumberOfBodies; ++i)  bodies[i] = i;
+    for (int i = 0; i < s.NumberOfTracers; ++i) tracers[i] = i;
+    return;
+  }
+
+  double mass = 0;
+  if (sample > 0) {
+    #pragma omp parallel for reduction(+:mass)
+    for (int i = 0; i < s.NumberOfBodies; ++i) mass += s.m[i];
+  }
+
+  const NBodyScenario::Philox philox(seed);
+  const bool   inRegion = region;
+  const double* lo = regionMin;
+  const double* hi = regionMax;
+  auto inside = [inRegion, lo, hi](double x, double y, double z) {
+    return !inRegion ||
+      (x >= lo[0] && x < hi[0] && y >= lo[1] && y < hi[1] && z >= lo[2] && z < hi[2]);
+  };
+  const int k = stride, n = sample;
+
+  compact(s.NumberOfBodies, [&](int i) {
+    if (!inside(s.xx[i], s.xy[i], s.xz[i])) return false;
+    if (s.id[i] % k != 0) return false;
+    if (n > 0) {
+      const double p = n*s.m[i]/mass;
+      if (p < 1) {
+        NBodyScenario::Stream random(philox, s.id[i], NBodyScenario::SnapshotSampleDomain);
+        if (random.uniform() >= p) return false;
+      }
+    }
+    return true;
+  }, bodies);
+
+  compact(s.NumberOfTracers, [&](int i) {
+    return inside(s.txx[i], s.txy[i], s.txz[i]) && s.tid[i] % k == 0;
+  }, tracers);
+}
+
+void NBodySnapshotFilter::writeDensity (const NBodySimulation& s, const std::string& fileName) const {
+  const int nc = densityCells;
+  double lo[3], hi[3];
+  if (region) {
+    std::copy(regionMin, regionMin+3, lo);
+    std::copy(regionMax, regionMax+3, hi);
+  }
+  else {
+    double x0 = std::numeric_limits<double>::max(), y0 = x0, z0 = x0;
+    double x1 = -x0, y1 = -x0, z1 = -x0;
+    #pragma omp parallel for reduction(min:x0,y0,z0) reduction(max:x1,y1,z1)
+    for (int i = 0; i < s.NumberOfBodies; ++i) {
+      x0 = std::min(x0, s.xx[i]); x1 = std::max(x1, s.xx[i]);
+      y0 = std::min(y0, s.xy[i]); y1 = std::max(y1, s.xy[i]);
+      z0 = std::min(z0, s.xz[i]); z1 = std::max(z1, s.xz[i]);
+    }
+    lo[0] = x0; lo[1] = y0; lo[2] = z0;
+    hi[0] = x1; hi[1] = y1; hi[2] = z1;
+    // the largest coordinates have to fall into the last voxel
+    for (int d = 0; d < 3; ++d) {
+      const double width = std::max(hi[d]-lo[d], 1e-12);
+      hi[d] = lo[d] + width*(1 + 1e-9);
+    }
+  }
+
+  double h[3];
+  for (int d = 0; d < 3; ++d) h[d] = (hi[d]-lo[d])/nc;
+
+  // The bodies are sorted into z-slabs, which own disjoint voxels. Every
+  // slab is deposited by one thread in the order of the bodies, so the
+  // density does not depend on the number of threads.
+  const int n = s.NumberOfBodies;
+  std::vector<long> voxel(n);
+  #pragma omp parallel for
+  for (int i = 0; i < n; ++i) {
+    const long cx = static_cast<long>(std::floor((s.xx[i]-lo[0])/h[0]));
+    const long cy = static_cast<long>(std::floor((s.xy[i]-lo[1])/h[1]));
+    const long cz = static_cast<long>(std::floor((s.xz[i]-lo[2])/h[2]));
+    const bool inside = cx >= 0 && cx < nc && cy >= 0 && cy < nc && cz >= 0 && cz < nc;
+    voxel[i] = inside ? (cz*nc + cy)*nc + cx : -1;
+  }
+
+  const long slabVoxels = static_cast<long>(nc)*nc;
+  std::vector<int> slabStart(nc+2, 0), slabOrder(n);
+  for (int i = 0; i < n; ++i) {
+    if (voxel[i] >= 0) slabStart[voxel[i]/slabVoxels+2]++;
+  }
+  for (int z = 2; z < nc+2; ++z) slabStart[z] += slabStart[z-1];
+  for (int i = 0; i < n; ++i) {
+    if (voxel[i] >= 0) slabOrder[slabStart[voxel[i]/slabVoxels+1]++] = i;
+  }
+
+  std::vector<double> density(static_cast<size_t>(nc)*nc*nc, 0.0);
+  #pragma omp parallel for schedule(dynamic)
+  for (int z = 0; z < nc; ++z) {
+    for (int q = slabStart[z]; q < slabStart[z+1]; ++q) {
+      const int i = slabOrder[q];
+      density[voxel[i]] += s.m[i];
+    }
+  }
+
+  const double volume = h[0]*h[1]*h[2];
+  std::ofstream out(fileName.c_str());
+  out << std::setprecision(9)
+      << "<?xml version=\"1.0\"?>" << std::endl
+      << "<VTKFile type=\"ImageData\" version=\"0.1\" byte_order=\"LittleEndian\">" << std::endl
+      << "<ImageData WholeExtent=\"0 " << nc << " 0 " << nc << " 0 " << nc << "\""
+      << " Origin=\"" << lo[0] << " " << lo[1] << " " << lo[2] << "\""
+      << " Spacing=\"" << h[0] << " " << h[1] << " " << h[2] << "\">" << std::endl
+      << " <Piece Extent=\"0 " << nc << " 0 " << nc << " 0 " << nc << "\">" << std::endl
+      << "  <CellData Scalars=\"density\">" << std::endl
+      << "   <DataArray type=\"Float64\" Name=\"density\" format=\"ascii\">";
+  for (size_t c = 0; c < density.size(); ++c) out << density[c]/volume << " ";
+  out << "   </DataArray>" << std::endl
+      << "  </CellData>" << std::endl
+      << " </Piece>" << std::endl
+      << "</ImageData>" << std::endl
+      << "</VTKFile>" << std::endl;
+}
@@ -0,0 +1,82 @@
+#ifndef NBODYSNAPSHOTFILTER_H
+#define NBODYSNAPSHOTFILTER_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+class NBodySimulation;
+
+/**
+ * In-situ reduction of the ParaView snapshots, for monitoring large runs:
+ *
+ * - NBODY_SNAPSHOT_STRIDE=k writes the bodies whose id is a multiple of k.
+ * - NBODY_SNAPSHOT_SAMPLE=n writes about n bodies drawn at random with
+ *   probability proportional to their mass, min(1, n m_i / M). Every body
+ *   draws from its own Philox stream keyed on NBODY_SNAPSHOT_SEED (default
+ *   1) and its id, in a domain of its own, so the sample is independent of
+ *   the positions the scenarios drew from the same seed. The same bodies
+ *   are shown in every snapshot and the sample does not depend on the
+ *   number of threads. Tracers have no mass and are only subject to the
+ *   stride and the region.
+ * - NBODY_SNAPSHOT_REGION=x0,y0,z0,x1,y1,z1 writes the bodies in this box.
+ * - NBODY_SNAPSHOT_DENSITY=n writes in addition the mass density on n^3
+ *   voxels, as VTK ImageData paraview-output/density-k.vti, over the region
+ *   or else the bounding box of the bodies. It is listed in result.pvd as
+ *   part 1 of the time step.
+ * - NBODY_SNAPSHOT_FULL_DELTA=T writes the snapshots at full resolution
+ *   again every T time units. Without it, a reduced run never writes all
+ *   bodies. With the density and no other filter, the snapshots between
+ *   the full ones hold the density only.
+ *
+ * The filters combine, and they select the bodies in parallel before
+ * anything is written. The trajectory file (NBODY_TRAJECTORY) always holds
+ * all bodies.
+ */
+class NBodySnapshotFilter {
+public:
+  NBodySnapshotFilter ();
+
+  int      stride;
+  int      sample;
+  uint64_t seed;
+  bool     region;
+  double   regionMin[3], regionMax[3];
+  int      densityCells;
+  double   fullDelta;
+
+  /**
+   * Time of the next full-resolution snapshot.
+   */
+  double   tFull;
+
+  void readEnvironmentOptions ();
+
+  /**
+   * Whether the snapshot at time t is written at full resolution, i.e.
+   * nothing is filtered or it is time for a full dump. Advances tFull.
+   */
+  bool fullResolution (double t);
+
+  /**
+   * Whether stride, sample or region reduce the bodies. If not, snapshots
+   * that are not at full resolution write no bodies.
+   */
+  bool filtersBodies () const;
+
+  /**
+   * Indices of the bodies and tracers of s to write, in order. With full,
+   * all of them.
+   */
+  void select (const NBodySimulation& s, bool full,
+               std::vector<int>& bodies, std::vector<int>& tracers) const;
+
+  /**
+   * Write the mass density of the bodies of s as VTK ImageData. The same
+   * for any number of threads.
+   */
+  void writeDensity (const NBodySimulation& s, const std::string& fileName) const;
+};
+
+#endif
@@ -0,0 +1,300 @@
+#include "NBodyTrajectory.h"
+#include "NBodyError.h"
+#include "NBodySimulation.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/types.h>
+
+using namespace NBodyTrajectory;
+
+namespace {
+  const int NumberOfColumns = 7;
+
+  size_t frameBytes (const FrameHeader& header, Precision precision) {
+    const size_t rows = header.numberOfBodies + header.numberOfTracers;
+    const bool   differences = precision == Float32 && !header.keyFrame;
+    return sizeof(FrameHeader) + rows*sizeof(int32_t) +
+           NumberOfColumns*rows*(differences ? sizeof(float) : sizeof(double));
+  }
+
+  template <class T>
+  void appendBytes (std::vector<char>& buffer, const T* data, size_t n) {
+    const size_t size = buffer.size();
+    buffer.resize(size + n*sizeof(T));
+    if (n > 0) std::memcpy(&buffer[size], data, n*sizeof(T));
+  }
+
+  bool readBytes (std::FILE* file, void* data, size_t bytes) {
+    return bytes == 0 || std::fread(data, bytes, 1, file) == 1;
+  }
+}
+
+NBodyTrajectoryWriter::NBodyTrajectoryWriter (const std::string& fileName,
+                                              Precision precision, int chunkFrames) :
+  _file(std::fopen(fileName.c_str(), "wb")), _precision(precision),
+  _chunkFrames(std::max(1, chunkFrames)), _offset(0), _framesInChunk(0),
+  _rows(0), _column(0), _keyFrame(true), _numberOfBodies(0) {
+  if (_file == nullptr) {
+    throw NBodyError() << "cannot open trajectory file " << fileName;
+  }
+  FileHeader header = { FileMagic, Version, static_cast<uint32_t>(precision),
+                        static_cast<uint32_t>(_chunkFrames) };
+  appendBytes(_buffer, &header, 1);
+}
+
+NBodyTrajectoryWriter::~NBodyTrajectoryWriter () {
+  try {
+    close();
+  }
+  catch (const NBodyError&) {
+    // a destructor must not throw, callers that care call close() first
+    std::fclose(_file);
+  }
+}
+
+void NBodyTrajectoryWriter::beginFrame (double t, int timeStep,
+                                        int numberOfBodies, int numberOfTracers,
+                                        const int32_t* bodyIds, const int32_t* tracerIds) {
+  const int rows = numberOfBodies + numberOfTracers;
+
+  // differences are only taken between frames with the same bodies in the
+  // same order, and never across chunks
+  bool sameBodies = _framesInChunk > 0 && rows == _rows && numberOfBodies == _numberOfBodies &&
+    std::equal(bodyIds, bodyIds+numberOfBodies, _previousId.begin()) &&
+    std::equal(tracerIds, tracerIds+numberOfTracers, _previousId.begin()+numberOfBodies);
+  _keyFrame = _precision == Float64 || !sameBodies;
+
+  IndexEntry entry = {
+    _offset + _buffer.size(), t, timeStep,
+    static_cast<uint32_t>(numberOfBodies), static_cast<uint32_t>(numberOfTracers),
+    _keyFrame ? static_cast<uint32_t>(_index.size()) : _index.back().keyFrame
+  };
+  _index.push_back(entry);
+
+  FrameHeader header = {
+    FrameMagic, _keyFrame ? 1u : 0u,
+    static_cast<uint32_t>(numberOfBodies), static_cast<uint32_t>(numberOfTracers),
+    timeStep, 0, t
+  };
+  appendBytes(_buffer, &header, 1);
+  appendBytes(_buffer, bodyIds, numberOfBodies);
+  appendBytes(_buffer, tracerIds, numberOfTracers);
+
+  _previousId.assign(bodyIds, bodyIds+numberOfBodies);
+  _previousId.insert(_previousId.end(), tracerIds, tracerIds+numberOfTracers);
+  _rows           = rows;
+  _numberOfBodies = numberOfBodies;
+  _column         = 0;
+  if (_precision == Float32) _previous.resize(NumberOfColumns*rows);
+}
+
+/**
+ * One column of the current frame. A null tracers pointer stands for zeros.
+ */
+void NBodyTrajectoryWriter::column (const double* bodies, const double* tracers) {
+  double* previous = _precision == Float32 ? _previous.data() + _column*_rows : nullptr;
+
+  if (_keyFrame) {
+    appendBytes(_buffer, bodies, _numberOfBodies);
+    if (tracers != nullptr) appendBytes(_buffer, tracers, _rows-_numberOfBodies);
+    else _buffer.resize(_buffer.size() + (_rows-_numberOfBodies)*sizeof(double), 0);
+
+    if (previous != nullptr) {
+      std::copy(bodies, bodies+_numberOfBodies, previous);
+      if (tracers != nullptr) std::copy(tracers, tracers+_rows-_numberOfBodies, previous+_numberOfBodies);
+      else std::fill(previous+_numberOfBodies, previous+_rows, 0.0);
+    }
+  }
+  else {
+    _quantised.resize(_rows);
+    for (int i = 0; i < _rows; ++i) {
+      double value = i < _numberOfBodies ? bodies[i] :
+                     tracers != nullptr ? tracers[i-_numberOfBodies] : 0.0;
+      _quantised[i] = static_cast<float>(value - previous[i]);
+      previous[i] += _quantised[i];
+    }
+    appendBytes(_buffer, _quantised.data(), _rows);
+  }
+
+  if (++_column == NumberOfColumns && ++_framesInChunk == _chunkFrames) {
+    _framesInChunk = 0;
+    flush();
+  }
+  else if (_buffer.size() >= NBODY_TRAJECTORY_BUFFER) {
+    write();
+  }
+}
+
+void NBodyTrajectoryWriter::append (const NBodySimulation& s) {
+  beginFrame(s.t, s.timeStepCounter, s.NumberOfBodies, s.NumberOfTracers, s.id, s.tid);
+  column(s.xx, s.txx);
+  column(s.xy, s.txy);
+  column(s.xz, s.txz);
+  column(s.vx, s.tvx);
+  column(s.vy, s.tvy);
+  column(s.vz, s.tvz);
+  column(s.m,  nullptr);
+}
+
+void NBodyTrajectoryWriter::append (const Frame& f) {
+  const int n = f.numberOfBodies;
+  beginFrame(f.t, f.timeStep, n, f.numberOfTracers, f.id.data(), f.id.data()+n);
+  column(f.x.data(),  f.x.data()+n);
+  column(f.y.data(),  f.y.data()+n);
+  column(f.z.data(),  f.z.data()+n);
+  column(f.vx.data(), f.vx.data()+n);
+  column(f.vy.data(), f.vy.data()+n);
+  column(f.vz.data(), f.vz.data()+n);
+  column(f.m.data(),  f.m.data()+n);
+}
+
+void NBodyTrajectoryWriter::write () {
+  if (!_buffer.empty() && std::fwrite(_buffer.data(), _buffer.size(), 1, _file) != 1) {
+    throw NBodyError() << "cannot write trajectory file";
+  }
+  _offset += _buffer.size();
+  _buffer.clear();
+}
+
+/**
+ * Chunks are flushed to the file system as well, so a killed run leaves
+ * all complete chunks readable.
+ */
+void NBodyTrajectoryWriter::flush () {
+  write();
+  if (std::fflush(_file) != 0) {
+    throw NBodyError() << "cannot write trajectory file";
+  }
+}
+
+void NBodyTrajectoryWriter::close () {
+  if (_file == nullptr) return;
+  flush();
+
+  Footer footer = { _offset, _index.size(), FooterMagic, 0 };
+  appendBytes(_buffer, _index.data(), _index.size());
+  appendBytes(_buffer, &footer, 1);
+  flush();
+
+  std::fclose(_file);
+  _file = nullptr;
+}
+
+NBodyTrajectoryReader::NBodyTrajectoryReader (const std::string& fileName) :
+  _fileName(fileName), _file(std::fopen(fileName.c_str(), "rb")), _precision(Float64),
+  _recovered(false), _current(-1) {
+  FileHeader header;
+  if (_file == nullptr || !readBytes(_file, &header, sizeof(header)) ||
+      header.magic != FileMagic || header.version != Version ||
+      (header.precision != Float64 && header.precision != Float32)) {
+    throw NBodyError() << fileName << " is not a trajectory file";
+  }
+  _precision = static_cast<Precision>(header.precision);
+
+  fseeko(_file, 0, SEEK_END);
+  const uint64_t fileSize = ftello(_file);
+  if (!readFooter(fileSize)) {
+    scanFrames(fileSize);
+    _recovered = true;
+  }
+}
+
+NBodyTrajectoryReader::~NBodyTrajectoryReader () {
+  if (_file != nullptr) std::fclose(_file);
+}
+
+bool NBodyTrajectoryReader::readFooter (uint64_t fileSize) {
+  Footer footer;
+  if (fileSize < sizeof(FileHeader) + sizeof(Footer)) return false;
+  fseeko(_file, fileSize - sizeof(Footer), SEEK_SET);
+  if (!readBytes(_file, &footer, sizeof(footer)) || footer.magic != FooterMagic ||
+      footer.indexOffset + footer.numberOfFrames*sizeof(IndexEntry) + sizeof(Footer) != fileSize) {
+    return false;
+  }
+  _index.resize(footer.numberOfFrames);
+  fseeko(_file, footer.indexOffset, SEEK_SET);
+  return readBytes(_file, _index.data(), _index.size()*sizeof(IndexEntry));
+}
+
+/**
+ * Index of a file without footer. A truncated last frame is dropped.
+ */
+void NBodyTrajectoryReader::scanFrames (uint64_t fileSize) {
+  _index.clear();
+  uint64_t offset = sizeof(FileHeader);
+  FrameHeader header;
+  while (offset + sizeof(FrameHeader) <= fileSize) {
+    fseeko(_file, offset, SEEK_SET);
+    if (!readBytes(_file, &header, sizeof(header)) || header.magic != FrameMagic ||
+        offset + frameBytes(header, _precision) > fileSize ||
+        (!header.keyFrame && _index.empty())) break;
+
+    IndexEntry entry = {
+      offset, header.t, header.timeStep, header.numberOfBodies, header.numberOfTracers,
+      header.keyFrame ? static_cast<uint32_t>(_index.size()) : _index.back().keyFrame
+    };
+    _index.push_back(entry);
+    offset += frameBytes(header, _precision);
+  }
+}
+
+void NBodyTrajectoryReader::read (int frame, Frame& result) {
+  if (frame < 0 || frame >= numberOfFrames()) {
+    throw NBodyError() << _fileName << " has no frame " << frame
+                       << " (" << numberOfFrames() << " frames)";
+  }
+
+  if (frame != _current) {
+    // continue from the last decoded frame if it is on the way
+    int next = static_cast<int>(_index[frame].keyFrame);
+    if (_current >= next && _current < frame) next = _current+1;
+
+    // a failed decode leaves no valid frame to continue from
+    _current = -1;
+    fseeko(_file, _index[next].offset, SEEK_SET);
+    for (int k = next; k <= frame; ++k) decodeNext(_decoded);
+    _current = frame;
+  }
+  result = _decoded;
+}
+
+/**
+ * Decode the frame at the file position. A difference frame is added to the
+ * frame in result, which has to be its predecessor.
+ */
+void NBodyTrajectoryReader::decodeNext (Frame& result) {
+  FrameHeader header;
+  if (!readBytes(_file, &header, sizeof(header)) || header.magic != FrameMagic) {
+    throw NBodyError() << _fileName << " is corrupt";
+  }
+  const size_t rows = header.numberOfBodies + header.numberOfTracers;
+
+  result.t               = header.t;
+  result.timeStep        = header.timeStep;
+  result.numberOfBodies  = header.numberOfBodies;
+  result.numberOfTracers = header.numberOfTracers;
+  result.id.resize(rows);
+
+  std::vector<double>* columns[NumberOfColumns] = {
+    &result.x, &result.y, &result.z, &result.vx, &result.vy, &result.vz, &result.m
+  };
+  bool ok = readBytes(_file, result.id.data(), rows*sizeof(int32_t));
+  for (int c = 0; c < NumberOfColumns && ok; ++c) {
+    std::vector<double>& column = *columns[c];
+    if (header.keyFrame) {
+      column.resize(rows);
+      ok = readBytes(_file, column.data(), rows*sizeof(double));
+    }
+    else {
+      _buffer.resize(rows);
+      ok = readBytes(_file, _buffer.data(), rows*sizeof(float));
+      for (size_t i = 0; i < rows; ++i) column[i] += _buffer[i];
+    }
+  }
+  if (!ok) {
+    throw NBodyError() << _fileName << " is truncated";
+  }
+}
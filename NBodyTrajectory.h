@@ -0,0 +1,208 @@
+#ifndef NBODYTRAJECTORY_H
+#define NBODYTRAJECTORY_H
+
+#include <stdint.h>
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+class NBodySimulation;
+
+/**
+ * Number of frames written per chunk. Every chunk starts with a key frame,
+ * so reading any frame decodes at most this many frames.
+ */
+#ifndef NBODY_TRAJECTORY_CHUNK
+#define NBODY_TRAJECTORY_CHUNK 64
+#endif
+
+/**
+ * Bytes the writer buffers before they are written to the file, so the
+ * memory used does not grow with the number of bodies.
+ */
+#ifndef NBODY_TRAJECTORY_BUFFER
+#define NBODY_TRAJECTORY_BUFFER (1 << 22)
+#endif
+
+/**
+ * Single-file trajectory, an alternative to one .vtp file per snapshot.
+ *
+ * A file starts with a FileHeader and holds the frames one after the other.
+ * A frame is a FrameHeader followed by the columns id, x, y, z, vx, vy, vz
+ * and m, each of numberOfBodies+numberOfTracers entries: the massive bodies
+ * first, then the tracers with mass 0, as in the ParaView snapshots. ids are
+ * int32 and the position in the setup. The other columns are float64. In
+ * the quantised format, a frame whose ids are those of the previous frame
+ * stores instead the float32 differences to the previous frame as decoded,
+ * so the error does not accumulate and is relative to the motion since the
+ * last frame rather than to the coordinates. Only the first frame of a chunk
+ * and frames after merges are key frames with float64 values.
+ *
+ * Frames are grouped in chunks of NBODY_TRAJECTORY_CHUNK frames. They are
+ * written through a buffer of NBODY_TRAJECTORY_BUFFER bytes, and the file is
+ * flushed at the end of every chunk. Only the index stays in memory.
+ * close() appends the index of all frames and a Footer pointing to it, so a
+ * reader seeks to any frame directly. A file without footer, e.g. of a run
+ * that was killed, is indexed by scanning the frames. All values are in the
+ * byte order of the machine, which is little endian on the machines this
+ * code targets.
+ */
+namespace NBodyTrajectory {
+  const uint32_t FileMagic   = 0x544a424e; // "NBJT"
+  const uint32_t FrameMagic  = 0x4d52464e; // "NFRM"
+  const uint32_t FooterMagic = 0x5844494e; // "NIDX"
+  const uint32_t Version     = 1;
+
+  enum Precision { Float64 = 0, Float32 = 1 };
+
+  struct FileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t precision;
+    uint32_t chunkFrames;
+  };
+
+  struct FrameHeader {
+    uint32_t magic;
+    uint32_t keyFrame;
+    uint32_t numberOfBodies;
+    uint32_t numberOfTracers;
+    int32_t  timeStep;
+    uint32_t reserved;
+    double   t;
+  };
+
+  struct IndexEntry {
+    uint64_t offset;
+    double   t;
+    int32_t  timeStep;
+    uint32_t numberOfBodies;
+    uint32_t numberOfTracers;
+    uint32_t keyFrame;          // number of the key frame this frame is decoded from
+  };
+
+  struct Footer {
+    uint64_t indexOffset;
+    uint64_t numberOfFrames;
+    uint32_t magic;
+    uint32_t reserved;
+  };
+
+  /**
+   * One decoded frame. The arrays hold numberOfBodies+numberOfTracers
+   * entries, the tracers last.
+   */
+  struct Frame {
+    double               t;
+    int                  timeStep;
+    int                  numberOfBodies;
+    int                  numberOfTracers;
+    std::vector<int32_t> id;
+    std::vector<double>  x, y, z, vx, vy, vz, m;
+  };
+}
+
+/**
+ * Appends frames to a trajectory file. Used by NBodySimulation::takeSnapshot()
+ * if NBODY_TRAJECTORY is set.
+ */
+class NBodyTrajectoryWriter {
+public:
+  NBodyTrajectoryWriter (const std::string& fileName,
+                         NBodyTrajectory::Precision precision = NBodyTrajectory::Float64,
+                         int chunkFrames = NBODY_TRAJECTORY_CHUNK);
+  ~NBodyTrajectoryWriter ();
+
+  void append (const NBodySimulation& simulation);
+  void append (const NBodyTrajectory::Frame& frame);
+
+  /**
+   * Write the buffered frames, the index and the footer. Throws NBodyError
+   * if the file cannot be written. The destructor closes the file as well,
+   * but drops such errors.
+   */
+  void close ();
+
+private:
+  NBodyTrajectoryWriter (const NBodyTrajectoryWriter&);
+  NBodyTrajectoryWriter& operator= (const NBodyTrajectoryWriter&);
+
+  void beginFrame (double t, int timeStep, int numberOfBodies, int numberOfTracers,
+                   const int32_t* bodyIds, const int32_t* tracerIds);
+  void column (const double* bodies, const double* tracers);
+  void write ();
+  void flush ();
+
+  std::FILE*                 _file;
+  NBodyTrajectory::Precision _precision;
+  int                        _chunkFrames;
+  uint64_t                   _offset;
+  std::vector<char>          _buffer;
+  int                        _framesInChunk;
+
+  std::vector<NBodyTrajectory::IndexEntry> _index;
+
+  /**
+   * ids and decoded values of the previous frame, the reference of the
+   * differences in the quantised format, and the column being written.
+   */
+  std::vector<int32_t> _previousId;
+  std::vector<double>  _previous;
+  std::vector<float>   _quantised;
+  int                  _rows;
+  int                  _column;
+  bool                 _keyFrame;
+  int                  _numberOfBodies;
+};
+
+/**
+ * Random access to the frames of a trajectory file.
+ *
+ *   NBodyTrajectoryReader trajectory("paraview-output/result.nbt");
+ *   NBodyTrajectory::Frame frame;
+ *   trajectory.read(trajectory.numberOfFrames()-1, frame);
+ *
+ * Reading the frames in order decodes every frame once. Invalid files and
+ * frame numbers throw NBodyError; the reader stays usable after an invalid
+ * frame number or a corrupt frame.
+ */
+class NBodyTrajectoryReader {
+public:
+  explicit NBodyTrajectoryReader (const std::string& fileName);
+  ~NBodyTrajectoryReader ();
+
+  int                        numberOfFrames () const { return _index.size(); }
+  NBodyTrajectory::Precision precision () const { return _precision; }
+  const NBodyTrajectory::IndexEntry& entry (int frame) const { return _index[frame]; }
+
+  /**
+   * Whether the footer was missing and the index had to be rebuilt.
+   */
+  bool recovered () const { return _recovered; }
+
+  void read (int frame, NBodyTrajectory::Frame& result);
+
+private:
+  NBodyTrajectoryReader (const NBodyTrajectoryReader&);
+  NBodyTrajectoryReader& operator= (const NBodyTrajectoryReader&);
+
+  bool readFooter (uint64_t fileSize);
+  void scanFrames (uint64_t fileSize);
+  void decodeNext (NBodyTrajectory::Frame& result);
+
+  std::string                              _fileName;
+  std::FILE*                               _file;
+  NBodyTrajectory::Precision               _precision;
+  std::vector<NBodyTrajectory::IndexEntry> _index;
+  bool                                     _recovered;
+
+  /**
+   * Last decoded frame, continued from when the frames are read in order.
+   */
+  int                    _current;
+  NBodyTrajectory::Frame _decoded;
+  std::vector<float>     _buffer;
+};
+
+#endif
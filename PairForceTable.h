@@ -0,0 +1,214 @@
+#ifndef PAIRFORCETABLE_H
+#define PAIRFORCETABLE_H
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "NBodyError.h"
+
+/**
+ * Every octave of r^2 is split into 2^PAIR_FORCE_TABLE_BITS intervals.
+ */
+#ifndef PAIR_FORCE_TABLE_BITS
+#define PAIR_FORCE_TABLE_BITS 5
+#endif
+
+/**
+ * Number of octaves of r^2 below the cutoff that a tabulated analytic force
+ * covers, i.e. down to r = cutoff/2^(octaves/2). Closer pairs get the force
+ * factor of the innermost interval.
+ */
+#ifndef PAIR_FORCE_TABLE_OCTAVES
+#define PAIR_FORCE_TABLE_OCTAVES 24
+#endif
+
+/**
+ * Short-range pair force as a function of u = r^2.
+ *
+ * The table holds the factor f(u) = F(r)/r, where F is the radial force
+ * (positive if repulsive), so that body i feels f(u) (x_i-x_j). It is a
+ * cubic polynomial on each interval, interpolating f at the ends and at the
+ * thirds. The intervals are spaced logarithmically: the interval of u and
+ * the position t in it are the exponent and the leading mantissa bits of
+ * the double u, so an evaluation is a few integer operations, one gather
+ * of four coefficients and three FMAs, without sqrt or division, and
+ * vectorises in omp simd loops. As the relative width of the intervals is
+ * the same everywhere, so is the accuracy for power laws.
+ *
+ * The error against the function tabulated is measured on a dense sample
+ * when the table is built.
+ */
+class PairForceTable {
+public:
+  PairForceTable () :
+    cutoff2(0), minR(0), maxError(0), base(0), size(0) {}
+
+  bool empty () const { return size == 0; }
+
+  /**
+   * Square of the cutoff radius. The table is not evaluated beyond.
+   */
+  double cutoff2;
+
+  /**
+   * Smallest distance covered by the table.
+   */
+  double minR;
+
+  /**
+   * Largest error of f found on the sample, relative to |f|, or to the
+   * largest |f| of the octave below the cutoff where f is smaller.
+   */
+  double maxError;
+
+  inline double operator() (double u) const {
+    int64_t bits;
+    std::memcpy(&bits, &u, sizeof(bits));
+    int64_t k = (bits >> MantissaShift) - base;
+    double  t = static_cast<double>(bits & MantissaMask) * MantissaScale;
+    t = k < 0 ? 0.0 : t;
+    k = k < 0 ? 0 : (k < size ? k : size-1);
+    const double* c = coefficients.data() + 4*k;
+    return c[0] + t*(c[1] + t*(c[2] + t*c[3]));
+  }
+
+  /**
+   * Tabulate f(u) for u in [cutoff^2/2^octaves, cutoff^2].
+   */
+  template <class F>
+  void tabulate (const F& f, double cutoff, int octaves = PAIR_FORCE_TABLE_OCTAVES) {
+    build(f, cutoff*cutoff, std::ldexp(cutoff*cutoff, -octaves));
+  }
+
+  /**
+   * Read a pair force from a text file with lines "r F(r)", r increasing,
+   * and tabulate its cubic spline. Lines starting with # are comments. The
+   * table starts at the first r, the cutoff is the last r, but at most
+   * maxCutoff. Throws NBodyError on invalid files.
+   */
+  void load (const std::string& fileName, double maxCutoff) {
+    std::ifstream in(fileName.c_str());
+    if (!in) {
+      throw NBodyError() << "cannot open pair force table " << fileName;
+    }
+    std::vector<double> r, F;
+    std::string line;
+    int lineNumber = 0;
+    while (std::getline(in, line)) {
+      lineNumber++;
+      size_t first = line.find_first_not_of(" \t\r");
+      if (first == std::string::npos || line[first] == '#') continue;
+      std::istringstream values(line);
+      double ri, Fi;
+      if (!(values >> ri >> Fi) || ri <= 0 || (!r.empty() && ri <= r.back())) {
+        throw NBodyError() << fileName << ":" << lineNumber
+                           << ": expected \"r F(r)\" with r positive and increasing";
+      }
+      r.push_back(ri);
+      F.push_back(Fi);
+    }
+    if (r.size() < 4) {
+      throw NBodyError() << fileName << " needs at least four points";
+    }
+
+    Spline spline(r, F);
+    const double cutoff = std::min(maxCutoff, r.back());
+    build(spline, cutoff*cutoff, r.front()*r.front());
+  }
+
+private:
+  static const int     MantissaShift = 52 - PAIR_FORCE_TABLE_BITS;
+  static const int64_t MantissaMask  = (static_cast<int64_t>(1) << MantissaShift) - 1;
+  static constexpr double MantissaScale = 1.0 / static_cast<double>(static_cast<int64_t>(1) << MantissaShift);
+
+  /**
+   * Natural cubic spline of F(r), as f(u) = F(sqrt(u))/sqrt(u). The first
+   * and last pieces are extended to the ends of the table's octaves.
+   */
+  struct Spline {
+    std::vector<double> r, F, F2;
+
+    Spline (const std::vector<double>& r_, const std::vector<double>& F_) :
+      r(r_), F(F_), F2(r_.size(), 0.0) {
+      const int n = r.size();
+      std::vector<double> d(n, 0.0);
+      for (int i = 1; i < n-1; ++i) {
+        const double s = (r[i]-r[i-1]) / (r[i+1]-r[i-1]);
+        const double p = s*F2[i-1] + 2;
+        F2[i] = (s-1)/p;
+        d[i]  = (F[i+1]-F[i])/(r[i+1]-r[i]) - (F[i]-F[i-1])/(r[i]-r[i-1]);
+        d[i]  = (6*d[i]/(r[i+1]-r[i-1]) - s*d[i-1])/p;
+      }
+      for (int i = n-2; i > 0; --i) F2[i] = F2[i]*F2[i+1] + d[i];
+    }
+
+    double operator() (double u) const {
+      const double ri = std::sqrt(u);
+      const int k = std::max<int>(1, std::min<int>(std::upper_bound(r.begin(), r.end(), ri) - r.begin(), r.size()-1));
+      const double h = r[k]-r[k-1];
+      const double a = (r[k]-ri)/h, b = (ri-r[k-1])/h;
+      return (a*F[k-1] + b*F[k] + ((a*a*a-a)*F2[k-1] + (b*b*b-b)*F2[k])*h*h/6) / ri;
+    }
+  };
+
+  /**
+   * Coefficients of the intervals from the octave of minU to the octave of
+   * cutoff2, and the error of the table on [minU, cutoff2].
+   */
+  template <class F>
+  void build (const F& f, double cutoff2_, double minU) {
+    const int intervalsPerOctave = 1 << PAIR_FORCE_TABLE_BITS;
+    int lowest, highest;
+    std::frexp(minU, &lowest);
+    std::frexp(cutoff2_, &highest);
+    // frexp gives u = m 2^e with m in [0.5,1), the octaves are [2^(e-1), 2^e)
+    lowest--;
+
+    cutoff2 = cutoff2_;
+    minR    = std::sqrt(minU);
+    base    = static_cast<int64_t>(1023 + lowest) << PAIR_FORCE_TABLE_BITS;
+    size    = static_cast<int64_t>(highest - lowest) * intervalsPerOctave;
+    coefficients.resize(4*size);
+
+    for (int64_t k = 0; k < size; ++k) {
+      const double u0 = std::ldexp(1.0 + static_cast<double>(k % intervalsPerOctave)/intervalsPerOctave,
+                                   lowest + static_cast<int>(k / intervalsPerOctave));
+      const double h  = std::ldexp(1.0, lowest + static_cast<int>(k / intervalsPerOctave)) / intervalsPerOctave;
+      const double y0 = f(u0), y1 = f(u0 + h/3), y2 = f(u0 + 2*h/3), y3 = f(u0 + h);
+      double* c = coefficients.data() + 4*k;
+      c[0] = y0;
+      c[1] = (-11*y0 + 18*y1 - 9*y2 + 2*y3) / 2;
+      c[2] = 9*(2*y0 - 5*y1 + 4*y2 - y3) / 2;
+      c[3] = 9*(-y0 + 3*y1 - 3*y2 + y3) / 2;
+    }
+
+    double scale = 0;
+    for (int j = 0; j <= 64; ++j) {
+      scale = std::max(scale, std::abs(f(cutoff2/2 + j*cutoff2/128)));
+    }
+    maxError = 0;
+    for (int64_t k = 0; k < 16*size; ++k) {
+      const int64_t interval = k/16;
+      const double u = std::ldexp(1.0 + (interval % intervalsPerOctave + (k % 16 + 0.5)/16)/intervalsPerOctave,
+                                  lowest + static_cast<int>(interval / intervalsPerOctave));
+      if (u < minU || u > cutoff2) continue;
+      const double exact = f(u);
+      maxError = std::max(maxError, std::abs((*this)(u) - exact) / std::max(std::abs(exact), scale));
+    }
+  }
+
+  int64_t             base;
+  int64_t             size;
+  std::vector<double> coefficients;
+};
+
+#endif
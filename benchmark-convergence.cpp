@@ -0,0 +1,105 @@
+#include <cmath>
+#include <iomanip>
+#include <string>
+
+#include "NBodyEngine.h"
+
+/**
+ * Convergence study of the time integrators, extending the one of step 1.
+ *
+ *   make benchmark-convergence-gcc
+ *   ./benchmark-convergence-gcc [final-time]
+ *
+ * Two bodies A and B with x_A=(1,0,0), v_A=(0,0.5,0), x_B=(-1,0,0),
+ * v_B=(0,-0.5,0) and unit masses orbit their centre of mass, so that
+ * x_A(t) = (cos(t/2), sin(t/2), 0). The error is the distance of A from
+ * this solution at the final time. For each integrator the table lists the
+ * error and the number of force evaluations as the time step is halved, and
+ * the observed order of convergence. The last part compares the force
+ * evaluations each integrator needs to reach given accuracy targets.
+ */
+
+struct Run {
+  double error;
+  int    forceEvaluations;
+};
+
+Run run(NBodyEngine::Kernel kernel, NBodySimulation::Integrator integrator,
+        double tFinal, int steps) {
+  const double xx[] = { 1.0, -1.0 }, xy[] = { 0.0, 0.0 }, xz[] = { 0.0, 0.0 };
+  const double vx[] = { 0.0, 0.0 }, vy[] = { 0.5, -0.5 }, vz[] = { 0.0, 0.0 };
+  const double m[]  = { 1.0, 1.0 };
+
+  NBodyEngine engine(kernel);
+  engine.simulation().integrator = integrator;
+  engine.create(2, xx, xy, xz, vx, vy, vz, m, tFinal/steps);
+  engine.advance(steps);
+
+  NBodyEngine::State s = engine.state();
+  double dx = s.xx[0] - std::cos(tFinal/2);
+  double dy = s.xy[0] - std::sin(tFinal/2);
+  double dz = s.xz[0];
+
+  Run r = { std::sqrt(dx*dx + dy*dy + dz*dz), engine.simulation().forceEvaluations };
+  return r;
+}
+
+int main (int argc, char** argv) {
+  const double tFinal = argc > 1 ? std::stod(argv[1]) : 10.0;
+
+  const NBodySimulation::Integrator integrators[] = {
+    NBodySimulation::StoermerVerlet, NBodySimulation::Yoshida4, NBodySimulation::Hermite4
+  };
+  const char* names[] = { "verlet", "yoshida", "hermite" };
+  const double targets[] = { 1e-4, 1e-6, 1e-8 };
+  int needed[3][3];
+
+  std::cout << std::setprecision(3);
+
+  for (int k = 0; k < 3; ++k) {
+    std::cout << names[k] << std::endl
+              << "  dt          error       force evaluations   order" << std::endl;
+
+    for (int t = 0; t < 3; ++t) needed[k][t] = -1;
+
+    double previous = 0;
+    for (int steps = 10; steps <= 20480; steps *= 2) {
+      Run r = run(NBodyEngine::Vectorised, integrators[k], tFinal, steps);
+      std::cout << "  " << std::setw(10) << tFinal/steps
+                << "  " << std::setw(10) << r.error
+                << "  " << std::setw(18) << r.forceEvaluations;
+      if (previous > 0) std::cout << "  " << std::setw(6) << std::log2(previous/r.error);
+      std::cout << std::endl;
+      previous = r.error;
+
+      for (int t = 0; t < 3; ++t) {
+        if (needed[k][t] < 0 && r.error <= targets[t]) needed[k][t] = r.forceEvaluations;
+      }
+    }
+
+    // the kernels have to agree with each other
+    Run scalar   = run(NBodyEngine::Scalar,       integrators[k], tFinal, 640);
+    Run parallel = run(NBodyEngine::Parallelised, integrators[k], tFinal, 640);
+    Run vector   = run(NBodyEngine::Vectorised,   integrators[k], tFinal, 640);
+    std::cout << "  errors of scalar, vectorised and parallel kernels at dt="
+              << tFinal/640 << ": " << scalar.error << ", " << vector.error
+              << ", " << parallel.error << std::endl << std::endl;
+  }
+
+  std::cout << "force evaluations to reach the target error" << std::endl
+            << "  target      verlet      yoshida     hermite" << std::endl;
+  for (int t = 0; t < 3; ++t) {
+    std::cout << "  " << std::setw(10) << targets[t];
+    for (int k = 0; k < 3; ++k) {
+      std::cout << "  " << std::setw(10);
+      if (needed[k][t] < 0) std::cout << "-"; else std::cout << needed[k][t];
+    }
+    if (needed[0][t] > 0 && needed[1][t] > 0 && needed[2][t] > 0) {
+      std::cout << "   (" << double(needed[0][t])/needed[1][t] << "x, "
+                << double(needed[0][t])/needed[2][t] << "x fewer than verlet)";
+    }
+    std::cout << std::endl;
+  }
+
+  return 0;
+}
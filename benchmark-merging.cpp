@@ -0,0 +1,168 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <omp.h>
+
+#include "NBodyEngine.h"
+
+/**
+ * Cost of merging many bodies at once.
+ *
+ *   make benchmark-merging-gcc
+ *   ./benchmark-merging-gcc [bodies] [groups] [group-size]
+ *
+ * Bodies of mass 1/N are spread uniformly over the unit cube, and then
+ * groups of group-size bodies are moved to within a fraction of the merge
+ * radius C*(m_i+m_j) of each other, as in a dense collapse. The table lists
+ * the time of NBodySimulation::process_collisions() with one and with all
+ * threads, and of the former serial O(N^2) loop, which merged one pair at a
+ * time and filled the gap with the last body (skipped above 50,000 bodies).
+ */
+
+struct Bodies {
+  std::vector<double> xx, xy, xz, vx, vy, vz, m;
+};
+
+Bodies collapse(int n, int groups, int groupSize) {
+  std::mt19937_64 generator(7);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+  Bodies b;
+  for (int i = 0; i < n; ++i) {
+    b.xx.push_back(uniform(generator));
+    b.xy.push_back(uniform(generator));
+    b.xz.push_back(uniform(generator));
+    b.vx.push_back(uniform(generator) - 0.5);
+    b.vy.push_back(uniform(generator) - 0.5);
+    b.vz.push_back(uniform(generator) - 0.5);
+    b.m.push_back(1.0/n);
+  }
+
+  // every member within a tenth of the merge radius of the first one
+  const double radius = 1e-2/n * 2.0/n;
+  std::vector<int> order(n);
+  for (int i = 0; i < n; ++i) order[i] = i;
+  std::shuffle(order.begin(), order.end(), generator);
+  for (int g = 0; g < groups; ++g) {
+    const int host = order[g*groupSize];
+    for (int k = 1; k < groupSize; ++k) {
+      const int i = order[g*groupSize + k];
+      b.xx[i] = b.xx[host] + 0.1*radius*(uniform(generator) - 0.5);
+      b.xy[i] = b.xy[host] + 0.1*radius*(uniform(generator) - 0.5);
+      b.xz[i] = b.xz[host] + 0.1*radius*(uniform(generator) - 0.5);
+    }
+  }
+  return b;
+}
+
+/**
+ * The serial merge that process_collisions() replaced.
+ */
+int serialMerge(Bodies& b, double C) {
+  int n = b.m.size();
+  for (int i = 0; i < n; ++i) {
+    for (int j = i+1; j < n; ++j) {
+      double dx = b.xx[j]-b.xx[i], dy = b.xy[j]-b.xy[i], dz = b.xz[j]-b.xz[i];
+      if (std::sqrt(dx*dx + dy*dy + dz*dz) / (b.m[i] + b.m[j]) <= C) {
+        double Minv = 1.0/(b.m[i]+b.m[j]);
+        b.xx[i] = (b.m[i]*b.xx[i] + b.m[j]*b.xx[j])*Minv;
+        b.xy[i] = (b.m[i]*b.xy[i] + b.m[j]*b.xy[j])*Minv;
+        b.xz[i] = (b.m[i]*b.xz[i] + b.m[j]*b.xz[j])*Minv;
+        b.vx[i] = (b.m[i]*b.vx[i] + b.m[j]*b.vx[j])*Minv;
+        b.vy[i] = (b.m[i]*b.vy[i] + b.m[j]*b.vy[j])*Minv;
+        b.vz[i] = (b.m[i]*b.vz[i] + b.m[j]*b.vz[j])*Minv;
+        b.m[i] += b.m[j];
+        b.xx[j] = b.xx[n-1]; b.xy[j] = b.xy[n-1]; b.xz[j] = b.xz[n-1];
+        b.vx[j] = b.vx[n-1]; b.vy[j] = b.vy[n-1]; b.vz[j] = b.vz[n-1];
+        b.m[j]  = b.m[n-1];
+        n--;
+      }
+    }
+  }
+  return n;
+}
+
+struct Result {
+  double             seconds;
+  int                remaining;
+  unsigned long long hash;
+  double             mass, px;
+};
+
+Result parallelMerge(const Bodies& b, int threads) {
+  omp_set_num_threads(threads);
+  NBodyEngine engine(NBodyEngine::Parallelised);
+  engine.create(b.m.size(), b.xx.data(), b.xy.data(), b.xz.data(),
+                b.vx.data(), b.vy.data(), b.vz.data(), b.m.data(), 1e-5);
+  NBodySimulation& s = engine.simulation();
+
+  auto start = std::chrono::steady_clock::now();
+  s.process_collisions();
+  Result r;
+  r.seconds   = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  r.remaining = s.NumberOfBodies;
+
+  r.hash = 1469598103934665603ull;
+  r.mass = r.px = 0;
+  const double* fields[] = { s.xx, s.xy, s.xz, s.vx, s.vy, s.vz, s.m };
+  for (int f = 0; f < 7; ++f) {
+    for (int i = 0; i < s.NumberOfBodies; ++i) {
+      unsigned long long bits;
+      std::memcpy(&bits, fields[f]+i, sizeof(bits));
+      r.hash = (r.hash ^ bits) * 1099511628211ull;
+    }
+  }
+  for (int i = 0; i < s.NumberOfBodies; ++i) {
+    r.mass += s.m[i];
+    r.px   += s.m[i]*s.vx[i];
+  }
+  return r;
+}
+
+int main (int argc, char** argv) {
+  const int n         = argc > 1 ? std::stoi(argv[1]) : 20000;
+  const int groups    = argc > 2 ? std::stoi(argv[2]) : 2000;
+  const int groupSize = argc > 3 ? std::stoi(argv[3]) : 4;
+  if (groups*groupSize > n) {
+    std::cerr << "more group members than bodies" << std::endl;
+    return -2;
+  }
+
+  Bodies b = collapse(n, groups, groupSize);
+  double mass = 0, px = 0;
+  for (int i = 0; i < n; ++i) {
+    mass += b.m[i];
+    px   += b.m[i]*b.vx[i];
+  }
+
+  const int maxThreads = omp_get_max_threads();
+  Result one = parallelMerge(b, 1);
+  Result all = parallelMerge(b, maxThreads);
+
+  std::cout << std::setprecision(3)
+            << n << " bodies, " << groups << " groups of " << groupSize
+            << ", expected " << n - groups*(groupSize-1) << " remaining" << std::endl
+            << "parallel merge, 1 thread:   " << one.seconds << " s, "
+            << one.remaining << " remaining" << std::endl
+            << "parallel merge, " << maxThreads << " threads: " << all.seconds << " s, "
+            << all.remaining << " remaining, "
+            << (one.hash == all.hash ? "bitwise identical" : "DIFFERENT") << std::endl
+            << "mass error " << std::abs(all.mass - mass)
+            << ", momentum error " << std::abs(all.px - px) << std::endl;
+
+  if (n <= 50000) {
+    Bodies serial = b;
+    auto start = std::chrono::steady_clock::now();
+    int remaining = serialMerge(serial, 1e-2/n);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "serial merge:              " << seconds << " s, "
+              << remaining << " remaining" << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,97 @@
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "NBodyEngine.h"
+#include "NBodySimulationMolecularForces.cpp"
+
+/**
+ * Every operator new of the process is counted, to show the allocations per
+ * step of the grid maintenance.
+ */
+static std::atomic<long> allocations(0);
+
+void* operator new (size_t size) {
+  allocations++;
+  void* p = std::malloc(size > 0 ? size : 1);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete (void* p) noexcept {
+  std::free(p);
+}
+
+/**
+ * Time per step of the molecular forces model of step 2.
+ *
+ *   make benchmark-molecular-gcc
+ *   ./benchmark-molecular-gcc [bodies] [bodies-per-cell] [steps] [speed]
+ *
+ * Bodies are placed on a jittered lattice, so no two are much closer than
+ * the lattice spacing, in a cube sized for the given mean number of bodies
+ * per cell of CUTOFF_RADIUS. The rate counts the candidate pairs in the 27
+ * cells around every body, i.e. the work of the original per-body loop.
+ * The bodies start with the given speed in random directions, so that they
+ * cross cell boundaries. Besides the time, the benchmark reports the
+ * operator new calls, the bodies whose cell was computed and the bodies
+ * that changed cells per step. NBODY_MOLECULAR_FORCE selects the pair force as in
+ * step 2.
+ */
+int main (int argc, char** argv) {
+  const int    n            = argc > 1 ? std::stoi(argv[1]) : 20000;
+  const double bodiesPerCell = argc > 2 ? std::stod(argv[2]) : 20;
+  const int    steps        = argc > 3 ? std::stoi(argv[3]) : 5;
+  const double speed        = argc > 4 ? std::stod(argv[4]) : 0;
+
+  const double volume  = n / bodiesPerCell * CUTOFF_RADIUS*CUTOFF_RADIUS*CUTOFF_RADIUS;
+  const int    perSide = static_cast<int>(std::ceil(std::cbrt(static_cast<double>(n))));
+  const double spacing = std::cbrt(volume) / perSide;
+
+  std::mt19937_64 generator(11);
+  std::uniform_real_distribution<double> jitter(-0.2*spacing, 0.2*spacing);
+  std::normal_distribution<double> direction(0.0, 1.0);
+  std::vector<double> x, y, z, vx, vy, vz, m(n, 1.0);
+  for (int i = 0; i < n; ++i) {
+    x.push_back((i % perSide + 0.5)*spacing + jitter(generator));
+    y.push_back((i / perSide % perSide + 0.5)*spacing + jitter(generator));
+    z.push_back((i / perSide / perSide + 0.5)*spacing + jitter(generator));
+    double d[3] = { direction(generator), direction(generator), direction(generator) };
+    double scale = speed / std::sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+    vx.push_back(scale*d[0]);
+    vy.push_back(scale*d[1]);
+    vz.push_back(scale*d[2]);
+  }
+
+  NBodyEngine engine(NBodyEngine::MolecularForces);
+  engine.create(n, x.data(), y.data(), z.data(), vx.data(), vy.data(), vz.data(), m.data(), 1e-6);
+  engine.simulation().readEnvironmentOptions();
+  engine.advance(1);
+
+  const Grid& grid = static_cast<NBodySimulationMolecularForces&>(engine.simulation()).cellGrid();
+  const long checksBefore = grid.checks, migrationsBefore = grid.migrations;
+  const long allocationsBefore = allocations;
+  auto start = std::chrono::steady_clock::now();
+  engine.advance(steps);
+  const double seconds =
+    std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()/steps;
+  const double allocationsPerStep = static_cast<double>(allocations - allocationsBefore)/steps;
+
+  const NBodySimulation& s = engine.simulation();
+  std::cout << std::setprecision(4)
+            << n << " bodies, " << bodiesPerCell << " per cell: "
+            << seconds << " s per step, "
+            << 27*bodiesPerCell*n/seconds << " candidate pairs/s, "
+            << allocationsPerStep << " allocations per step, "
+            << static_cast<double>(grid.checks - checksBefore)/steps << " cell checks and "
+            << static_cast<double>(grid.migrations - migrationsBefore)/steps << " migrations per step, "
+            << "dx_min=" << s.minDx << ", first body " << s.xx[0] << " " << s.xy[0] << " " << s.xz[0]
+            << std::endl;
+  return 0;
+}
@@ -0,0 +1,133 @@
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <omp.h>
+
+#include "NBodyEngine.h"
+
+/**
+ * Cost of the reproducible-summation mode relative to the fast path, and a
+ * check that it is bitwise identical across kernels and thread counts.
+ *
+ *   make benchmark-reproducible-gcc
+ *   ./benchmark-reproducible-gcc [bodies] [steps]
+ *
+ * Bodies are uniformly distributed in a unit cube centred at the origin, as
+ * in the scaling tests of step 4. The check is repeated untimed with a tenth
+ * as many tracers in addition.
+ */
+
+struct Setup {
+  int n;
+  std::vector<double> xx, xy, xz, vx, vy, vz, m;
+
+  Setup(int bodies, int tracers = 0) :
+    n(bodies+tracers), xx(n), xy(n), xz(n), vx(n,0), vy(n,0), vz(n,0), m(n) {
+    std::mt19937_64 generator(42);
+    std::uniform_real_distribution<double> uniform(-0.5, 0.5);
+    for (int i = 0; i < n; ++i) {
+      xx[i] = uniform(generator);
+      xy[i] = uniform(generator);
+      xz[i] = uniform(generator);
+      m[i]  = i < bodies ? 1.0/bodies : 0.0;
+    }
+  }
+};
+
+struct Result {
+  double seconds;
+  std::vector<double> state;
+};
+
+Result run(const Setup& setup, NBodyEngine::Kernel kernel, bool reproducible,
+           int threads, int steps) {
+  omp_set_num_threads(threads);
+
+  NBodyEngine engine(kernel);
+  engine.simulation().reproducible = reproducible;
+  engine.create(setup.n, &setup.xx[0], &setup.xy[0], &setup.xz[0],
+                &setup.vx[0], &setup.vy[0], &setup.vz[0], &setup.m[0], 1e-3);
+
+  auto start = std::chrono::steady_clock::now();
+  engine.advance(steps);
+  auto stop = std::chrono::steady_clock::now();
+
+  NBodyEngine::State s = engine.state();
+  Result r;
+  r.seconds = std::chrono::duration<double>(stop - start).count();
+  r.state.insert(r.state.end(), s.xx, s.xx + s.numberOfBodies);
+  r.state.insert(r.state.end(), s.xy, s.xy + s.numberOfBodies);
+  r.state.insert(r.state.end(), s.xz, s.xz + s.numberOfBodies);
+  r.state.insert(r.state.end(), s.vx, s.vx + s.numberOfBodies);
+  r.state.insert(r.state.end(), s.vy, s.vy + s.numberOfBodies);
+  r.state.insert(r.state.end(), s.vz, s.vz + s.numberOfBodies);
+  r.state.insert(r.state.end(), s.txx, s.txx + s.numberOfTracers);
+  r.state.insert(r.state.end(), s.txy, s.txy + s.numberOfTracers);
+  r.state.insert(r.state.end(), s.txz, s.txz + s.numberOfTracers);
+  r.state.insert(r.state.end(), s.tvx, s.tvx + s.numberOfTracers);
+  r.state.insert(r.state.end(), s.tvy, s.tvy + s.numberOfTracers);
+  r.state.insert(r.state.end(), s.tvz, s.tvz + s.numberOfTracers);
+  return r;
+}
+
+bool bitwiseEqual(const Result& a, const Result& b) {
+  return a.state.size() == b.state.size() &&
+         std::memcmp(&a.state[0], &b.state[0], a.state.size()*sizeof(double)) == 0;
+}
+
+int main (int argc, char** argv) {
+  int n     = argc > 1 ? std::stoi(argv[1]) : 2000;
+  int steps = argc > 2 ? std::stoi(argv[2]) : 10;
+  int maxThreads = omp_get_max_threads();
+
+  Setup setup(n);
+  std::cout << std::setprecision(4)
+            << n << " bodies, " << steps << " steps, up to "
+            << maxThreads << " threads" << std::endl;
+
+  Result reference = run(setup, NBodyEngine::Scalar, true, 1, steps);
+
+  const char* names[] = { "step-1", "", "step-3", "step-4" };
+  NBodyEngine::Kernel kernels[] = {
+    NBodyEngine::Scalar, NBodyEngine::Vectorised, NBodyEngine::Parallelised
+  };
+
+  bool identical = true;
+  for (NBodyEngine::Kernel kernel : kernels) {
+    int threads = kernel == NBodyEngine::Parallelised ? maxThreads : 1;
+    Result fast = run(setup, kernel, false, threads, steps);
+    Result repr = run(setup, kernel, true, threads, steps);
+    bool same = bitwiseEqual(repr, reference);
+    identical = identical && same;
+
+    std::cout << names[kernel]
+              << ":\t fast=" << fast.seconds << "s"
+              << ",\t reproducible=" << repr.seconds << "s"
+              << ",\t cost=" << repr.seconds/fast.seconds << "x"
+              << ",\t identical to step-1: " << (same ? "yes" : "no")
+              << std::endl;
+  }
+
+  for (int threads = 1; threads <= std::max(4, maxThreads); ++threads) {
+    bool same = bitwiseEqual(run(setup, NBodyEngine::Parallelised, true, threads, steps), reference);
+    identical = identical && same;
+    std::cout << "step-4 with " << threads << " threads identical to step-1: "
+              << (same ? "yes" : "no") << std::endl;
+  }
+
+  Setup tracers(n, n/10);
+  Result tracerReference = run(tracers, NBodyEngine::Scalar, true, 1, steps);
+  for (NBodyEngine::Kernel kernel : kernels) {
+    int threads = kernel == NBodyEngine::Parallelised ? maxThreads : 1;
+    bool same = bitwiseEqual(run(tracers, kernel, true, threads, steps), tracerReference);
+    identical = identical && same;
+    std::cout << names[kernel] << " with " << n/10 << " tracers identical to step-1: "
+              << (same ? "yes" : "no") << std::endl;
+  }
+
+  return identical ? 0 : 1;
+}
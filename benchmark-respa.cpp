@@ -0,0 +1,135 @@
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "NBodyEngine.h"
+#include "NBodySimulationRespa.cpp"
+
+/**
+ * Energy drift versus speed of the multiple time stepping integrator.
+ *
+ *   make benchmark-respa-gcc
+ *   ./benchmark-respa-gcc [bodies] [steps] [split-radius]
+ *
+ * A clumpy cluster: the bodies are spread over twenty Gaussian clumps of
+ * radius 0.05 inside the unit sphere, each clump with a small random bulk
+ * velocity and an internal velocity dispersion of 0.25, and all bodies have
+ * mass 1/N. Every run uses the same inner
+ * time step. The table compares Stoermer-Verlet with the all-pairs kernel of
+ * step 3, Verlet with a k times larger step, and RESPA with k = 2, 4, 8. It
+ * lists the wall time, the pair interactions per step and the relative
+ * energy drift between the end of the first block of eight steps and the
+ * end of the run.
+ */
+
+struct Bodies {
+  std::vector<double> xx, xy, xz, vx, vy, vz, m;
+};
+
+Bodies clumpyCluster(int n) {
+  std::mt19937_64 generator(2024);
+  std::normal_distribution<double> gauss(0.0, 1.0);
+  std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+
+  const int clumps = 20;
+  std::vector<double> cx(clumps), cy(clumps), cz(clumps), cvx(clumps), cvy(clumps), cvz(clumps);
+  for (int c = 0; c < clumps; ++c) {
+    do {
+      cx[c] = uniform(generator); cy[c] = uniform(generator); cz[c] = uniform(generator);
+    } while (cx[c]*cx[c] + cy[c]*cy[c] + cz[c]*cz[c] > 1.0);
+    cvx[c] = 0.1*uniform(generator); cvy[c] = 0.1*uniform(generator); cvz[c] = 0.1*uniform(generator);
+  }
+
+  Bodies b;
+  for (int i = 0; i < n; ++i) {
+    int c = i % clumps;
+    b.xx.push_back(cx[c] + 0.05*gauss(generator));
+    b.xy.push_back(cy[c] + 0.05*gauss(generator));
+    b.xz.push_back(cz[c] + 0.05*gauss(generator));
+    b.vx.push_back(cvx[c] + 0.25*gauss(generator));
+    b.vy.push_back(cvy[c] + 0.25*gauss(generator));
+    b.vz.push_back(cvz[c] + 0.25*gauss(generator));
+    b.m.push_back(1.0/n);
+  }
+  return b;
+}
+
+double totalEnergy(NBodyEngine& engine) {
+  return engine.simulation().kineticEnergy + engine.simulation().potentialEnergy;
+}
+
+/**
+ * Runs the given number of inner steps of size dt and prints one row.
+ * k is the RESPA interval, or the step multiplier of Verlet if respa is
+ * false.
+ */
+void run(const Bodies& b, const char* name, bool respa, int k,
+         double dt, int steps, double splitRadius) {
+  const int n = b.m.size();
+  NBodyEngine engine(respa ? NBodyEngine::Respa : NBodyEngine::Vectorised);
+  if (respa) {
+    NBodySimulationRespa& r = dynamic_cast<NBodySimulationRespa&>(engine.simulation());
+    r.splitRadius       = splitRadius;
+    r.longRangeInterval = k;
+  }
+  const double step = respa ? dt : k*dt;
+  const int    nSteps = respa ? steps : steps/k;
+  engine.create(n, b.xx.data(), b.xy.data(), b.xz.data(),
+                b.vx.data(), b.vy.data(), b.vz.data(), b.m.data(), step);
+
+  // reference after the first block, so that every run starts from a state
+  // with consistent diagnostics
+  engine.advance(respa ? 8 : 8/k);
+  const double e0 = totalEnergy(engine);
+  const int n0 = engine.simulation().NumberOfBodies;
+
+  auto start = std::chrono::steady_clock::now();
+  engine.advance(nSteps - (respa ? 8 : 8/k));
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  double pairs;
+  if (respa) {
+    NBodySimulationRespa& r = dynamic_cast<NBodySimulationRespa&>(engine.simulation());
+    pairs = double(r.longRangeEvaluations)*n*(n-1)/2/steps;
+  }
+  else {
+    pairs = double(n)*(n-1)/2/k;
+  }
+
+  std::cout << "  " << std::setw(12) << std::left << name << std::right
+            << "  " << std::setw(8) << k
+            << "  " << std::setw(10) << seconds
+            << "  " << std::setw(14) << pairs
+            << "  " << std::setw(12) << std::abs((totalEnergy(engine) - e0)/e0);
+  if (engine.simulation().NumberOfBodies != n0) {
+    std::cout << "  (" << n0 - engine.simulation().NumberOfBodies << " merges)";
+  }
+  std::cout << std::endl;
+}
+
+int main (int argc, char** argv) {
+  const int    n           = argc > 1 ? std::stoi(argv[1]) : 2000;
+  const int    steps       = argc > 2 ? std::stoi(argv[2]) : 400;
+  const double splitRadius = argc > 3 ? std::stod(argv[3]) : 0.1;
+  const double dt          = 1e-4;
+
+  Bodies b = clumpyCluster(n);
+
+  std::cout << std::setprecision(3)
+            << n << " bodies, " << steps << " steps of " << dt
+            << ", split radius " << splitRadius << std::endl
+            << "  integrator    k         time [s]    pairs/step      energy drift" << std::endl;
+
+  run(b, "verlet",     false, 1, dt, steps, splitRadius);
+  run(b, "verlet k*dt", false, 2, dt, steps, splitRadius);
+  run(b, "verlet k*dt", false, 4, dt, steps, splitRadius);
+  run(b, "verlet k*dt", false, 8, dt, steps, splitRadius);
+  run(b, "respa",      true,  2, dt, steps, splitRadius);
+  run(b, "respa",      true,  4, dt, steps, splitRadius);
+  run(b, "respa",      true,  8, dt, steps, splitRadius);
+
+  return 0;
+}
@@ -0,0 +1,126 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+#include "NBodyEngine.h"
+
+/**
+ * Cost of the reduced ParaView snapshots, see NBodySnapshotFilter.h.
+ *
+ *   make benchmark-snapshot-gcc
+ *   ./benchmark-snapshot-gcc [bodies] [density-cells]
+ *
+ * A Plummer sphere is written once per configuration into paraview-output:
+ * all bodies, every tenth body, a mass-weighted sample of 10,000 bodies, the
+ * bodies in the central box [-0.5,0.5]^3, and the sample together with the
+ * density grid. The table lists the time to select the bodies, the time of
+ * the whole snapshot, the bodies written and the size of the files.
+ *
+ * Finally, a sample of 1,000 bodies of the uniform scenario with the same
+ * seed has to cover the cube: every tenth of every axis has to receive
+ * about a tenth of the sample. The benchmark fails otherwise.
+ */
+
+namespace {
+  double seconds (std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  long fileSize (const std::string& fileName) {
+    struct stat s;
+    return stat(fileName.c_str(), &s) == 0 ? s.st_size : 0;
+  }
+
+  /**
+   * Number of points in a .vtp snapshot.
+   */
+  long pointsIn (const std::string& fileName) {
+    std::ifstream in(fileName.c_str());
+    std::string line;
+    const std::string key = "NumberOfPoints=\"";
+    while (std::getline(in, line)) {
+      const size_t found = line.find(key);
+      if (found != std::string::npos) return std::stol(line.substr(found + key.size()));
+    }
+    return 0;
+  }
+}
+
+int main (int argc, char** argv) {
+  const int n             = argc > 1 ? std::stoi(argv[1]) : 1000000;
+  const int densityCells  = argc > 2 ? std::stoi(argv[2]) : 64;
+
+  NBodyEngine engine(NBodyEngine::Vectorised);
+  engine.createScenario("plummer", n, 7, 1e-4);
+  NBodySimulation& s = engine.simulation();
+  s.openParaviewVideoFile();
+
+  const char* names[] = { "all bodies", "stride 10", "sample 10000", "region", "sample + density" };
+  std::cout << std::setw(18) << "snapshot" << std::setw(12) << "select [s]"
+            << std::setw(12) << "write [s]" << std::setw(12) << "bodies"
+            << std::setw(14) << "bytes" << std::endl;
+
+  for (int c = 0; c < 5; ++c) {
+    NBodySnapshotFilter& f = s.snapshotFilter;
+    f = NBodySnapshotFilter();
+    if (c == 1) f.stride = 10;
+    if (c == 2 || c == 4) f.sample = 10000;
+    if (c == 3) {
+      f.region = true;
+      for (int d = 0; d < 3; ++d) {
+        f.regionMin[d] = -0.5;
+        f.regionMax[d] =  0.5;
+      }
+    }
+    if (c == 4) f.densityCells = densityCells;
+
+    std::vector<int> bodies, tracers;
+    auto start = std::chrono::steady_clock::now();
+    f.select(s, f.fullResolution(s.t), bodies, tracers);
+    const double selectSeconds = seconds(start);
+
+    start = std::chrono::steady_clock::now();
+    s.printParaviewSnapshot();
+    const double writeSeconds = seconds(start);
+
+    std::stringstream vtp, vti;
+    vtp << "paraview-output/result-" << c << ".vtp";
+    vti << "paraview-output/density-" << c << ".vti";
+    std::cout << std::setw(18) << names[c] << std::setprecision(3)
+              << std::setw(12) << selectSeconds << std::setw(12) << writeSeconds
+              << std::setw(12) << pointsIn(vtp.str())
+              << std::setw(14) << fileSize(vtp.str()) + fileSize(vti.str()) << std::endl;
+  }
+
+  s.closeParaviewVideoFile();
+
+  // the sample must not reuse the random numbers that placed the bodies
+  NBodyEngine cube(NBodyEngine::Vectorised);
+  cube.createScenario("uniform", 20000, 1, 1e-4);
+  NBodySnapshotFilter sampler;
+  sampler.sample = 1000;
+  std::vector<int> bodies, tracers;
+  sampler.select(cube.simulation(), false, bodies, tracers);
+
+  const NBodySimulation& c = cube.simulation();
+  const double* axes[] = { c.xx, c.xy, c.xz };
+  int fewest = bodies.size();
+  for (int d = 0; d < 3; ++d) {
+    std::vector<int> slabs(10, 0);
+    for (size_t k = 0; k < bodies.size(); ++k) {
+      slabs[std::min(9, static_cast<int>((axes[d][bodies[k]] + 0.5)*10))]++;
+    }
+    for (int slab = 0; slab < 10; ++slab) fewest = std::min(fewest, slabs[slab]);
+  }
+  // about 100 expected per slab, with a standard deviation of 9.5
+  const bool covers = bodies.size() > 800 && fewest >= 50;
+  std::cout << "sample of " << bodies.size() << " of a uniform cube, fewest per tenth of an axis "
+            << fewest << ": " << (covers ? "covers the cube" : "DOES NOT COVER THE CUBE") << std::endl;
+  return covers ? 0 : 1;
+}
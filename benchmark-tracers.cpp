@@ -0,0 +1,96 @@
+#include <chrono>
+#include <iomanip>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "NBodyEngine.h"
+
+/**
+ * Cost of tracers compared to treating every body as a source.
+ *
+ *   make benchmark-tracers-gcc
+ *   ./benchmark-tracers-gcc [massive-bodies] [tracers] [steps]
+ *
+ * The massive bodies, with a total mass of 1, and the tracers are spread
+ * uniformly over the unit cube. For every kernel the table lists the time
+ * per step with the tracers as a separate species (an M x T pass on top of
+ * the M^2/2 pairs of the massive bodies), and with the tracers given a
+ * negligible mass of 1e-12 instead, so that all M+T bodies are sources. The
+ * last column is the rate of tracer interactions of the M x T pass alone.
+ */
+
+struct Bodies {
+  std::vector<double> xx, xy, xz, vx, vy, vz, m;
+};
+
+Bodies uniformCube(int massive, int tracers, double tracerMass) {
+  std::mt19937_64 generator(2024);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+  Bodies b;
+  for (int i = 0; i < massive + tracers; ++i) {
+    b.xx.push_back(uniform(generator));
+    b.xy.push_back(uniform(generator));
+    b.xz.push_back(uniform(generator));
+    b.vx.push_back(0);
+    b.vy.push_back(0);
+    b.vz.push_back(0);
+    b.m.push_back(i < massive ? 1.0/massive : tracerMass);
+  }
+  return b;
+}
+
+double secondsPerStep(NBodyEngine::Kernel kernel, const Bodies& b, int steps) {
+  NBodyEngine engine(kernel);
+  engine.create(b.m.size(), b.xx.data(), b.xy.data(), b.xz.data(),
+                b.vx.data(), b.vy.data(), b.vz.data(), b.m.data(), 1e-5);
+  // the first step evaluates the initial forces as well
+  engine.advance(1);
+
+  auto start = std::chrono::steady_clock::now();
+  engine.advance(steps);
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()/steps;
+}
+
+double tracerPassSeconds(NBodyEngine::Kernel kernel, const Bodies& b, int steps) {
+  NBodyEngine engine(kernel);
+  engine.create(b.m.size(), b.xx.data(), b.xy.data(), b.xz.data(),
+                b.vx.data(), b.vy.data(), b.vz.data(), b.m.data(), 1e-5);
+
+  auto start = std::chrono::steady_clock::now();
+  for (int step = 0; step < steps; ++step) engine.simulation().process_tracers();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()/steps;
+}
+
+int main (int argc, char** argv) {
+  const int massive = argc > 1 ? std::stoi(argv[1]) : 2000;
+  const int tracers = argc > 2 ? std::stoi(argv[2]) : 50000;
+  const int steps   = argc > 3 ? std::stoi(argv[3]) : 5;
+
+  const Bodies withTracers = uniformCube(massive, tracers, 0.0);
+  const Bodies allSources  = uniformCube(massive, tracers, 1e-12);
+
+  const NBodyEngine::Kernel kernels[] = {
+    NBodyEngine::Scalar, NBodyEngine::Vectorised, NBodyEngine::Parallelised
+  };
+  const char* names[] = { "scalar", "vectorised", "parallel" };
+
+  std::cout << std::setprecision(3)
+            << massive << " massive bodies, " << tracers << " tracers" << std::endl
+            << "  kernel        tracers [s/step]   all sources [s/step]   speedup   tracer interactions/s" << std::endl;
+
+  for (int k = 0; k < 3; ++k) {
+    double t = secondsPerStep(kernels[k], withTracers, steps);
+    double a = secondsPerStep(kernels[k], allSources, 1);
+    double p = tracerPassSeconds(kernels[k], withTracers, steps);
+
+    std::cout << "  " << std::setw(10) << std::left << names[k] << std::right
+              << "  " << std::setw(16) << t
+              << "  " << std::setw(21) << a
+              << "  " << std::setw(8) << a/t
+              << "  " << std::setw(22) << double(massive)*tracers/p << std::endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,150 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <random>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+#include "NBodyEngine.h"
+#include "NBodyTrajectory.h"
+
+/**
+ * Output cost of the .vtp snapshots against the trajectory file.
+ *
+ *   make benchmark-trajectory-gcc
+ *   ./benchmark-trajectory-gcc [bodies] [frames] [steps-per-frame]
+ *
+ * A Plummer-like cluster is run with the vectorised kernel, and after every
+ * few steps the state is written as a .vtp snapshot (into paraview-output),
+ * as a float64 trajectory and as a float32 trajectory. Only the output is
+ * timed. Then random frames are read back, and the position error of the
+ * float32 trajectory is compared to rounding the positions to float32.
+ * Reading past the last frame has to throw NBodyError and leave the reader
+ * usable; the benchmark fails otherwise.
+ */
+
+namespace {
+  double seconds (std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  long fileSize (const std::string& fileName) {
+    struct stat s;
+    return stat(fileName.c_str(), &s) == 0 ? s.st_size : 0;
+  }
+}
+
+int main (int argc, char** argv) {
+  const int n              = argc > 1 ? std::stoi(argv[1]) : 2000;
+  const int frames         = argc > 2 ? std::stoi(argv[2]) : 200;
+  const int stepsPerFrame  = argc > 3 ? std::stoi(argv[3]) : 1;
+
+  std::mt19937_64 generator(7);
+  std::normal_distribution<double> normal(0.0, 1.0);
+  std::vector<double> x(n), y(n), z(n), vx(n), vy(n), vz(n), m(n, 1.0/n);
+  for (int i = 0; i < n; ++i) {
+    x[i]  = 0.3*normal(generator);  y[i]  = 0.3*normal(generator);  z[i]  = 0.3*normal(generator);
+    vx[i] = 0.5*normal(generator);  vy[i] = 0.5*normal(generator);  vz[i] = 0.5*normal(generator);
+  }
+
+  NBodyEngine engine(NBodyEngine::Vectorised);
+  engine.create(n, x.data(), y.data(), z.data(), vx.data(), vy.data(), vz.data(), m.data(), 1e-4);
+  NBodySimulation& s = engine.simulation();
+
+  double vtpSeconds = 0, float64Seconds = 0, float32Seconds = 0;
+  long   vtpBytes = 0;
+  {
+    NBodyTrajectoryWriter float64("benchmark-trajectory-float64.nbt", NBodyTrajectory::Float64);
+    NBodyTrajectoryWriter float32("benchmark-trajectory-float32.nbt", NBodyTrajectory::Float32);
+    s.openParaviewVideoFile();
+    for (int frame = 0; frame < frames; ++frame) {
+      auto start = std::chrono::steady_clock::now();
+      s.printParaviewSnapshot();
+      vtpSeconds += seconds(start);
+      std::stringstream name;
+      name << "paraview-output/result-" << frame << ".vtp";
+      vtpBytes += fileSize(name.str());
+
+      start = std::chrono::steady_clock::now();
+      float64.append(s);
+      float64Seconds += seconds(start);
+
+      start = std::chrono::steady_clock::now();
+      float32.append(s);
+      float32Seconds += seconds(start);
+
+      engine.advance(stepsPerFrame);
+    }
+    auto start = std::chrono::steady_clock::now();
+    float64.close();
+    float64Seconds += seconds(start);
+    start = std::chrono::steady_clock::now();
+    float32.close();
+    float32Seconds += seconds(start);
+    s.closeParaviewVideoFile();
+  }
+
+  NBodyTrajectoryReader float64("benchmark-trajectory-float64.nbt");
+  NBodyTrajectoryReader float32("benchmark-trajectory-float32.nbt");
+
+  // random access, and the errors of all frames read in order
+  std::uniform_int_distribution<int> anyFrame(0, frames-1);
+  NBodyTrajectory::Frame exact, quantised;
+  double randomFloat64 = 0, randomFloat32 = 0;
+  const int reads = 100;
+  for (int k = 0; k < reads; ++k) {
+    const int frame = anyFrame(generator);
+    auto start = std::chrono::steady_clock::now();
+    float64.read(frame, exact);
+    randomFloat64 += seconds(start);
+    start = std::chrono::steady_clock::now();
+    float32.read(frame, quantised);
+    randomFloat32 += seconds(start);
+  }
+
+  double deltaError = 0, roundingError = 0;
+  for (int frame = 0; frame < frames; ++frame) {
+    float64.read(frame, exact);
+    float32.read(frame, quantised);
+    for (size_t i = 0; i < exact.x.size(); ++i) {
+      deltaError    = std::max(deltaError, std::abs(quantised.x[i] - exact.x[i]));
+      roundingError = std::max(roundingError,
+                               std::abs(static_cast<double>(static_cast<float>(exact.x[i])) - exact.x[i]));
+    }
+  }
+
+  std::cout << std::setprecision(3)
+            << n << " bodies, " << frames << " frames" << std::endl
+            << "  format            files   size [MB]   write [ms/frame]   random read [ms/frame]" << std::endl
+            << "  vtp (ascii)  " << std::setw(10) << frames+1
+            << "  " << std::setw(10) << vtpBytes/1e6
+            << "  " << std::setw(17) << 1e3*vtpSeconds/frames
+            << "  " << std::setw(23) << "-" << std::endl
+            << "  float64      " << std::setw(10) << 1
+            << "  " << std::setw(10) << fileSize("benchmark-trajectory-float64.nbt")/1e6
+            << "  " << std::setw(17) << 1e3*float64Seconds/frames
+            << "  " << std::setw(23) << 1e3*randomFloat64/reads << std::endl
+            << "  float32      " << std::setw(10) << 1
+            << "  " << std::setw(10) << fileSize("benchmark-trajectory-float32.nbt")/1e6
+            << "  " << std::setw(17) << 1e3*float32Seconds/frames
+            << "  " << std::setw(23) << 1e3*randomFloat32/reads << std::endl
+            << "  maximum position error of float32: " << deltaError
+            << " (rounding to float32: " << roundingError << ")" << std::endl;
+
+  bool reported = false;
+  try {
+    float64.read(frames, exact);
+  }
+  catch (const NBodyError&) {
+    reported = true;
+  }
+  float64.read(frames-1, exact);
+  std::cout << "  reading frame " << frames << ": "
+            << (reported ? "reported as an error" : "NOT REPORTED") << std::endl;
+
+  std::remove("benchmark-trajectory-float64.nbt");
+  std::remove("benchmark-trajectory-float32.nbt");
+  return reported ? 0 : 1;
+}
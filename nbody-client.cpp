@@ -0,0 +1,183 @@
+#include <cctype>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "NBodyScenario.h"
+#include "NBodyServer.h"
+
+/**
+ * Client of nbody-server-gcc.
+ *
+ *   make nbody-client-gcc
+ *   ./nbody-client-gcc [options] plot-time final-time dt x y z vx vy vz m ...
+ *   ./nbody-client-gcc [options] plot-time final-time dt scenario bodies [seed]
+ *   ./nbody-client-gcc [--socket path] --shutdown
+ *
+ * The setup is given as for the step-N executables, as bodies or as a
+ * built-in scenario that the client generates (the plot time is
+ * ignored, as the server writes no output), and the integrator and
+ * reproducible summation are taken from NBODY_INTEGRATOR and
+ * NBODY_REPRODUCIBLE as there. The client prints what the step-N
+ * executables print at the end of a run, followed by the energy and the
+ * timings.
+ *
+ *   --socket path   server socket, default NBODY_SOCKET or /tmp/nbody.sock
+ *   --kernel name   scalar, vectorised (default) or parallel
+ *   --repeat K      submit the job K times, one connection each
+ *   --concurrent    submit the K jobs at once instead of one after another
+ */
+
+namespace {
+  void usage () {
+    std::cerr << "usage: nbody-client-gcc [--socket path] [--kernel scalar|vectorised|parallel]"
+                 " [--repeat K] [--concurrent] plot-time final-time dt x y z vx vy vz m ..." << std::endl
+              << "       nbody-client-gcc [options] plot-time final-time dt scenario bodies [seed]" << std::endl
+              << "       nbody-client-gcc [--socket path] --shutdown" << std::endl;
+  }
+
+  bool submit (const std::string& socketPath, const NBodyJob& job, NBodyJobResult& result) {
+    int s = connectToServer(socketPath);
+    if (s < 0) return false;
+    bool ok = sendJob(s, job) && receiveResult(s, result);
+    close(s);
+    return ok;
+  }
+}
+
+int main (int argc, char** argv) {
+  std::string socketPath = defaultSocketPath();
+  NBodyEngine::Kernel kernel = NBodyEngine::Vectorised;
+  int  repeat     = 1;
+  bool concurrent = false;
+  bool stop       = false;
+
+  int a = 1;
+  for ( ; a < argc && std::strncmp(argv[a], "--", 2) == 0; ++a) {
+    std::string option(argv[a]);
+    if (option == "--socket" && a+1 < argc)      socketPath = argv[++a];
+    else if (option == "--repeat" && a+1 < argc) repeat = std::max(1, std::stoi(argv[++a]));
+    else if (option == "--concurrent")           concurrent = true;
+    else if (option == "--shutdown")             stop = true;
+    else if (option == "--kernel" && a+1 < argc) {
+      std::string name(argv[++a]);
+      if (name == "scalar")          kernel = NBodyEngine::Scalar;
+      else if (name == "vectorised") kernel = NBodyEngine::Vectorised;
+      else if (name == "parallel")   kernel = NBodyEngine::Parallelised;
+      else {
+        usage();
+        return -2;
+      }
+    }
+    else {
+      usage();
+      return -2;
+    }
+  }
+
+  NBodyJob job;
+  std::memset(&job.header, 0, sizeof(job.header));
+  job.header.magic = NBodyProtocol::JobMagic;
+
+  if (stop) {
+    job.header.command = NBodyProtocol::Shutdown;
+    NBodyJobResult result;
+    if (!submit(socketPath, job, result)) {
+      std::cerr << "no server on " << socketPath << std::endl;
+      return -2;
+    }
+    return 0;
+  }
+
+  const int  values   = argc - a;
+  const bool scenario = (values == 5 || values == 6) && std::isalpha(argv[a+3][0]);
+  if (!scenario && (values < 3+7 || (values-3) % 7 != 0)) {
+    usage();
+    return -2;
+  }
+
+  // parsed exactly as by NBodySimulation::setUp()
+  NBodySimulation options;
+  options.readEnvironmentOptions();
+
+  job.header.command        = NBodyProtocol::Run;
+  job.header.kernel         = kernel;
+  job.header.integrator     = options.integrator;
+  job.header.reproducible   = options.reproducible;
+  job.header.numberOfBodies = (values-3) / 7;
+  job.header.finalTime      = std::stof(argv[a+1]);
+  job.header.timeStepSize   = std::stof(argv[a+2]);
+  if (scenario) {
+    NBodyScenario::generate(options, argv[a+3], std::stoi(argv[a+4]),
+                            values > 5 ? std::stoull(argv[a+5]) : 1);
+    job.header.numberOfBodies = options.NumberOfBodies;
+    job.xx.assign(options.xx, options.xx + options.NumberOfBodies);
+    job.xy.assign(options.xy, options.xy + options.NumberOfBodies);
+    job.xz.assign(options.xz, options.xz + options.NumberOfBodies);
+    job.vx.assign(options.vx, options.vx + options.NumberOfBodies);
+    job.vy.assign(options.vy, options.vy + options.NumberOfBodies);
+    job.vz.assign(options.vz, options.vz + options.NumberOfBodies);
+    job.m.assign (options.m,  options.m  + options.NumberOfBodies);
+  }
+  for (int i = a+3; !scenario && i < argc; i += 7) {
+    job.xx.push_back(std::stof(argv[i  ]));
+    job.xy.push_back(std::stof(argv[i+1]));
+    job.xz.push_back(std::stof(argv[i+2]));
+    job.vx.push_back(std::stof(argv[i+3]));
+    job.vy.push_back(std::stof(argv[i+4]));
+    job.vz.push_back(std::stof(argv[i+5]));
+    job.m.push_back (std::stof(argv[i+6]));
+  }
+
+  std::vector<NBodyJobResult> results(repeat);
+  std::vector<char>           ok(repeat, 0);
+
+  auto start = std::chrono::steady_clock::now();
+  if (concurrent) {
+    std::vector<std::thread> threads;
+    for (int k = 0; k < repeat; ++k) {
+      threads.push_back(std::thread([&, k]() { ok[k] = submit(socketPath, job, results[k]); }));
+    }
+    for (int k = 0; k < repeat; ++k) threads[k].join();
+  }
+  else {
+    for (int k = 0; k < repeat; ++k) ok[k] = submit(socketPath, job, results[k]);
+  }
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  double serverSeconds = 0;
+  for (int k = 0; k < repeat; ++k) {
+    if (!ok[k]) {
+      std::cerr << "no answer from server on " << socketPath << std::endl;
+      return -2;
+    }
+    if (results[k].header.status != 0) {
+      std::cerr << "job rejected: " << results[k].message << std::endl;
+      return -2;
+    }
+    serverSeconds += results[k].header.seconds;
+  }
+
+  const NBodyJobResult& r = results[0];
+  std::cout << std::setprecision(15)
+            << "Number of remaining objects: " << r.header.numberOfBodies << std::endl;
+  if (r.header.numberOfTracers > 0) {
+    std::cout << "Number of tracers: " << r.header.numberOfTracers << std::endl;
+  }
+  std::cout << "Position of first remaining object: "
+            << r.xx[0] << ", " << r.xy[0] << ", " << r.xz[0] << std::endl
+            << "Time steps: " << r.header.timeSteps << ", t=" << r.header.t << std::endl
+            << "Energy: " << r.header.kineticEnergy + r.header.potentialEnergy << std::endl
+            << std::setprecision(4)
+            << repeat << " jobs in " << seconds << " s, "
+            << seconds/repeat << " s per job, "
+            << serverSeconds/repeat << " s of which simulation" << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,85 @@
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include "NBodySimulation.h"
+#include "NBodyTrajectory.h"
+
+/**
+ * Converter of trajectory files (see NBodyTrajectory.h) to the ParaView
+ * output of the step-N executables.
+ *
+ *   make nbody-convert-gcc
+ *   ./nbody-convert-gcc trajectory [first-frame [last-frame]]
+ *   ./nbody-convert-gcc --list trajectory
+ *
+ * The frames are written as paraview-output/result-k.vtp with the
+ * collection paraview-output/result.pvd, exactly as the step-N executables
+ * write them without NBODY_TRAJECTORY. --list prints the frame index.
+ */
+int main (int argc, char** argv) {
+  const bool list = argc > 1 && std::strcmp(argv[1], "--list") == 0;
+  if (argc < 2+list) {
+    std::cerr << "usage: " << argv[0] << " trajectory [first-frame [last-frame]]" << std::endl
+              << "       " << argv[0] << " --list trajectory" << std::endl;
+    return -2;
+  }
+
+  try {
+    NBodyTrajectoryReader trajectory(argv[1+list]);
+    if (trajectory.recovered()) {
+      std::cerr << "warning: " << argv[1+list] << " has no index, "
+                << trajectory.numberOfFrames() << " complete frames recovered" << std::endl;
+    }
+
+    if (list) {
+      std::cout << std::setprecision(15)
+                << "# frame time_step t N tracers key_frame" << std::endl;
+      for (int k = 0; k < trajectory.numberOfFrames(); ++k) {
+        const NBodyTrajectory::IndexEntry& e = trajectory.entry(k);
+        std::cout << k << " " << e.timeStep << " " << e.t << " " << e.numberOfBodies
+                  << " " << e.numberOfTracers << " " << e.keyFrame << std::endl;
+      }
+      return 0;
+    }
+
+    const int first = argc > 2 ? std::stoi(argv[2]) : 0;
+    const int last  = argc > 3 ? std::stoi(argv[3]) : trajectory.numberOfFrames()-1;
+
+    NBodySimulation simulation;
+    NBodyTrajectory::Frame frame;
+    simulation.openParaviewVideoFile();
+    for (int k = first; k <= last; ++k) {
+      trajectory.read(k, frame);
+
+      const int n = frame.numberOfBodies;
+      simulation.allocateBodies(n);
+      simulation.allocateTracers(frame.numberOfTracers);
+      simulation.t               = frame.t;
+      simulation.timeStepCounter = frame.timeStep;
+      std::copy(frame.x.begin(),  frame.x.begin()+n,  simulation.xx);
+      std::copy(frame.y.begin(),  frame.y.begin()+n,  simulation.xy);
+      std::copy(frame.z.begin(),  frame.z.begin()+n,  simulation.xz);
+      std::copy(frame.vx.begin(), frame.vx.begin()+n, simulation.vx);
+      std::copy(frame.vy.begin(), frame.vy.begin()+n, simulation.vy);
+      std::copy(frame.vz.begin(), frame.vz.begin()+n, simulation.vz);
+      std::copy(frame.m.begin(),  frame.m.begin()+n,  simulation.m);
+      std::copy(frame.x.begin()+n, frame.x.end(), simulation.txx);
+      std::copy(frame.y.begin()+n, frame.y.end(), simulation.txy);
+      std::copy(frame.z.begin()+n, frame.z.end(), simulation.txz);
+
+      simulation.printParaviewSnapshot();
+    }
+    simulation.closeParaviewVideoFile();
+
+    std::cout << "converted frames " << first << " to " << last << " of "
+              << trajectory.numberOfFrames() << " to paraview-output/result.pvd" << std::endl;
+    return 0;
+  }
+  catch (const NBodyError& error) {
+    std::cerr << error.what() << std::endl;
+    return -2;
+  }
+}
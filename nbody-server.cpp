@@ -0,0 +1,22 @@
+#include <iostream>
+#include <string>
+
+#include "NBodyServer.h"
+
+/**
+ * Simulation server for many short runs, see NBodyServer.h.
+ *
+ *   make nbody-server-gcc
+ *   ./nbody-server-gcc [socket] [workers]
+ *
+ * The socket defaults to NBODY_SOCKET or /tmp/nbody.sock, and the server
+ * runs one worker on all cores by default. Jobs are submitted with
+ * nbody-client-gcc, which also stops the server with --shutdown.
+ */
+int main (int argc, char** argv) {
+  const std::string socketPath = argc > 1 ? argv[1] : defaultSocketPath();
+  const int         workers    = argc > 2 ? std::stoi(argv[2]) : 1;
+
+  NBodyServer server(socketPath, workers);
+  return server.run();
+}
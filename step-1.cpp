@@ -1,6 +1,4 @@
-#include <iomanip>
-
-#include "NBodySimulation.h"
+#include "NBodyEngine.h"
 
 /**
  * You can compile this file with
@@ -19,29 +17,13 @@
 /**
  * Main routine.
  *
+ * The simulation itself lives in the nbody library (see NBodyEngine.h), this
+ * executable only selects the kernel.
+ *
  * No major changes are needed in the assignment. You can add initialisation or
  * or remove input checking, if you feel the need to do so. But keep in mind
  * that you may not alter what the program writes to the standard output.
  */
-#include <cmath>
-
 int main (int argc, char** argv) {
-
-  std::cout << std::setprecision(15);
-
-  // Code that initialises and runs the simulation.
-  NBodySimulation nbs;
-  nbs.setUp(argc,argv);
-  nbs.openParaviewVideoFile();
-  nbs.takeSnapshot();
-
-  while (!nbs.hasReachedEnd()) {
-    nbs.updateBody();
-    nbs.takeSnapshot();
-  }
-
-  nbs.printSummary();
-  nbs.closeParaviewVideoFile();
-
-  return 0;
+  return runCommandLineSimulation(NBodyEngine::Scalar, argc, argv);
 }
@@ -0,0 +1,90 @@
+#include <iomanip>
+#include <iostream>
+
+#include "NBodySimulationDistributed.cpp"
+
+/**
+ * You can compile this file with
+ *   make step-4-mpi   // Uses the MPI compiler wrapper mpicxx around g++.
+ * and run it with as many ranks as wanted, e.g.
+ *   mpirun -np 4 ./step-4-mpi 0.01 1.0 0.001 plummer 100000
+ * The threads per rank are set with OMP_NUM_THREADS as usual. On a single
+ * machine with fewer cores than ranks, Open MPI needs --oversubscribe.
+ *
+ * The arguments and the output are those of step 4. Rank 0 gathers the
+ * bodies for every snapshot and writes the ParaView, trajectory and
+ * diagnostics output; the other ranks write nothing.
+ */
+int main (int argc, char** argv) {
+  int provided;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+  if (provided < MPI_THREAD_FUNNELED) {
+    std::cerr << "the MPI library does not support MPI_THREAD_FUNNELED" << std::endl;
+    MPI_Abort(MPI_COMM_WORLD, -2);
+  }
+
+  int code = 0;
+  {
+    NBodySimulationDistributed simulation(MPI_COMM_WORLD);
+    const bool root = simulation.rankOf() == 0;
+
+    // Every rank sets up the whole system, but only rank 0 reports it
+    std::cout << std::setprecision(15);
+    if (!root) {
+      std::cout.setstate(std::ios::failbit);
+      std::cerr.setstate(std::ios::failbit);
+    }
+    try {
+      simulation.setUp(argc, argv);
+    }
+    catch (const NBodyError& error) {
+      std::cerr << error.what() << std::endl;
+      code = -2;
+    }
+    catch (int error) {
+      code = error;
+    }
+    std::cerr.clear();
+
+    if (code == 0) {
+      simulation.distribute();
+
+      NBodySimulation output;
+      if (root) {
+        output.readEnvironmentOptions();
+        output.openParaviewVideoFile();
+        output.openDiagnosticsFile();
+      }
+
+      simulation.evaluateDiagnostics();
+      simulation.gather(output, true);
+      if (simulation.t >= simulation.tPlot) simulation.tPlot += simulation.tPlotDelta;
+      if (root) {
+        output.takeSnapshot();
+        output.logDiagnostics();
+      }
+
+      while (!simulation.hasReachedEnd()) {
+        simulation.updateBody();
+
+        const bool snapshot = simulation.t >= simulation.tPlot;
+        simulation.gather(output, snapshot);
+        if (snapshot) simulation.tPlot += simulation.tPlotDelta;
+        if (root) {
+          output.logDiagnostics();
+          output.takeSnapshot();
+        }
+      }
+
+      simulation.gather(output, true);
+      if (root) {
+        output.printSummary();
+        output.closeDiagnosticsFile();
+        output.closeParaviewVideoFile();
+      }
+    }
+  }
+
+  MPI_Finalize();
+  return code;
+}